@@ -0,0 +1,72 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cofile.h"
+
+/*!  Round X up to a multiple of 8  */
+#define ALIGN8(X) ((((X) + 7) / 8) * 8)
+
+
+void cofileInitHeader (COFILEHEADER *header, uint32_t m, uint32_t n, uint64_t nnz, uint32_t flags) {
+  memset (header, 0, sizeof (COFILEHEADER));
+  memcpy (header -> magic, COFILE_MAGIC, COFILE_MAGIC_LEN);
+  header -> version = COFILE_VERSION;
+  header -> flags = flags;
+  header -> m = m;
+  header -> n = n;
+  header -> nnz = nnz;
+
+  return;
+}
+
+
+/*!  Calculate where each section of a file with this header starts  */
+void cofileLayout (const COFILEHEADER *header, COFILELAYOUT *layout) {
+  layout -> row_ids = ALIGN8 (sizeof (COFILEHEADER));
+  layout -> column_ids = layout -> row_ids + (uint64_t) header -> m * sizeof (uint32_t);
+  layout -> row_offsets = ALIGN8 (layout -> column_ids + (uint64_t) header -> n * sizeof (uint32_t));
+  layout -> columns = layout -> row_offsets + ((uint64_t) header -> m + 1) * sizeof (uint64_t);
+  layout -> counts = layout -> columns + header -> nnz * sizeof (uint32_t);
+  layout -> log_counts = ALIGN8 (layout -> counts + header -> nnz * sizeof (uint32_t));
+  if (header -> flags & COFILE_LOG_COUNTS) {
+    layout -> size = layout -> log_counts + header -> nnz * sizeof (double);
+  }
+  else {
+    layout -> size = layout -> log_counts;
+  }
+
+  return;
+}
+
+
+/*!  Check if the buffer starts with the magic bytes of a version 2 (or later) file  */
+bool cofileIsHeader (const void *buffer, size_t len) {
+  const COFILEHEADER *header = buffer;
+
+  if (len < sizeof (COFILEHEADER)) {
+    return false;
+  }
+
+  return (memcmp (header -> magic, COFILE_MAGIC, COFILE_MAGIC_LEN) == 0);
+}
@@ -0,0 +1,73 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Binary co-occurrence file, version 2.  All values are in the byte order
+**  of the machine that wrote the file and each section starts at a multiple
+**  of 8 bytes:
+**
+**    header        COFILEHEADER
+**    row ids       uint32_t [m]
+**    column ids    uint32_t [n]
+**    row offsets   uint64_t [m + 1]   (first pair of each row; the last is nnz)
+**    columns       uint32_t [nnz]     (w2 of each pair, row by row)
+**    counts        uint32_t [nnz]
+**    log counts    double [nnz]       (only if COFILE_LOG_COUNTS is set)
+**
+**  The row offsets, columns and log counts are used in place as the CSR
+**  arrays (cos_rows, cos_columns, cos_counts) after the file is mapped.
+*/
+
+#ifndef COFILE_H
+#define COFILE_H
+
+#include <stdint.h>
+
+/*!  First bytes of a version 2 file; legacy files start with the number of rows  */
+#define COFILE_MAGIC "PLSA-CO"
+#define COFILE_MAGIC_LEN 8
+#define COFILE_VERSION 2
+
+/*!  Flags:  the log counts section is present  */
+#define COFILE_LOG_COUNTS 0x1
+
+typedef struct cofileheader {
+  char magic[COFILE_MAGIC_LEN];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t m;
+  uint32_t n;
+  uint64_t nnz;
+} COFILEHEADER;
+
+/*!  Byte offsets of the sections of a file and its total size  */
+typedef struct cofilelayout {
+  uint64_t row_ids;
+  uint64_t column_ids;
+  uint64_t row_offsets;
+  uint64_t columns;
+  uint64_t counts;
+  uint64_t log_counts;
+  uint64_t size;
+} COFILELAYOUT;
+
+void cofileInitHeader (COFILEHEADER *header, uint32_t m, uint32_t n, uint64_t nnz, uint32_t flags);
+void cofileLayout (const COFILEHEADER *header, COFILELAYOUT *layout);
+bool cofileIsHeader (const void *buffer, size_t len);
+
+#endif
@@ -19,7 +19,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <math.h>
 #include <time.h>
+#include <limits.h>
 
 #include "PLSA_MP_Config.h"
 #if HAVE_MPI
@@ -31,170 +33,213 @@
 #include "comm.h"
 
 #if HAVE_MPI
-static void recvProbsFromOthers (INFO *info) {
-  unsigned int k = 0;  /*  Cluster position on the main processor  */
-  int result = 0;
-  unsigned int tag = 0;
-  unsigned int owner = 0;
-  MPI_Status *status = wmalloc (sizeof (MPI_Status));
+/*!  Process whose cut-off logSumsOp uses (MPI operations have no other arguments)  */
+static INFO *op_info = NULL;
 
-  if (info -> world_size == 1) {
-    return;
-  }
-
-  for (k = 0; k < info -> num_clusters; k++) {
-    owner = BLOCK_OWNER (k, info -> world_size, info -> num_clusters);
-    if (owner != 0) {
-      MSG_RECV_STATUS (info -> world_id, owner, info -> iter, TAG_PROBW1_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW1_Z, k);
-      result = MPI_Recv (info -> probw1_z_curr + (k * info -> m), (info -> m), MPI_TYPE, owner, tag, MPI_COMM_WORLD, status);
+/*!  Reduction operation that adds log values; empty sums (-HUGE_VAL) are allowed  */
+static MPI_Op log_sums_op = MPI_OP_NULL;
 
-      MSG_RECV_STATUS (info -> world_id, owner, info -> iter, TAG_PROBW2_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW2_Z, k);
-      result = MPI_Recv (info -> probw2_z_curr + (k * info -> n), (info -> n), MPI_TYPE, owner, tag, MPI_COMM_WORLD, status);
+/*!  Reductions of log sums in progress (see ireduceLogSums)  */
+static MPI_Request sums_requests[MERGE_PARTS];
+static int sums_pending = 0;
 
-      MSG_RECV_STATUS (info -> world_id, owner, info -> iter, TAG_PROBZ, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBZ, k);
-      result = MPI_Recv (&info -> probz_curr[k], 1, MPI_TYPE, owner, tag, MPI_COMM_WORLD, status);
-    }
-  }
+/*!  Exchanges of p(i|z) and p(j|z) in progress (see gatherProbs)  */
+static MPI_Request probs_requests[2];
+static int probs_pending = 0;
 
-  wfree (status);
+/*!  Number of clusters of each process and the first of them, for MPI_Iallgatherv; they must last until the exchanges are complete  */
+static int *block_counts = NULL;
+static int *block_displs = NULL;
 
-  return;
-}
+static void logSumsOp (void *in, void *inout, int *len, MPI_Datatype *type) {
+  INFO *info = op_info;
+  PROBNODE *a = in;
+  PROBNODE *b = inout;
+  signed int pos;
 
-static void sendProbsToMain (INFO *info) {
-  unsigned int k = 0;  /*  Cluster position on the main processor  */
-  unsigned int p = 0;  /*  Cluster position on the non-main processors  */
-  int result = 0;
-  unsigned int tag = 0;
-
-  for (p = 0; p < info -> block_size; p++) {
-    k = info -> block_start + p;
-
-    /*  Send p(i|z)  */
-    MSG_SEND_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBW1_Z, k);
-    tag = MSG_TAG (info -> iter, TAG_PROBW1_Z, k);
-    result = MPI_Send (info -> probw1_z_curr + (p * info -> m), (info -> m), MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD);
-
-    /*  Send p(j|z)  */
-    MSG_SEND_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBW2_Z, k);
-    tag = MSG_TAG (info -> iter, TAG_PROBW2_Z, k);
-    result = MPI_Send (info -> probw2_z_curr + (p * info -> n), (info -> n), MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD);
-
-    /*  Send p(z)  */
-    MSG_SEND_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBZ, k);
-    tag = MSG_TAG (info -> iter, TAG_PROBZ, k);
-    result = MPI_Send (&info -> probz_curr[p], 1, MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD);
+  for (pos = 0; pos < *len; pos++) {
+    logSumsEmptyInline (b[pos], a[pos]);
   }
 
   return;
 }
 
 
-static void sendProbsToOthers (INFO *info) {
-  unsigned int k = 0;  /*  Cluster position on the main processor  */
-  int result = 0;
-  unsigned int tag = 0;
-  unsigned int owner = 0;
+/*!  Gather the blocks of clusters of all processes into table, in place;
+**  each cluster is width values and process r owns the clusters
+**  [BLOCK_LOW (r), BLOCK_HIGH (r)], so the counts and displacements are
+**  in clusters  */
+static int allgatherBlocks (INFO *info, PROBNODE *table, unsigned int width, MPI_Request *request) {
+  MPI_Datatype cluster;
+  int result;
 
-  for (k = 0; k < info -> num_clusters; k++) {
-    owner = BLOCK_OWNER (k, info -> world_size, info -> num_clusters);
+  /*  A type may be freed while an operation that uses it is in progress;
+  **  block_counts and block_displs may not  */
+  MPI_Type_contiguous (width, MPI_TYPE, &cluster);
+  MPI_Type_commit (&cluster);
+  result = MPI_Iallgatherv (MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, table, block_counts, block_displs, cluster, MPI_COMM_WORLD, request);
+  MPI_Type_free (&cluster);
 
-    /*  If I am not the destination...  */
-    if (owner != info -> world_id) {
-      /*  Send p(i|z)  */
-      MSG_SEND_STATUS (info -> world_id, owner, info -> iter, TAG_PROBW1_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW1_Z, k);
-      result = MPI_Send (info -> probw1_z_curr + (k * info -> m), (info -> m), MPI_TYPE, owner, tag, MPI_COMM_WORLD);
+  return (result);
+}
 
-      /*  Send p(j|z)  */
-      MSG_SEND_STATUS (info -> world_id, owner, info -> iter, TAG_PROBW2_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW2_Z, k);
-      result = MPI_Send (info -> probw2_z_curr + (k * info -> n), (info -> n), MPI_TYPE, owner, tag, MPI_COMM_WORLD);
 
-      MSG_SEND_STATUS (info -> world_id, owner, info -> iter, TAG_PROBZ, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBZ, k);
-      result = MPI_Send (&info -> probz_curr[k], 1, MPI_TYPE, owner, tag, MPI_COMM_WORLD);
-    }
+/*!  Wait for requests, adding the time to wait_time  */
+static void waitRequests (INFO *info, MPI_Request *requests, int *pending, double *wait_time) {
+  double start;
+  int result;
+
+  if (*pending == 0) {
+    return;
   }
+  start = MPI_Wtime ();
+  result = MPI_Waitall (*pending, requests, MPI_STATUSES_IGNORE);
+  if (result != MPI_SUCCESS) {
+    fprintf (stderr, "Waiting for %d requests at %u result:  %d.\n", *pending, info -> world_id, result);
+  }
+  *wait_time += MPI_Wtime () - start;
+  *pending = 0;
 
   return;
 }
+#endif
 
 
-static void recvProbsFromMain (INFO *info) {
-  unsigned int k = 0;  /*  Cluster position on the main processor  */
-  unsigned int p = 0;  /*  Cluster position on the non-main processors  */
-  int result = 0;
-  unsigned int tag = 0;
-  unsigned int owner = 0;
-  MPI_Status *status = wmalloc (sizeof (MPI_Status));
-
-  for (k = 0; k < info -> num_clusters; k++) {
-    owner = BLOCK_OWNER (k, info -> world_size, info -> num_clusters);
-
-    /*  If the owner is me  */
-    if (owner == info -> world_id) {
-      /*  Send p(i|z)  */
-      MSG_RECV_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBW1_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW1_Z, k);
-      result = MPI_Recv (info -> probw1_z_curr + (p * info -> m), (info -> m), MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD, status);
-
-      /*  Send p(j|z)  */
-      MSG_RECV_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBW2_Z, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBW2_Z, k);
-      result = MPI_Recv (info -> probw2_z_curr + (p * info -> n), (info -> n), MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD, status);
-
-      /*  Send p(z)  */
-      MSG_RECV_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBZ, k);
-      tag = MSG_TAG (info -> iter, TAG_PROBZ, k);
-      result = MPI_Recv (&info -> probz_curr[p], 1, MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD, status);
-      p++;
+/*!  Create the reduction operation of ireduceLogSums and the block sizes of gatherProbs  */
+void initComm (INFO *info) {
+#if HAVE_MPI
+  signed int r;
+
+  if (info -> world_size > 1) {
+    op_info = info;
+    /*  Not commutative, so that the partial sums are always added in the
+    **  order of the processes and every process gets the same result  */
+    MPI_Op_create (logSumsOp, 0, &log_sums_op);
+
+    block_counts = wmalloc (info -> world_size * sizeof (int));
+    block_displs = wmalloc (info -> world_size * sizeof (int));
+    for (r = 0; r < info -> world_size; r++) {
+      block_counts[r] = BLOCK_SIZE (r, info -> world_size, info -> num_clusters);
+      block_displs[r] = BLOCK_LOW (r, info -> world_size, info -> num_clusters);
     }
   }
-
-  wfree (status);
+#endif
 
   return;
 }
-#else
-static void recvProbsFromOthers (INFO *info) {
+
+
+void freeComm (INFO *info) {
+#if HAVE_MPI
+  waitProbs (info);
+  if (log_sums_op != MPI_OP_NULL) {
+    MPI_Op_free (&log_sums_op);
+  }
+  if (block_counts != NULL) {
+    wfree (block_counts);
+    wfree (block_displs);
+  }
+#endif
+
   return;
 }
 
-static void sendProbsToMain (INFO *info) {
+
+/*!  Start adding the log values of all processes, cell by cell; every
+**  process receives the sums after waitLogSums.  Reductions already in
+**  progress are given the chance to move on.  MPI counts are ints, so
+**  more than INT_MAX values are reduced in pieces  */
+void ireduceLogSums (INFO *info, PROBNODE *values, size_t count) {
+#if HAVE_MPI
+  size_t piece;
+  int result;
+  int done;
+
+  while (count > 0) {
+    piece = (count > INT_MAX) ? INT_MAX : count;
+    if (sums_pending == MERGE_PARTS) {
+      waitLogSums (info, &(info -> waitMerge_time));
+    }
+    result = MPI_Iallreduce (MPI_IN_PLACE, values, (int) piece, MPI_TYPE, log_sums_op, MPI_COMM_WORLD, &sums_requests[sums_pending]);
+    if (result != MPI_SUCCESS) {
+      fprintf (stderr, "Reducing log values at %u result:  %d.\n", info -> world_id, result);
+    }
+    sums_pending++;
+    values += piece;
+    count -= piece;
+  }
+  (void) MPI_Testall (sums_pending, sums_requests, &done, MPI_STATUSES_IGNORE);
+#endif
+
   return;
 }
 
 
-static void sendProbsToOthers (INFO *info) {
+/*!  Wait for the reductions started by ireduceLogSums, adding the time to wait_time  */
+void waitLogSums (INFO *info, double *wait_time) {
+#if HAVE_MPI
+  waitRequests (info, sums_requests, &sums_pending, wait_time);
+#endif
+
   return;
 }
 
 
-static void recvProbsFromMain (INFO *info) {
+/*!  Wait for the exchange of p(i|z) and p(j|z) started by gatherProbs;
+**  needed before the clusters of other processes are used  */
+void waitProbs (INFO *info) {
+#if HAVE_MPI
+  waitRequests (info, probs_requests, &probs_pending, &(info -> waitGather_time));
+#endif
+
   return;
 }
+
+
+/*!  The log likelihood of all processes at MAINPROC, given that of this
+**  process; with the clusters divided, MAINPROC already has all of it  */
+PROBNODE gatherML (INFO *info, PROBNODE ml) {
+#if HAVE_MPI
+  PROBNODE total = 0.0;
+
+  if ((info -> world_size > 1) && (info -> decompose == DECOMPOSE_ROWS)) {
+    MPI_Reduce (&ml, &total, 1, MPI_TYPE, MPI_SUM, MAINPROC, MPI_COMM_WORLD);
+    return (total);
+  }
 #endif
 
-/*!  MAINPROC sends the initialized (*current*) p(i|z), p(j|z), and p(z) to all other processes  */
+  return (ml);
+}
+
+
+/*!  MAINPROC sends the initialized (*current*) p(i|z), p(j|z), and p(z) to
+**  all other processes; not needed if the rows are divided, as every
+**  process then initializes its own rows  */
 void distributeProbs (INFO *info) {
+#if HAVE_MPI
+  MPI_Datatype row;
+  MPI_Datatype column;
+#endif
   time_t start;
   time_t end;
 
   time (&start);
-  if (info -> world_size == 1) {
+  if ((info -> world_size == 1) || (info -> decompose == DECOMPOSE_ROWS)) {
     return;
   }
 
-  if (info -> world_id == MAINPROC) {
-    sendProbsToOthers (info);
-  }
-  else {
-    recvProbsFromMain (info);
-  }
+#if HAVE_MPI
+  /*  Sent as one value per cluster, so that the count fits in an int  */
+  MPI_Type_contiguous (info -> m, MPI_TYPE, &row);
+  MPI_Type_commit (&row);
+  MPI_Type_contiguous (info -> n, MPI_TYPE, &column);
+  MPI_Type_commit (&column);
+  MPI_Bcast (info -> probw1_z_curr, info -> num_clusters, row, MAINPROC, MPI_COMM_WORLD);
+  MPI_Bcast (info -> probw2_z_curr, info -> num_clusters, column, MAINPROC, MPI_COMM_WORLD);
+  MPI_Bcast (info -> probz_curr, info -> num_clusters, MPI_TYPE, MAINPROC, MPI_COMM_WORLD);
+  MPI_Type_free (&row);
+  MPI_Type_free (&column);
+#endif
   time (&end);
   info -> distributeProbs_time += difftime (end, start);
 
@@ -202,8 +247,23 @@ void distributeProbs (INFO *info) {
 }
 
 
-/*!  All other processes send the *current* p(i|z), p(j|z), and p(z) to MAINPROC  */
+/*!  Combine *current* p(i|z), p(j|z), and p(z) of all processes.
+**
+**  With the clusters divided, each process contributes the block of
+**  clusters it owns and receives those of all others.  Only p(z) is
+**  needed at once (by normalizeProbZ); the EM steps of a process only use
+**  its own clusters, so p(i|z) and p(j|z) are exchanged while the next
+**  iteration is calculated, and waitProbs must be called before the
+**  clusters of other processes are used (as by printCoProb).
+**
+**  With the rows divided, each process holds p(i|z) of its own rows, and
+**  its sums of p(j|z) and p(z) over them are added to those of all others  */
 void gatherProbs (INFO *info) {
+#if HAVE_MPI
+  MPI_Request request;
+  int result;
+  int pending = 1;
+#endif
   time_t start;
   time_t end;
 
@@ -212,15 +272,31 @@ void gatherProbs (INFO *info) {
     return;
   }
 
-  if (info -> world_id == MAINPROC) {
-    recvProbsFromOthers (info);
+#if HAVE_MPI
+  if (info -> decompose == DECOMPOSE_ROWS) {
+    ireduceLogSums (info, info -> probw2_z_curr, (size_t) info -> num_clusters * info -> n);
+    ireduceLogSums (info, info -> probz_curr, info -> num_clusters);
+    waitLogSums (info, &(info -> waitGather_time));
   }
   else {
-    sendProbsToMain (info);
+    /*  The previous exchange (of what is now *previous*) must be complete  */
+    waitProbs (info);
+    result = allgatherBlocks (info, info -> probw1_z_curr, info -> m, &probs_requests[0]);
+    if (result == MPI_SUCCESS) {
+      result = allgatherBlocks (info, info -> probw2_z_curr, info -> n, &probs_requests[1]);
+    }
+    probs_pending = 2;
+    if (result == MPI_SUCCESS) {
+      result = allgatherBlocks (info, info -> probz_curr, 1, &request);
+    }
+    if (result != MPI_SUCCESS) {
+      fprintf (stderr, "Gathering probabilities at %u result:  %d.\n", info -> world_id, result);
+    }
+    waitRequests (info, &request, &pending, &(info -> waitGather_time));
   }
+#endif
   time (&end);
   info -> gatherProbs_time += difftime (end, start);
 
   return;
 }
-
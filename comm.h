@@ -19,6 +19,12 @@
 #ifndef COMM_H
 #define COMM_H
 
+void initComm (INFO *info);
+void freeComm (INFO *info);
+void ireduceLogSums (INFO *info, PROBNODE *values, size_t count);
+void waitLogSums (INFO *info, double *wait_time);
+void waitProbs (INFO *info);
+PROBNODE gatherML (INFO *info, PROBNODE ml);
 void distributeProbs (INFO *info);
 void gatherProbs (INFO *info);
 
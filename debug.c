@@ -38,15 +38,13 @@ void handler_sigfpe () {
 /*  Used by input.c  */
 void debugCheckCo (INFO *info) {
   unsigned int j = 0;
-  unsigned int cos_count = 0;
   unsigned int curr_j;
 
   /*  Check flags in co-occurrence table  */
   for (unsigned int i = 0; i < info -> m; i++) {
-    cos_count = GET_COS_POSITION (i, 0);
     curr_j = 0;
-    for (unsigned int pos_j = 1; pos_j <= cos_count; pos_j++) {
-      j = GET_COS_POSITION (i, pos_j);
+    for (size_t pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+      j = GET_COS_POSITION (pos);
       while (curr_j < j) {
         fprintf (stderr, "X");
         curr_j++;
@@ -100,8 +98,8 @@ void checkCoProb (INFO *info) {
 
 
 void printAllProbsPrev (INFO *info) {
-  unsigned int i = 0;
-  unsigned int count = 0;
+  size_t i = 0;
+  size_t count = 0;
 
   if ((info -> world_size > 1) && (info -> world_id == MAINPROC)) {
     return;
@@ -109,7 +107,7 @@ void printAllProbsPrev (INFO *info) {
 
   count = 0;
   fprintf (stderr, "\n[%u] P[%u] ===== p(w1|z) =====\n", info -> world_id, info -> iter);
-  for (i = 0; i < (info -> num_clusters * info -> m); i++) {
+  for (i = 0; i < ((size_t) info -> num_clusters * info -> m); i++) {
     fprintf (stderr, "%f", info -> probw1_z_prev[i]);
     count++;
     if ((count % info -> m) == 0) {
@@ -122,7 +120,7 @@ void printAllProbsPrev (INFO *info) {
 
   count = 0;
   fprintf (stderr, "\n[%u] P[%u] ===== p(w2|z) =====\n", info -> world_id, info -> iter);
-  for (i = 0; i < (info -> num_clusters * info -> n); i++) {
+  for (i = 0; i < ((size_t) info -> num_clusters * info -> n); i++) {
     fprintf (stderr, "%f", info -> probw2_z_prev[i]);
     count++;
     if ((count % info -> n) == 0) {
@@ -145,8 +143,8 @@ void printAllProbsPrev (INFO *info) {
 
 
 void printAllProbsCurr (INFO *info) {
-  unsigned int i = 0;
-  unsigned int count = 0;
+  size_t i = 0;
+  size_t count = 0;
 
   if ((info -> world_size > 1) && (info -> world_id == MAINPROC)) {
     return;
@@ -154,7 +152,7 @@ void printAllProbsCurr (INFO *info) {
 
   count = 0;
   fprintf (stderr, "\n[%u] C[%u] ===== p(w1|z) =====\n", info -> world_id, info -> iter);
-  for (i = 0; i < (info -> num_clusters * info -> m); i++) {
+  for (i = 0; i < ((size_t) info -> num_clusters * info -> m); i++) {
     fprintf (stderr, "%f", info -> probw1_z_curr[i]);
     count++;
     if ((count % info -> m) == 0) {
@@ -167,7 +165,7 @@ void printAllProbsCurr (INFO *info) {
 
   count = 0;
   fprintf (stderr, "\n[%u] C[%u] ===== p(w2|z) =====\n", info -> world_id, info -> iter);
-  for (i = 0; i < (info -> num_clusters * info -> n); i++) {
+  for (i = 0; i < ((size_t) info -> num_clusters * info -> n); i++) {
     fprintf (stderr, "%f", info -> probw2_z_curr[i]);
     count++;
     if ((count % info -> n) == 0) {
@@ -191,11 +189,11 @@ void printAllProbsCurr (INFO *info) {
 
 void printJointProb (INFO *info) {
   unsigned int i = 0;
-  unsigned int j = 0;
+  size_t pos = 0;
 
   for (i = 0; i < info -> m; i++) {
-    for (j = 0; j < info -> n; j++) {
-      fprintf (stderr, "[%f]\t", info -> prob_w1w2[i * info -> n + j]);
+    for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+      fprintf (stderr, "[%u: %f]\t", GET_COS_POSITION (pos), GET_PROB_W1W2 (pos));
     }
     fprintf (stderr, "\n");
   }
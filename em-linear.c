@@ -0,0 +1,494 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Linear-space versions of the EM steps (--linear).
+**
+**  The probability tables remain in log-space; only the inner loops work
+**  with linear values.  Underflow is avoided by scaling:
+**    -  each cluster k of P(w2|z) is shifted by its maximum, b_k, so that
+**       its largest linear value is 1;
+**    -  each row i is shifted by s_i, the maximum over k of
+**       P(z) + P(w1|z) + b_k (as logs), so that its largest weight is 1.
+**  Then, for a pair (i, j),
+**    log p(i,j) = s_i + log (sum_k r_k(i) * q_k(j))
+**  where r_k(i) = exp (P(z) + P(w1|z) + b_k - s_i) and
+**  q_k(j) = exp (P(w2|z) - b_k).  The sum is a plain multiply-add and only
+**  one exp is needed per (row, cluster) instead of per (pair, cluster).
+**
+**  The linear tables are cluster-minor (q is [w2][k]) with the cluster
+**  dimension padded with zeroes to a multiple of KERNEL_WIDTH, so that the
+**  sums over k for each pair are done by the kernels in kernels.c.
+**
+**  A pair whose sum underflows is recomputed in log-space.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "comm.h"
+#include "em-steps.h"
+#include "em-linear.h"
+
+/*!  Convert a linear sum back to log-space; cells that received nothing are given the minimum probability  */
+#define LINEAR_TO_LOG(X) (((X) > 0.0) ? log (X) : log (MIN_PROB))
+
+/*!  Convert a linear sum back to log-space, as an empty sum (-HUGE_VAL) if it received nothing (see normalizeProbs)  */
+#define LINEAR_TO_EMPTY(X) (((X) > 0.0) ? log (X) : -HUGE_VAL)
+
+/*!  Create the shifted linear P(w2|z) table (q) of the given clusters as [w2][KERNEL_PAD (clusters)], with the shift of each cluster in shift  */
+void linearProbW2Z (INFO *info, PROBNODE *probw2_z, unsigned int clusters, PROBNODE *q, PROBNODE *shift) {
+  unsigned int kpad = KERNEL_PAD (clusters);
+  signed int k;  /*  Index into clusters  */
+  signed int j;  /*  Index into w2  */
+  PROBNODE max;
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(j,max)
+#endif
+  for (k = 0; k < clusters; k++) {
+    max = probw2_z[(size_t) k * info -> n];
+    for (j = 1; j < info -> n; j++) {
+      if (probw2_z[(size_t) k * info -> n + j] > max) {
+        max = probw2_z[(size_t) k * info -> n + j];
+      }
+    }
+    shift[k] = max;
+  }
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(k)
+#endif
+  for (j = 0; j < info -> n; j++) {
+    for (k = 0; k < clusters; k++) {
+      q[(size_t) j * kpad + k] = exp (probw2_z[(size_t) k * info -> n + j] - shift[k]);
+    }
+    for (k = clusters; k < kpad; k++) {
+      q[(size_t) j * kpad + k] = 0.0;
+    }
+  }
+
+  return;
+}
+
+
+/*!  Calculate the weights r of row i for the given clusters, padded with zeroes to KERNEL_PAD (clusters); returns the row shift s_i  */
+PROBNODE linearRowWeights (INFO *info, PROBNODE *probw1_z, PROBNODE *probz, unsigned int clusters, PROBNODE *shift, unsigned int i, PROBNODE *r) {
+  unsigned int kpad = KERNEL_PAD (clusters);
+  unsigned int k;  /*  Index into clusters  */
+  PROBNODE max;
+
+  max = -HUGE_VAL;
+  for (k = 0; k < clusters; k++) {
+    r[k] = probz[k] + probw1_z[(size_t) k * info -> m + i] + shift[k];
+    if (r[k] > max) {
+      max = r[k];
+    }
+  }
+
+  /*  The row has no mass at all  */
+  if (isinf (max)) {
+    for (k = 0; k < kpad; k++) {
+      r[k] = 0.0;
+    }
+    return (max);
+  }
+
+  for (k = 0; k < clusters; k++) {
+    r[k] = exp (r[k] - max);
+  }
+  for (k = clusters; k < kpad; k++) {
+    r[k] = 0.0;
+  }
+
+  return (max);
+}
+
+
+/*!  Calculate log p(i,j) over the given clusters in log-space; used when the linear sum underflows  */
+static PROBNODE logProbW1W2 (INFO *info, PROBNODE *probw1_z, PROBNODE *probw2_z, PROBNODE *probz, unsigned int clusters, unsigned int i, unsigned int j) {
+  unsigned int k;  /*  Index into clusters  */
+  PROBNODE temp;
+
+  temp = probz[0] + probw1_z[i] + probw2_z[j];
+  for (k = 1; k < clusters; k++) {
+    logSumsInline (temp, (probz[k] + probw1_z[(size_t) k * info -> m + i] + probw2_z[(size_t) k * info -> n + j]));
+  }
+
+  return (temp);
+}
+
+
+/*!  Calculate log p(i,j) of the pairs of rows [first, last) over the given clusters and place it in result;
+**  the shifted linear P(w2|z) of the clusters must be in work.q and work.shift  */
+static void linearPairs (INFO *info, PROBNODE *probw1_z, PROBNODE *probw2_z, PROBNODE *probz, unsigned int clusters, unsigned int first, unsigned int last, PROBNODE *result) {
+  unsigned int kpad = KERNEL_PAD (clusters);
+  PROBNODE *q = info -> work.q;
+  PROBNODE *shift = info -> work.shift;
+  signed int i;  /*  Index into w1  */
+
+#if HAVE_OPENMP
+#pragma omp parallel
+#endif
+  {
+    PROBNODE *r;
+    PROBNODE s;
+    PROBNODE sum;
+    unsigned int j;  /*  Index into w2  */
+    size_t pos;  /*  Actual position in the cooccurrence arrays  */
+
+#if HAVE_OPENMP
+    r = WORK_VECTOR (omp_get_thread_num (), 0);
+#else
+    r = WORK_VECTOR (0, 0);
+#endif
+
+#if HAVE_OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+    for (i = first; i < last; i++) {
+      s = linearRowWeights (info, probw1_z, probz, clusters, shift, i, r);
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        j = GET_COS_POSITION (pos);
+        sum = info -> kernels.dot (r, q + (size_t) j * kpad, kpad);
+        if (sum > 0.0) {
+          result[pos] = s + log (sum);
+        }
+        else {
+          result[pos] = logProbW1W2 (info, probw1_z, probw2_z, probz, clusters, i, j);
+        }
+      }
+    }
+  }
+
+  return;
+}
+
+
+void calculateProbW1W2Linear (INFO *info) {
+  unsigned int base = info -> block_start;  /*  First cluster of this process  */
+  PROBNODE *probw1_z = info -> probw1_z_curr + (size_t) base * info -> m;
+  PROBNODE *probw2_z = info -> probw2_z_curr + (size_t) base * info -> n;
+  PROBNODE *probz = info -> probz_curr + base;
+  unsigned int parts = mergeParts (info);
+  unsigned int part;
+  unsigned int first;
+  unsigned int last;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  linearProbW2Z (info, probw2_z, info -> block_size, info -> work.q, info -> work.shift);
+
+  /*  Each part of the rows is sent to the other processes as soon as it is done  */
+  for (part = 0; part < parts; part++) {
+    rowsByNnz (info, parts, part, &first, &last);
+    linearPairs (info, probw1_z, probw2_z, probz, info -> block_size, first, last, info -> prob_w1w2);
+    mergeProbW1W2 (info, first, last);
+  }
+
+  /*  Combine the partial sums of all processes  */
+  waitLogSums (info, &(info -> waitMerge_time));
+
+  time (&end);
+  info -> calculateProbW1W2_time += difftime (end, start);
+
+  return;
+}
+
+
+/*!  E and M steps from *previous* into *current*.  If fused, p(w1,w2) of
+**  *previous* is calculated in the same sweep instead of being read, and the
+**  log likelihood is returned  */
+static PROBNODE linearEMStep (INFO *info, bool fused) {
+  unsigned int m = info -> m;
+  unsigned int n = info -> n;
+  unsigned int block_size = info -> block_size;
+  unsigned int base = info -> block_start;  /*  First cluster of this process  */
+  unsigned int kpad = KERNEL_PAD (block_size);
+  PROBNODE *w1_prev = info -> probw1_z_prev + (size_t) base * m;  /*  *previous* of the clusters of this process  */
+  PROBNODE *w2_prev = info -> probw2_z_prev + (size_t) base * n;
+  PROBNODE *z_prev = info -> probz_prev + base;
+  PROBNODE *q = info -> work.q;
+  PROBNODE *shift = info -> work.shift;
+  PROBNODE *row_shift = info -> work.row_shift;
+  PROBNODE *factor = info -> work.factor;
+  size_t width = info -> work.width;
+  PROBNODE *acc_w2 = info -> work.w2;  /*  Linear P(w2|z) sums as [w2][k]  */
+  PROBNODE *acc_z = info -> work.z;  /*  One copy per thread with --estep rows  */
+  PROBNODE total = 0.0;
+  signed int i;  /*  Index into w1  */
+  signed int j;  /*  Index into w2  */
+  signed int k;  /*  Index into clusters, local to this processor  */
+  size_t pos;  /*  Actual position in the cooccurrence arrays  */
+
+  linearProbW2Z (info, w2_prev, block_size, q, shift);
+
+  /*******************************************************/
+  /*  For each pair, P(z|w1,w2) * count = factor * r_k(i) * q_k(j), where factor
+  **  only depends on the pair; factor is 0 if the pair must be done in log-space  */
+
+#if HAVE_OPENMP
+#pragma omp parallel reduction(+:total)
+#endif
+  {
+    PROBNODE *weights;
+    PROBNODE f;
+    PROBNODE sum;
+
+#if HAVE_OPENMP
+    weights = WORK_VECTOR (omp_get_thread_num (), 0);
+#else
+    weights = WORK_VECTOR (0, 0);
+#endif
+
+#if HAVE_OPENMP
+#pragma omp for private(pos,j,sum) schedule(dynamic, 64)
+#endif
+    for (i = 0; i < m; i++) {
+      row_shift[i] = linearRowWeights (info, w1_prev, z_prev, block_size, shift, i, weights);
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        if (fused) {
+          j = GET_COS_POSITION (pos);
+          sum = info -> kernels.dot (weights, q + (size_t) j * kpad, kpad);
+          if (sum > 0.0) {
+            GET_PROB_W1W2 (pos) = row_shift[i] + log (sum);
+          }
+          else {
+            GET_PROB_W1W2 (pos) = logProbW1W2 (info, w1_prev, w2_prev, z_prev, block_size, i, j);
+          }
+          total += (GET_PROB_W1W2 (pos) * exp (GET_COS (pos)));
+        }
+        f = exp (GET_COS (pos) + row_shift[i] - GET_PROB_W1W2 (pos));
+        factor[pos] = (isfinite (f)) ? f : 0.0;
+      }
+    }
+  }
+
+  /*******************************************************/
+  /*  Accumulate linear sums.  With --estep rows, each thread takes the rows
+  **  with its share of the co-occurrences and sums P(w2|z) and P(z) into its
+  **  own copy (of P(w2|z), only of the columns of its rows); otherwise, each
+  **  thread takes a slice of the padded clusters (a multiple of KERNEL_WIDTH)
+  **  of every row.  The kernels work across the thread's clusters  */
+
+#if HAVE_OPENMP
+#pragma omp parallel num_threads(info -> work.threads) private(i,j,k,pos)
+#endif
+  {
+    PROBNODE *r;
+    PROBNODE *row;
+    PROBNODE *extra;
+    PROBNODE *my_w2 = acc_w2;
+    PROBNODE *my_z = acc_z;
+    PROBNODE *copy;
+    unsigned int me = 0;
+    unsigned int team = 1;
+    unsigned int parts;
+    unsigned int part;
+    unsigned int first = 0;
+    unsigned int last_row = m;
+    unsigned int lo = 0;
+    unsigned int hi = kpad;
+    unsigned int last;
+    unsigned int t;
+    size_t stride = kpad;  /*  Between the columns of my_w2  */
+    size_t c;
+    size_t slot;
+    PROBNODE post;
+    PROBNODE sum;
+#if HAVE_OPENMP
+    me = omp_get_thread_num ();
+    team = omp_get_num_threads ();
+#endif
+    r = WORK_VECTOR (me, 0);
+    row = WORK_VECTOR (me, 1);
+    extra = WORK_VECTOR (me, 2);
+
+    /*  The copies of --estep rows were made for work.threads threads; should
+    **  the team be smaller, a thread takes several parts  */
+    parts = (info -> estep == ESTEP_ROWS) ? info -> work.threads : team;
+    for (part = me; part < parts; part += team) {
+      if (info -> estep == ESTEP_ROWS) {
+        rowsByNnz (info, parts, part, &first, &last_row);
+        stride = width;
+        my_w2 = info -> work.copies + info -> work.copy_starts[part] * width;
+        my_z = acc_z + part * kpad;
+        memset (my_w2, 0, (info -> work.copy_starts[part + 1] - info -> work.copy_starts[part]) * width * sizeof (PROBNODE));
+        memset (my_z, 0, kpad * sizeof (PROBNODE));
+      }
+      else {
+        lo = BLOCK_LOW (me, team, kpad / KERNEL_WIDTH) * KERNEL_WIDTH;
+        hi = BLOCK_LOW (me + 1, team, kpad / KERNEL_WIDTH) * KERNEL_WIDTH;
+        if (lo < hi) {
+          for (j = 0; j < n; j++) {
+            memset (acc_w2 + (size_t) j * kpad + lo, 0, (hi - lo) * sizeof (PROBNODE));
+          }
+          memset (acc_z + lo, 0, (hi - lo) * sizeof (PROBNODE));
+        }
+      }
+      last = (hi < block_size) ? hi : block_size;
+
+      if (lo < hi) {
+        for (i = first; i < last_row; i++) {
+          for (k = lo; k < hi; k++) {
+            r[k] = (k < block_size) ? exp (GET_PROBZ_PREV (base + k) + GET_PROBW1_Z_PREV (base + k, i) + shift[k] - row_shift[i]) : 0.0;
+            row[k] = 0.0;
+            extra[k] = 0.0;
+          }
+
+          for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+            j = GET_COS_POSITION (pos);
+            slot = (info -> estep == ESTEP_ROWS) ? info -> work.pair_slots[pos] : (size_t) j;
+            if (factor[pos] != 0.0) {
+              info -> kernels.scatter (my_w2 + slot * stride + lo, row + lo, q + (size_t) j * kpad + lo, r + lo, factor[pos], hi - lo);
+            }
+            else {
+              for (k = lo; k < last; k++) {
+                post = exp (GET_COS (pos) + GET_PROBZ_W1W2_PREV (base + k, i, j) - GET_PROB_W1W2 (pos));
+                extra[k] += post;
+                my_w2[slot * stride + k] += post;
+              }
+            }
+          }
+
+          /*  probw1_z and probz; the row's sum is r_k(i) * sum (factor * q_k(j))  */
+          for (k = lo; k < last; k++) {
+            sum = r[k] * row[k] + extra[k];
+            GET_PROBW1_Z_CURR (base + k, i) = LINEAR_TO_LOG (sum);
+            my_z[k] += sum;
+          }
+        }
+      }
+    }
+
+    /*  Add the copies of the threads that have each column into acc_w2, and
+    **  those of P(z) into the first  */
+    if (info -> estep == ESTEP_ROWS) {
+#if HAVE_OPENMP
+#pragma omp barrier
+#pragma omp for
+#endif
+      for (j = 0; j < n; j++) {
+        memset (acc_w2 + (size_t) j * kpad, 0, kpad * sizeof (PROBNODE));
+        for (c = info -> work.column_starts[j]; c < info -> work.column_starts[j + 1]; c++) {
+          copy = info -> work.copies + info -> work.column_slots[c] * width;
+          for (k = 0; k < kpad; k++) {
+            acc_w2[(size_t) j * kpad + k] += copy[k];
+          }
+        }
+      }
+#if HAVE_OPENMP
+#pragma omp single
+#endif
+      for (k = 0; k < kpad; k++) {
+        for (t = 1; t < parts; t++) {
+          acc_z[k] += acc_z[t * kpad + k];
+        }
+      }
+    }
+  }
+
+  /*******************************************************/
+  /*  Back to log-space in *current*  */
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(j)
+#endif
+  for (k = 0; k < block_size; k++) {
+    GET_PROBZ_CURR (base + k) = LINEAR_TO_EMPTY (acc_z[k]);
+    for (j = 0; j < n; j++) {
+      GET_PROBW2_Z_CURR (base + k, j) = LINEAR_TO_EMPTY (acc_w2[(size_t) j * kpad + k]);
+    }
+  }
+
+  return (total);
+}
+
+
+void applyEMStepLinear (INFO *info) {
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  linearEMStep (info, false);
+
+  time (&end);
+  info -> applyEMStep_time += difftime (end, start);
+
+  return;
+}
+
+
+/*!  Linear-space version of applyEMStepFused  */
+PROBNODE applyEMStepLinearFused (INFO *info) {
+  PROBNODE total;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  total = linearEMStep (info, true);
+
+  time (&end);
+  info -> applyEMStep_time += difftime (end, start);
+
+  return (total);
+}
+
+
+/*!  Calculate log p(i,j) of every column of row i over all clusters in linear-space; q and shift are from linearProbW2Z and r is space for the row weights  */
+void linearRowProbs (INFO *info, PROBNODE *q, PROBNODE *shift, PROBNODE *r, unsigned int i, PROBNODE *result) {
+  unsigned int num_clusters = info -> num_clusters;
+  unsigned int kpad = KERNEL_PAD (num_clusters);
+  unsigned int j;  /*  Index into w2  */
+  PROBNODE s;
+  PROBNODE sum;
+
+  s = linearRowWeights (info, info -> probw1_z_curr, info -> probz_curr, num_clusters, shift, i, r);
+
+  for (j = 0; j < info -> n; j++) {
+    sum = info -> kernels.dot (r, q + (size_t) j * kpad, kpad);
+    if (sum > 0.0) {
+      result[j] = s + log (sum);
+    }
+    else {
+      result[j] = logProbW1W2 (info, info -> probw1_z_curr, info -> probw2_z_curr, info -> probz_curr, num_clusters, i, j);
+    }
+  }
+
+  return;
+}
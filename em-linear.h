@@ -0,0 +1,29 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EM_LINEAR_H
+#define EM_LINEAR_H
+
+void linearProbW2Z (INFO *info, PROBNODE *probw2_z, unsigned int clusters, PROBNODE *q, PROBNODE *shift);
+PROBNODE linearRowWeights (INFO *info, PROBNODE *probw1_z, PROBNODE *probz, unsigned int clusters, PROBNODE *shift, unsigned int i, PROBNODE *r);
+void linearRowProbs (INFO *info, PROBNODE *q, PROBNODE *shift, PROBNODE *r, unsigned int i, PROBNODE *result);
+void calculateProbW1W2Linear (INFO *info);
+void applyEMStepLinear (INFO *info);
+PROBNODE applyEMStepLinearFused (INFO *info);
+
+#endif
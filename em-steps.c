@@ -29,8 +29,14 @@
 #include <mpi.h>
 #endif
 
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
 #include "wmalloc.h"
 #include "plsa-defn.h"
+#include "comm.h"
+#include "model.h"
 #include "em-steps.h"
 
 
@@ -61,12 +67,267 @@ void swapPrevCurr (INFO *info) {
 }
 
 
+/*!  With --estep rows, each thread adds P(w2|z) of its rows into its own
+**  copy, which has only the columns of those rows:  pair_slots gives the
+**  place of the column of each pair in it.  The copies that hold each
+**  column are listed in thread order, so that they are added in the same
+**  order as copies of all columns would be.  Returns false, with nothing
+**  allocated, if the copies need more than ESTEP_COPIES_LIMIT times the
+**  memory of P(w1|z) and P(w2|z)  */
+static bool initCopies (INFO *info) {
+  WORKSPACE *work = &(info -> work);
+  unsigned int n = info -> n;
+  unsigned int *stamp;  /*  Last thread (plus 1) with each column  */
+  unsigned int *local;  /*  Slot of each column in the copy of that thread  */
+  size_t *fill;
+  size_t slots = 0;
+  unsigned int pass;
+  unsigned int first;
+  unsigned int last;
+  unsigned int t;
+  unsigned int i;  /*  Index into w1  */
+  unsigned int j;  /*  Index into w2  */
+  size_t pos;
+
+  stamp = wmalloc (n * sizeof (unsigned int) + 1);
+  local = wmalloc (n * sizeof (unsigned int) + 1);
+  work -> pair_slots = wmalloc (info -> nnz * sizeof (unsigned int) + 1);
+  work -> copy_starts = wmalloc ((work -> threads + 1) * sizeof (size_t));
+  work -> column_starts = wmalloc ((n + 1) * sizeof (size_t));
+  work -> column_slots = NULL;
+  fill = work -> column_starts;
+  for (j = 0; j <= n; j++) {
+    fill[j] = 0;
+  }
+
+  /*  The first pass finds the slots and counts the copies of each column;
+  **  the second lists them  */
+  for (pass = 0; pass < 2; pass++) {
+    for (j = 0; j < n; j++) {
+      stamp[j] = 0;
+    }
+    slots = 0;
+    for (t = 0; t < work -> threads; t++) {
+      work -> copy_starts[t] = slots;
+      rowsByNnz (info, work -> threads, t, &first, &last);
+      for (i = first; i < last; i++) {
+        for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+          j = GET_COS_POSITION (pos);
+          if (stamp[j] != t + 1) {
+            stamp[j] = t + 1;
+            local[j] = slots - work -> copy_starts[t];
+            if (pass == 0) {
+              fill[j + 1]++;
+            }
+            else {
+              work -> column_slots[fill[j]++] = slots;
+            }
+            slots++;
+          }
+          work -> pair_slots[pos] = local[j];
+        }
+      }
+    }
+    work -> copy_starts[work -> threads] = slots;
+
+    if (pass == 0) {
+      if ((double) slots * work -> width > ESTEP_COPIES_LIMIT * info -> num_clusters * ((double) info -> m + n)) {
+        wfree (stamp);
+        wfree (local);
+        wfree (work -> pair_slots);
+        wfree (work -> copy_starts);
+        wfree (work -> column_starts);
+        work -> pair_slots = NULL;
+        work -> copy_starts = NULL;
+        work -> column_starts = NULL;
+        if (info -> world_id == MAINPROC) {
+          fprintf (stderr, "==\tWarning:  The copies of p(w2|z) of --estep rows would need %.1f MB; dividing the E and M steps by clusters instead.\n", (double) slots * work -> width * sizeof (PROBNODE) / (1024 * 1024));
+        }
+        return false;
+      }
+      for (j = 0; j < n; j++) {
+        fill[j + 1] += fill[j];
+      }
+      work -> column_slots = wmalloc (slots * sizeof (size_t) + 1);
+      fill = wmalloc ((n + 1) * sizeof (size_t));
+      memcpy (fill, work -> column_starts, (n + 1) * sizeof (size_t));
+    }
+  }
+  work -> copies = wmalloc (slots * work -> width * sizeof (PROBNODE) + 1);
+
+  wfree (fill);
+  wfree (stamp);
+  wfree (local);
+
+  return true;
+}
+
+
+/*!  Allocate the work space of the EM steps once for the whole run, so
+**  that nothing is allocated during the iterations  */
+void initWorkspace (INFO *info) {
+  WORKSPACE *work = &(info -> work);
+  unsigned int copies;
+
+  work -> threads = 1;
+#if HAVE_OPENMP
+  work -> threads = omp_get_max_threads ();
+#endif
+  work -> width = KERNEL_PAD (info -> num_clusters);
+
+  work -> copies = NULL;
+  work -> copy_starts = NULL;
+  work -> pair_slots = NULL;
+  work -> column_starts = NULL;
+  work -> column_slots = NULL;
+  if ((info -> estep == ESTEP_ROWS) && (!initCopies (info))) {
+    info -> estep = ESTEP_CLUSTERS;
+  }
+  copies = (info -> estep == ESTEP_ROWS) ? work -> threads : 1;
+
+  work -> w2 = NULL;
+  if (info -> linear) {
+    work -> w2 = wmalloc ((size_t) work -> width * info -> n * sizeof (PROBNODE));
+  }
+  work -> z = wmalloc ((size_t) copies * work -> width * sizeof (PROBNODE));
+  work -> vectors = wmalloc ((size_t) work -> threads * WORK_VECTORS * work -> width * sizeof (PROBNODE));
+
+  work -> q = NULL;
+  work -> shift = NULL;
+  work -> row_shift = NULL;
+  work -> factor = NULL;
+  if (info -> linear) {
+    work -> q = wmalloc ((size_t) work -> width * info -> n * sizeof (PROBNODE));
+    work -> shift = wmalloc (work -> width * sizeof (PROBNODE));
+    work -> row_shift = wmalloc (info -> m * sizeof (PROBNODE));
+    work -> factor = wmalloc (info -> nnz * sizeof (PROBNODE));
+  }
+
+  return;
+}
+
+
+void freeWorkspace (INFO *info) {
+  WORKSPACE *work = &(info -> work);
+
+  if (work -> copies != NULL) {
+    wfree (work -> copies);
+    wfree (work -> copy_starts);
+    wfree (work -> pair_slots);
+    wfree (work -> column_starts);
+    wfree (work -> column_slots);
+  }
+  if (work -> w2 != NULL) {
+    wfree (work -> w2);
+  }
+  wfree (work -> z);
+  wfree (work -> vectors);
+  if (work -> q != NULL) {
+    wfree (work -> q);
+    wfree (work -> shift);
+    wfree (work -> row_shift);
+    wfree (work -> factor);
+  }
+
+  return;
+}
+
+
+/*!  Replace the random probabilities in *current* with those of the model
+**  to start from (--init-model), matching the rows and columns by their
+**  ids.  Rows and columns that are not in the model keep their random
+**  values, and p(w1|z) and p(w2|z) are normalized again.  The values stay
+**  logs, since the smallest of a model are below the range of exp.  With
+**  the rows divided among processes, the sums of p(w1|z) are added over
+**  all of them  */
+static void warmStart (INFO *info) {
+  unsigned int num_clusters = info -> num_clusters;
+  MODEL *model;
+  uint32_t *rows;  /*  Row of the model of each row  */
+  uint32_t *columns;  /*  Column of the model of each column  */
+  unsigned int rows_found;
+  unsigned int columns_found;
+  double *sums;
+  double shift;
+  unsigned int i;  /*  Index into w1  */
+  unsigned int j;  /*  Index into w2  */
+  unsigned int k;  /*  Index into clusters  */
+
+  model = modelOpen (info -> init_model_fn);
+  if (model == NULL) {
+    exit (EXIT_FAILURE);
+  }
+  rows = wmalloc (info -> m * sizeof (uint32_t) + 1);
+  columns = wmalloc (info -> n * sizeof (uint32_t) + 1);
+  sums = wmalloc (num_clusters * sizeof (double));
+  rows_found = modelMapIds (model -> row_ids, model -> header.m, info -> row_ids + info -> row_offset, info -> m, rows);
+  columns_found = modelMapIds (model -> column_ids, model -> header.n, info -> column_ids, info -> n, columns);
+
+  for (k = 0; k < num_clusters; k++) {
+    GET_PROBZ_CURR (k) = model -> probz[k];
+  }
+
+  /*  p(w1|z); the sums are in linear-space  */
+  for (k = 0; k < num_clusters; k++) {
+    sums[k] = 0.0;
+    for (i = 0; i < info -> m; i++) {
+      if (rows[i] != UINT32_MAX) {
+        GET_PROBW1_Z_CURR (k, i) = model -> probw1_z[(size_t) k * model -> header.m + rows[i]];
+      }
+      sums[k] += exp (GET_PROBW1_Z_CURR (k, i));
+    }
+  }
+#if HAVE_MPI
+  if ((info -> decompose == DECOMPOSE_ROWS) && (info -> world_size > 1)) {
+    MPI_Allreduce (MPI_IN_PLACE, sums, num_clusters, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce (MPI_IN_PLACE, &rows_found, 1, MPI_UNSIGNED, MPI_SUM, MPI_COMM_WORLD);
+  }
+#endif
+  for (k = 0; k < num_clusters; k++) {
+    shift = log (sums[k]);
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) -= shift;
+    }
+  }
+
+  /*  p(w2|z) likewise  */
+  for (k = 0; k < num_clusters; k++) {
+    sums[k] = 0.0;
+    for (j = 0; j < info -> n; j++) {
+      if (columns[j] != UINT32_MAX) {
+        GET_PROBW2_Z_CURR (k, j) = model -> probw2_z[(size_t) k * model -> header.n + columns[j]];
+      }
+      sums[k] += exp (GET_PROBW2_Z_CURR (k, j));
+    }
+    shift = log (sums[k]);
+    for (j = 0; j < info -> n; j++) {
+      GET_PROBW2_Z_CURR (k, j) -= shift;
+    }
+  }
+
+  if ((info -> verbose) && (info -> world_id == MAINPROC)) {
+    fprintf (stderr, "==\tStarted from the model:                         %s\n", info -> init_model_fn);
+    fprintf (stderr, "==\t  Rows found in it:                             %u of %u\n", rows_found, info -> m_global);
+    fprintf (stderr, "==\t  Columns found in it:                          %u of %u\n", columns_found, info -> n);
+  }
+
+  wfree (rows);
+  wfree (columns);
+  wfree (sums);
+  modelClose (model);
+
+  return;
+}
+
+
 void initEM (INFO *info) {
   unsigned int num_clusters = info -> num_clusters;
   unsigned int i;  /*  Index into w1  */
   unsigned int j;  /*  Index into w2  */
   unsigned int k;  /*  Index into clusters  */
+  unsigned int g;  /*  Index of a row in the file  */
   PROBNODE sum;
+  PROBNODE value;
   time_t start;
   time_t end;
 
@@ -83,14 +344,16 @@ void initEM (INFO *info) {
     GET_PROBZ_CURR (k) = DOLOG (GET_PROBZ_CURR (k) / sum);
   }
 
-  /*  Assign probabilities to probw1_z  */
-  for (i = 0; i < (info -> num_clusters * info -> m); i++) {
-    info -> probw1_z_curr[i] = RANDOM_FLOAT;
-  }
+  /*  Assign probabilities to probw1_z; the values of all rows are drawn,
+  **  but only the rows of this process are kept  */
   for (k = 0; k < num_clusters; k++) {
     sum = 0.0;
-    for (i = 0; i < info -> m; i++) {
-      sum += GET_PROBW1_Z_CURR (k, i);
+    for (g = 0; g < info -> m_global; g++) {
+      value = RANDOM_FLOAT;
+      sum += value;
+      if ((g >= info -> row_offset) && (g - info -> row_offset < info -> m)) {
+        GET_PROBW1_Z_CURR (k, g - info -> row_offset) = value;
+      }
     }
     for (i = 0; i < info -> m; i++) {
       GET_PROBW1_Z_CURR (k, i) = DOLOG (GET_PROBW1_Z_CURR (k, i) / sum);
@@ -98,8 +361,10 @@ void initEM (INFO *info) {
   }
 
   /*  Assign probabilities to probw2_z  */
-  for (i = 0; i < (info -> num_clusters * info -> n); i++) {
-    info -> probw2_z_curr[i] = RANDOM_FLOAT;
+  for (k = 0; k < num_clusters; k++) {
+    for (j = 0; j < info -> n; j++) {
+      GET_PROBW2_Z_CURR (k, j) = RANDOM_FLOAT;
+    }
   }
   for (k = 0; k < num_clusters; k++) {
     sum= 0.0;
@@ -111,6 +376,12 @@ void initEM (INFO *info) {
     }
   }
 
+  /*  The values are drawn all the same, so that new rows and columns get
+  **  the values they would have had without a model  */
+  if (info -> init_model_fn != NULL) {
+    warmStart (info);
+  }
+
   PROGRESS_MSG ("Initialization complete...");
 
   time (&end);
@@ -120,102 +391,230 @@ void initEM (INFO *info) {
 }
 
 
-void applyEMStep (INFO *info) {
-  unsigned int i = 0;  /*  Index into w1  */
-  unsigned int j = 0;  /*  Index into w2  */
-  signed int k = 0;  /*  Index into clusters, local to this processor  */
-  register unsigned int pos_j;  /*  Actual position in the cooccurrence array  */
-  register unsigned int cos_count;  /*  Number of cooccurrences in each row  */
-  PROBNODE temp;
-  PROBNODE cos;
-  bool *flag_z = NULL;
-  bool **flag_w1_z = NULL;
-  bool **flag_w2_z = NULL;
+/*!  The first row whose co-occurrences start at or after position target  */
+static unsigned int firstRowAt (INFO *info, size_t target) {
+  unsigned int lo = 0;
+  unsigned int hi = info -> m;
+  unsigned int mid;
 
-  time_t start;
-  time_t end;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (GET_COS_START (mid) < target) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
 
-  time (&start);
+  return (lo);
+}
 
-  /*******************************************************/
-  /*  Initialize flags that indicate whether the cell is so far untouched   */
 
-  flag_z = wmalloc (info -> block_size * sizeof (bool));
-  for (k = 0; k < info -> block_size; k++) {
-    flag_z[k] = false;
-  }
+/*!  Rows [*first, *last) of the given part when the rows are divided into parts with about the same number of co-occurrences  */
+void rowsByNnz (INFO *info, unsigned int parts, unsigned int part, unsigned int *first, unsigned int *last) {
+  *first = (part == 0) ? 0 : firstRowAt (info, (size_t) (((double) info -> nnz * part) / parts));
+  *last = (part + 1 == parts) ? info -> m : firstRowAt (info, (size_t) (((double) info -> nnz * (part + 1)) / parts));
 
-  flag_w1_z = wmalloc (info -> block_size * sizeof (bool*));
-  for (k = 0; k < info -> block_size; k++) {
-    flag_w1_z[k] = wmalloc (info -> m * sizeof (bool));
-    for (i = 0; i < info -> m; i++) {
-      flag_w1_z[k][i] = false;
-    }
-  }
+  return;
+}
 
-  flag_w2_z = wmalloc (info -> block_size * sizeof (bool*));
-  for (k = 0; k < info -> block_size; k++) {
-    flag_w2_z[k] = wmalloc (info -> n * sizeof (bool));
-    for (j = 0; j < info -> n; j++) {
-      flag_w2_z[k][j] = false;
-    }
-  }
 
+/*!  Rows [*first, *last) of the calling thread when the E and M steps
+**  divide the rows among the threads  */
+void threadRows (INFO *info, unsigned int *first, unsigned int *last) {
+#if HAVE_OPENMP
+  rowsByNnz (info, omp_get_num_threads (), omp_get_thread_num (), first, last);
+#else
+  rowsByNnz (info, 1, 0, first, last);
+#endif
+
+  return;
+}
 
-  /*******************************************************/
-  /*  Update probabilities */
 
+/*!  E and M steps with the threads dividing the rows by the number of
+**  co-occurrences.  Each row of probw1_z belongs to one thread; probw2_z
+**  and probz are summed by each thread into its own copy (of probw2_z,
+**  only of the columns of its rows; see initCopies), and the copies are
+**  then added cell by cell.
+**  If fused, p(w1,w2) is calculated from *previous* in the same sweep
+**  instead of being read, and the log likelihood is returned  */
+static PROBNODE applyEMStepRows (INFO *info, bool fused) {
+  unsigned int n = info -> n;
+  unsigned int block_size = info -> block_size;
+  unsigned int base = info -> block_start;  /*  First cluster of this process  */
+  size_t width = info -> work.width;
+  PROBNODE *priv_z = info -> work.z;  /*  probz of each thread, as [thread][k]  */
+  PROBNODE total = 0.0;
+
+  /*  The copies were made for this many threads  */
 #if HAVE_OPENMP
-#pragma omp parallel for private(i,cos_count,pos_j,j,cos,temp)
+#pragma omp parallel num_threads(info -> work.threads) reduction(+:total)
 #endif
-  for (k = 0; k < info -> block_size; k++) {
-    for (i = 0; i < info -> m; i++) {
-      cos_count = GET_COS_POSITION (i, 0);
-      for (pos_j = 1; pos_j <= cos_count; pos_j++) {
-        j = GET_COS_POSITION (i, pos_j);
-        cos = GET_COS (i, pos_j);
-        temp = (GET_PROBZ_W1W2_PREV (k, i, j)) - GET_PROB_W1W2 (i, j);
-
-        /*  probz  */
-        if (flag_z[k]) {
-          logSumsInline (GET_PROBZ_CURR (k), cos + temp);
-        }
-        else {
-          GET_PROBZ_CURR (k) = cos + temp;
-          flag_z[k] = true;
-        }
+  {
+    unsigned int me = 0;
+    unsigned int team = 1;
+    unsigned int part;
+    unsigned int first;
+    unsigned int last;
+    unsigned int i;  /*  Index into w1  */
+    unsigned int j;  /*  Index into w2  */
+    unsigned int k;  /*  Index into clusters, local to this processor  */
+    unsigned int t;
+    size_t pos;  /*  Actual position in the cooccurrence arrays  */
+    size_t c;
+    size_t cells;
+    PROBNODE value;
+    PROBNODE denom;
+    PROBNODE *my_w2;
+    PROBNODE *my_z;
+    PROBNODE *row;
+    PROBNODE *terms;  /*  log p(z,w1,w2) of the pair  */
+    PROBNODE *copy;
+
+#if HAVE_OPENMP
+    me = omp_get_thread_num ();
+    team = omp_get_num_threads ();
+#endif
+    row = WORK_VECTOR (me, 0);
+    terms = WORK_VECTOR (me, 1);
+
+    /*  Should the team be smaller than asked for, a thread takes several parts  */
+    for (part = me; part < info -> work.threads; part += team) {
+      my_w2 = info -> work.copies + info -> work.copy_starts[part] * width;
+      cells = (info -> work.copy_starts[part + 1] - info -> work.copy_starts[part]) * width;
+      my_z = priv_z + part * block_size;
+      for (c = 0; c < cells; c++) {
+        my_w2[c] = -HUGE_VAL;
+      }
+      for (k = 0; k < block_size; k++) {
+        my_z[k] = -HUGE_VAL;
+      }
 
-        /*  probw1_z  */
-        if (flag_w1_z[k][i]) {
-          logSumsInline (GET_PROBW1_Z_CURR (k, i), cos + temp);
+      rowsByNnz (info, info -> work.threads, part, &first, &last);
+      for (i = first; i < last; i++) {
+        for (k = 0; k < block_size; k++) {
+          row[k] = -HUGE_VAL;
         }
-        else {
-          GET_PROBW1_Z_CURR (k, i) = cos + temp;
-          flag_w1_z[k][i] = true;
+
+        for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+          j = GET_COS_POSITION (pos);
+          for (k = 0; k < block_size; k++) {
+            terms[k] = GET_PROBZ_W1W2_PREV (base + k, i, j);
+          }
+          if (fused) {
+            GET_PROB_W1W2 (pos) = info -> kernels.logSumExp (terms, block_size, info -> ln_limit);
+            total += (GET_PROB_W1W2 (pos) * DOEXP (GET_COS (pos)));
+          }
+          denom = GET_PROB_W1W2 (pos);
+
+          for (k = 0; k < block_size; k++) {
+            value = GET_COS (pos) + (terms[k] - denom);
+            logSumsEmptyInline (row[k], value);
+            logSumsEmptyInline (my_w2[(size_t) info -> work.pair_slots[pos] * width + k], value);
+            logSumsEmptyInline (my_z[k], value);
+          }
         }
 
-        /*  probw2_z  */
-        if (flag_w2_z[k][j]) {
-          logSumsInline (GET_PROBW2_Z_CURR (k, j), cos + temp);
+        for (k = 0; k < block_size; k++) {
+          GET_PROBW1_Z_CURR (base + k, i) = EMPTY_TO_MIN (row[k]);
         }
-        else {
-          GET_PROBW2_Z_CURR (k, j) = cos + temp;
-          flag_w2_z[k][j] = true;
+      }
+    }
+
+    /*  Add the copies of the threads that have each column  */
+#if HAVE_OPENMP
+#pragma omp barrier
+#pragma omp for
+#endif
+    for (j = 0; j < n; j++) {
+      for (k = 0; k < block_size; k++) {
+        row[k] = -HUGE_VAL;
+      }
+      for (c = info -> work.column_starts[j]; c < info -> work.column_starts[j + 1]; c++) {
+        copy = info -> work.copies + info -> work.column_slots[c] * width;
+        for (k = 0; k < block_size; k++) {
+          logSumsEmptyInline (row[k], copy[k]);
         }
       }
+      for (k = 0; k < block_size; k++) {
+        GET_PROBW2_Z_CURR (base + k, j) = row[k];
+      }
+    }
+
+#if HAVE_OPENMP
+#pragma omp for
+#endif
+    for (k = 0; k < block_size; k++) {
+      value = priv_z[k];
+      for (t = 1; t < info -> work.threads; t++) {
+        logSumsEmptyInline (value, priv_z[t * block_size + k]);
+      }
+      GET_PROBZ_CURR (base + k) = value;
     }
   }
 
-  /*******************************************************/
-  /*  Uninitialize flags  */
+  return (total);
+}
+
+
+/*!  E and M steps with the threads dividing the clusters of this process  */
+static void applyEMStepClusters (INFO *info) {
+  unsigned int i = 0;  /*  Index into w1  */
+  unsigned int j = 0;  /*  Index into w2  */
+  signed int k = 0;  /*  Index into clusters, local to this processor  */
+  register size_t pos;  /*  Actual position in the cooccurrence arrays  */
+  PROBNODE temp;
+  PROBNODE cos;
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(i,pos,j,cos,temp)
+#endif
+  for (k = info -> block_start; k <= info -> block_end; k++) {
+    /*  Empty sums  */
+    GET_PROBZ_CURR (k) = -HUGE_VAL;
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) = -HUGE_VAL;
+    }
+    for (j = 0; j < info -> n; j++) {
+      GET_PROBW2_Z_CURR (k, j) = -HUGE_VAL;
+    }
+
+    for (i = 0; i < info -> m; i++) {
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        j = GET_COS_POSITION (pos);
+        cos = GET_COS (pos);
+        temp = (GET_PROBZ_W1W2_PREV (k, i, j)) - GET_PROB_W1W2 (pos);
+
+        logSumsEmptyInline (GET_PROBZ_CURR (k), cos + temp);
+        logSumsEmptyInline (GET_PROBW1_Z_CURR (k, i), cos + temp);
+        logSumsEmptyInline (GET_PROBW2_Z_CURR (k, j), cos + temp);
+      }
+    }
 
-  wfree (flag_z);
-  for (k = 0; k < info -> block_size; k++) {
-    wfree (flag_w1_z[k]);
-    wfree (flag_w2_z[k]);
+    /*  Rows without any co-occurrences; p(w2|z) and p(z) are left to normalizeProbs  */
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) = EMPTY_TO_MIN (GET_PROBW1_Z_CURR (k, i));
+    }
+  }
+
+  return;
+}
+
+
+void applyEMStep (INFO *info) {
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  if (info -> estep == ESTEP_ROWS) {
+    applyEMStepRows (info, false);
+  }
+  else {
+    applyEMStepClusters (info);
   }
-  wfree (flag_w1_z);
-  wfree (flag_w2_z);
 
   time (&end);
   info -> applyEMStep_time += difftime (end, start);
@@ -224,39 +623,40 @@ void applyEMStep (INFO *info) {
 }
 
 
+/*!  Calculate p(w1,w2) and the log likelihood of *previous* and apply the
+**  E and M steps to it, placing the results in *current*, in one sweep over
+**  the co-occurrences.  Only for a single process (all clusters are local)
+**  and --estep rows; returns the log likelihood  */
+PROBNODE applyEMStepFused (INFO *info) {
+  PROBNODE total;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  total = applyEMStepRows (info, true);
+
+  time (&end);
+  info -> applyEMStep_time += difftime (end, start);
+
+  return (total);
+}
+
+
+/*!  Calculate the log likelihood from p(w1,w2) of the pairs; at MAINPROC, after calculateProbW1W2  */
 PROBNODE calculateML (INFO *info) {
-  unsigned int num_clusters = info -> num_clusters;
-  signed int i;  /*  Index into w1  */
-  signed int j;  /*  Index into w2  */
-  signed int k;  /*  Index into clusters  */
-  unsigned int pos_j;  /*  Actual position in the cooccurrence array  */
-  unsigned int cos_count;  /*  Number of cooccurrences in each row  */
+  size_t pos;  /*  Actual position in the cooccurrence arrays  */
   PROBNODE total = 0.0;
-  PROBNODE temp;
   time_t start;
   time_t end;
 
   time (&start);
 
 #if HAVE_OPENMP
-#pragma omp parallel for private(cos_count,pos_j,j,temp,k) reduction(+:total)
+#pragma omp parallel for reduction(+:total)
 #endif
-  for (i = 0; i < info -> m; i++) {
-    cos_count = GET_COS_POSITION (i, 0);
-    for (pos_j = 1; pos_j <= cos_count; pos_j++) {
-      j = GET_COS_POSITION (i, pos_j);
-
-      /*  Initialize with cluster 0  */
-      temp = GET_PROBZ_W1W2_CURR (0,i,j);
-      /*  Log-likelihood for the co-occurrence of two words  */
-      for (k = 1; k < num_clusters; k++) {
-        /*  temp stores log values  */
-        logSumsInline (temp, (GET_PROBZ_W1W2_CURR (k,i,j)));
-      }
-
-      /*  Log-likelihood across all examples  */
-      total += (temp * DOEXP (GET_COS (i, pos_j)));
-    }
+  for (pos = 0; pos < info -> nnz; pos++) {
+    total += (GET_PROB_W1W2 (pos) * DOEXP (GET_COS (pos)));
   }
 
   time (&end);
@@ -266,65 +666,150 @@ PROBNODE calculateML (INFO *info) {
 }
 
 
-void calculateProbW1W2 (INFO *info) {
-  signed int i;  /*  Index into w1  */
+/*!  Calculate the log likelihood of the held-out pairs of this process
+**  from *current*, over all clusters; at MAINPROC unless the rows are
+**  divided, after the probabilities have arrived (waitProbs)  */
+PROBNODE heldOutML (INFO *info) {
+  unsigned int i;  /*  Index into w1  */
   unsigned int j;  /*  Index into w2  */
   unsigned int k;  /*  Index into clusters  */
-  PROBNODE temp = 0.0;
-  PROBNODE *temp_prob_w1w2 = NULL;
-  int result = 0;
-  unsigned int tag = 0;
-  unsigned int owner = 0;
-#if HAVE_MPI
-  MPI_Status *status = wmalloc (sizeof (MPI_Status));
-#endif
+  size_t pos;  /*  Position in the held-out pairs  */
+  PROBNODE *terms;  /*  log p(z,w1,w2) of one pair for each cluster  */
+  PROBNODE total = 0.0;
   time_t start;
   time_t end;
 
   time (&start);
 
 #if HAVE_OPENMP
-#pragma omp parallel for private(j,temp,k)
+#pragma omp parallel private(i,j,k,pos,terms) reduction(+:total)
 #endif
-  for (i = 0; i < info -> m; i++) {
-    for (j = 0; j < info -> n; j++) {
-      temp = GET_PROBZ_W1W2_CURR (0,i,j);
-      for (k = 1; k < info -> block_size; k++) {
-        /*  temp stores logarithms  */
-        logSumsInline (temp, (GET_PROBZ_W1W2_CURR (k,i,j)));
+  {
+#if HAVE_OPENMP
+    terms = WORK_VECTOR (omp_get_thread_num (), 0);
+#pragma omp for
+#else
+    terms = WORK_VECTOR (0, 0);
+#endif
+    for (pos = 0; pos < info -> held_nnz; pos++) {
+      i = info -> held_rows[pos];
+      j = info -> held_columns[pos];
+      for (k = 0; k < info -> num_clusters; k++) {
+        terms[k] = GET_PROBZ_W1W2_CURR (k, i, j);
       }
-      GET_PROB_W1W2(i,j) = temp;
+      total += (info -> kernels.logSumExp (terms, info -> num_clusters, info -> ln_limit) * DOEXP (info -> held_counts[pos]));
     }
   }
 
-#if HAVE_MPI
-  if (info -> world_id == MAINPROC) {
-    temp_prob_w1w2 = wmalloc (info -> m * info -> n * sizeof (PROBNODE));
+  time (&end);
+  info -> calculateML_time += difftime (end, start);
+
+  return (total);
+}
 
-    /*  Receive each temporary matrix and copy it in  */
-    for (owner = 1; owner < info -> world_size; owner++) {
-      MSG_RECV_STATUS (info -> world_id, owner, info -> iter, TAG_PROBW1W2, 0);
-      tag = MSG_TAG (info -> iter, TAG_PROBW1W2, 0);
-      result = MPI_Recv (temp_prob_w1w2, (info -> m * info -> n), MPI_TYPE, owner, tag, MPI_COMM_WORLD, status);
+
+/*!  Raise p(z), p(w1|z) and p(w2|z) of the clusters of this process in
+**  *current* to the power beta (multiplying the logs), so that the E-step
+**  that follows is that of tempered EM:  p(z|w1,w2) is proportional to
+**  p(z,w1,w2)^beta.  The tables are no longer normalized; p(w1,w2) must
+**  then be calculated again for the E-step  */
+void temperProbs (INFO *info) {
+  PROBNODE beta = info -> beta;
+  unsigned int i;  /*  Index into w1  */
+  unsigned int j;  /*  Index into w2  */
+  signed int k;  /*  Index into clusters  */
 
 #if HAVE_OPENMP
-#pragma omp parallel for private(j)
+#pragma omp parallel for private(i,j)
 #endif
-      for (i = 0; i < info -> m; i++) {
-        for (j = 0; j < info -> n; j++) {
-          logSumsInline (GET_PROB_W1W2(i,j), temp_prob_w1w2[i * info -> n + j]);
-        }
-      }
+  for (k = info -> block_start; k <= info -> block_end; k++) {
+    GET_PROBZ_CURR (k) *= beta;
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) *= beta;
+    }
+    for (j = 0; j < info -> n; j++) {
+      GET_PROBW2_Z_CURR (k, j) *= beta;
     }
+  }
 
-    wfree (temp_prob_w1w2);
+  return;
+}
+
+
+/*!  Number of parts the rows are divided into for mergeProbW1W2, so that
+**  the reduction of each part is in progress while the next is calculated;
+**  1 unless there is something to reduce  */
+unsigned int mergeParts (INFO *info) {
+  if ((info -> world_size > 1) && (info -> decompose == DECOMPOSE_CLUSTERS)) {
+    return (MERGE_PARTS);
   }
-  else {
-    MSG_SEND_STATUS (info -> world_id, MAINPROC, info -> iter, TAG_PROBW1W2, 0);
-    tag = MSG_TAG (info -> iter, TAG_PROBW1W2, 0);
-    result = MPI_Send (info -> prob_w1w2, (info -> m * info -> n), MPI_TYPE, MAINPROC, tag, MPI_COMM_WORLD);
+
+  return (1);
+}
+
+
+/*!  Start combining the partial p(w1,w2) of each process's clusters for
+**  the pairs of rows [first, last); all processes receive the sums of the
+**  non-zero pairs, so only nnz values are exchanged.  Nothing is needed if
+**  the rows are divided, since each process then has all clusters of its
+**  pairs.  The sums are complete after waitLogSums  */
+void mergeProbW1W2 (INFO *info, unsigned int first, unsigned int last) {
+  if ((info -> world_size > 1) && (info -> decompose == DECOMPOSE_CLUSTERS)) {
+    ireduceLogSums (info, info -> prob_w1w2 + GET_COS_START (first), GET_COS_START (last) - GET_COS_START (first));
   }
+
+  return;
+}
+
+
+void calculateProbW1W2 (INFO *info) {
+  signed int i;  /*  Index into w1  */
+  unsigned int j;  /*  Index into w2  */
+  unsigned int k;  /*  Index into clusters  */
+  unsigned int parts = mergeParts (info);
+  unsigned int part;
+  unsigned int first;
+  unsigned int last;
+  size_t pos;  /*  Actual position in the cooccurrence arrays  */
+  PROBNODE *terms;  /*  log p(z,w1,w2) of one pair for each local cluster  */
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  /*  Only the pairs in the co-occurrence data are ever used, so the
+  **  remaining (zero) pairs are not calculated.  Each part of the rows is
+  **  sent to the other processes as soon as it is done  */
+  for (part = 0; part < parts; part++) {
+    rowsByNnz (info, parts, part, &first, &last);
+#if HAVE_OPENMP
+#pragma omp parallel private(pos,j,k,terms)
+#endif
+    {
+#if HAVE_OPENMP
+      terms = WORK_VECTOR (omp_get_thread_num (), 0);
+#else
+      terms = WORK_VECTOR (0, 0);
 #endif
+#if HAVE_OPENMP
+#pragma omp for
+#endif
+      for (i = first; i < last; i++) {
+        for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+          j = GET_COS_POSITION (pos);
+          for (k = 0; k < info -> block_size; k++) {
+            terms[k] = GET_PROBZ_W1W2_CURR (info -> block_start + k, i, j);
+          }
+          GET_PROB_W1W2 (pos) = info -> kernels.logSumExp (terms, info -> block_size, info -> ln_limit);
+        }
+      }
+    }
+
+    mergeProbW1W2 (info, first, last);
+  }
+
+  /*  Combine the partial sums of all processes  */
+  waitLogSums (info, &(info -> waitMerge_time));
 
   time (&end);
   info -> calculateProbW1W2_time += difftime (end, start);
@@ -333,12 +818,14 @@ void calculateProbW1W2 (INFO *info) {
 }
 
 
-/*!  Normalize probabilities  */
+/*!  Normalize p(w1|z) and p(w2|z) of the clusters of this process by their
+**  p(z).  The steps leave empty sums of p(w2|z) and p(z) as -HUGE_VAL, since
+**  with the rows divided they are only partial sums until gatherProbs; they
+**  are set to the minimum probability here  */
 void normalizeProbs (INFO *info) {
   unsigned int i;  /*  Index into w1  */
   unsigned int j;  /*  Index into w2  */
   signed int k;  /*  Index into clusters  */
-  PROBNODE sum;
   PROBNODE norm;
   time_t start;
   time_t end;
@@ -348,7 +835,8 @@ void normalizeProbs (INFO *info) {
 #if HAVE_OPENMP
 #pragma omp parallel for private(norm,i,j)
 #endif
-  for (k = 0; k < info -> num_clusters; k++) {
+  for (k = info -> block_start; k <= info -> block_end; k++) {
+    GET_PROBZ_CURR (k) = EMPTY_TO_MIN (GET_PROBZ_CURR (k));
     norm = GET_PROBZ_CURR (k);
 
     /*  probw1_z  */
@@ -358,11 +846,26 @@ void normalizeProbs (INFO *info) {
 
     /*  probw2_z  */
     for (j = 0; j < info -> n; j++) {
-      GET_PROBW2_Z_CURR (k, j) = GET_PROBW2_Z_CURR (k, j) - norm;
+      GET_PROBW2_Z_CURR (k, j) = EMPTY_TO_MIN (GET_PROBW2_Z_CURR (k, j)) - norm;
     }
   }
 
-  /*  probz  */
+  time (&end);
+  info -> normalizeProbs_time += difftime (end, start);
+
+  return;
+}
+
+
+/*!  Normalize p(z) over all clusters; after gatherProbs  */
+void normalizeProbZ (INFO *info) {
+  signed int k;  /*  Index into clusters  */
+  PROBNODE sum;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
   sum = GET_PROBZ_CURR (0);
   for (k = 1; k < info -> num_clusters; k++) {
     logSumsInline (sum, GET_PROBZ_CURR (k));
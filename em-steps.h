@@ -20,10 +20,20 @@
 #define EM_STEP_H
 
 void swapPrevCurr (INFO *info);
+void initWorkspace (INFO *info);
+void freeWorkspace (INFO *info);
 void initEM (INFO *info);
+void rowsByNnz (INFO *info, unsigned int parts, unsigned int part, unsigned int *first, unsigned int *last);
+void threadRows (INFO *info, unsigned int *first, unsigned int *last);
 void applyEMStep (INFO *info);
+PROBNODE applyEMStepFused (INFO *info);
 PROBNODE calculateML (INFO *info);
+PROBNODE heldOutML (INFO *info);
+void temperProbs (INFO *info);
+unsigned int mergeParts (INFO *info);
+void mergeProbW1W2 (INFO *info, unsigned int first, unsigned int last);
 void calculateProbW1W2 (INFO *info);
 void normalizeProbs (INFO *info);
+void normalizeProbZ (INFO *info);
 
 #endif
@@ -0,0 +1,289 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Fold-in:  the latent states p(z|w1) of rows that the model was not
+**  trained on.  p(z) and p(w2|z) of a model written with --model are kept
+**  fixed, and EM estimates only the mixture of latent states of each new
+**  row, which depends on no other row.  The rows are read from the
+**  co-occurrence file (see stream.c) FOLDIN_BATCH_ROWS at a time:  the
+**  threads fold in a batch while one of them writes the previous batch and
+**  reads the next, so the result of each batch is in the output file before
+**  the whole input is read.
+**
+**  The output file <base>.foldin has the layout of the p(x,y) file:  the
+**  number of rows, the number of latent states, and the row ids, then
+**  log p(z|w1) of each row.  Columns of the input that are not in the
+**  model are ignored.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>  /*  DBL_EPSILON  */
+#include <time.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "model.h"
+#include "stream.h"
+#include "foldin.h"
+
+/*!  Number of rows read, folded in, and written at a time  */
+#define FOLDIN_BATCH_ROWS 4096
+
+/*!  Write log p(z|w1) of the rows of the batch  */
+static void writeBatch (FILE *fp, bool textio, STREAMBATCH *batch, unsigned int k) {
+  size_t pos;
+
+  if (textio) {
+    for (pos = 0; pos < (size_t) batch -> rows * k; pos++) {
+      fprintf (fp, "%lf\t", batch -> topics[pos]);
+    }
+  }
+  else {
+    fwrite (batch -> topics, sizeof (PROBNODE), (size_t) batch -> rows * k, fp);
+  }
+  fflush (fp);
+
+  return;
+}
+
+
+/*!  Fold row r of the batch into the model by EM:  starting from p(z),
+**  log p(z|w1) is estimated with p(z) and p(w2|z) fixed (probw2 has the k
+**  values of each column together, less shift of each latent state unless
+**  it is NULL), for at most maxiter steps or until
+**  the log likelihood of the row changes by less than ML_DELTA percent.
+**  work has room for 3 x k values.  Returns the number of steps and the
+**  log likelihood before the last one  */
+unsigned int foldInRow (const double *probz, const double *probw2, const double *shift, unsigned int k, STREAMBATCH *batch, unsigned int r, unsigned int maxiter, double *work, double *likelihood) {
+  double *topics = work;  /*  log p(z|w1)  */
+  double *post = work + k;  /*  p(z|w1,w2) of a pair  */
+  double *sums = work + 2 * k;  /*  Counts of each latent state  */
+  const double *column;
+  double total;
+  double top;
+  double sum;
+  double ll = 0.0;
+  double prev_ll = 0.0;
+  unsigned int steps = 0;
+  unsigned int z;
+  size_t pos;
+
+  for (z = 0; z < k; z++) {
+    topics[z] = probz[z];
+  }
+
+  while (steps < maxiter) {
+    /*  E-step, adding up the M-step as it goes  */
+    for (z = 0; z < k; z++) {
+      sums[z] = 0.0;
+    }
+    total = 0.0;
+    ll = 0.0;
+    for (pos = batch -> starts[r]; pos < batch -> starts[r + 1]; pos++) {
+      column = probw2 + (size_t) batch -> columns[pos] * k;
+      top = -HUGE_VAL;
+      for (z = 0; z < k; z++) {
+        post[z] = topics[z] + column[z];
+        if (shift != NULL) {
+          post[z] -= shift[z];
+        }
+        if (post[z] > top) {
+          top = post[z];
+        }
+      }
+      if (isinf (top)) {
+        continue;
+      }
+      sum = 0.0;
+      for (z = 0; z < k; z++) {
+        post[z] = exp (post[z] - top);
+        sum += post[z];
+      }
+      ll += batch -> counts[pos] * (top + log (sum));
+      total += batch -> counts[pos];
+      for (z = 0; z < k; z++) {
+        sums[z] += batch -> counts[pos] * post[z] / sum;
+      }
+    }
+
+    /*  A row without any pairs keeps p(z)  */
+    if (total == 0.0) {
+      break;
+    }
+    for (z = 0; z < k; z++) {
+      topics[z] = (sums[z] > 0.0) ? log (sums[z] / total) : -HUGE_VAL;
+    }
+    steps++;
+
+    if ((steps > 1) && (DBL_LESS (fabs ((ll - prev_ll) / prev_ll * 100), ML_DELTA))) {
+      break;
+    }
+    prev_ll = ll;
+  }
+
+  for (z = 0; z < k; z++) {
+    batch -> topics[(size_t) r * k + z] = topics[z];
+  }
+  *likelihood = ll;
+
+  return (steps);
+}
+
+
+bool foldIn (INFO *info) {
+  MODEL *model;
+  STREAM stream;
+  STREAMBATCH batch[2];
+  double *probw2;  /*  p(w2|z) of the model, column by column  */
+  unsigned int k;
+  unsigned int n;
+  unsigned int missing;
+  unsigned int batches;
+  double likelihood = 0.0;
+  unsigned long steps = 0;
+  FILE *fp = NULL;
+  char *fn;
+  unsigned int b;
+  unsigned int i;
+  unsigned int z;
+  time_t start;
+  time_t end;
+
+  /*  The rows are folded in by the threads of one process  */
+  if (info -> world_id != MAINPROC) {
+    return true;
+  }
+  if (info -> world_size > 1) {
+    fprintf (stderr, "==\tWarning:  Rows are folded in by the first MPI process only.\n");
+  }
+
+  time (&start);
+  model = modelOpen (info -> foldin_fn);
+  if (model == NULL) {
+    return false;
+  }
+  k = model -> header.k;
+  n = model -> header.n;
+
+  probw2 = wmalloc ((size_t) n * k * sizeof (double) + 1);
+#if HAVE_OPENMP
+#pragma omp parallel for private(z)
+#endif
+  for (i = 0; i < n; i++) {
+    for (z = 0; z < k; z++) {
+      probw2[(size_t) i * k + z] = model -> probw2_z[(size_t) z * n + i];
+    }
+  }
+
+  openStream (info, &stream);
+  missing = stream.n - modelMapIds (model -> column_ids, n, stream.column_ids, stream.n, stream.columns);
+
+  fn = wmalloc (sizeof (char) * (strlen (info -> base_fn) + 10));
+  sprintf (fn, "%s.foldin", info -> base_fn);
+  if (info -> textio) {
+    FOPEN (fn, fp, "w");
+    fprintf (fp, "%u\t%u\t", stream.m, k);
+    for (i = 0; i < stream.m; i++) {
+      fprintf (fp, "%u\t", stream.row_ids[i]);
+    }
+  }
+  else {
+    FOPEN (fn, fp, "wb");
+    fwrite (&stream.m, sizeof (unsigned int), 1, fp);
+    fwrite (&k, sizeof (unsigned int), 1, fp);
+    fwrite (stream.row_ids, sizeof (unsigned int), stream.m, fp);
+  }
+
+  for (b = 0; b < 2; b++) {
+    initStreamBatch (&(batch[b]), FOLDIN_BATCH_ROWS, k);
+  }
+  batches = (stream.m + FOLDIN_BATCH_ROWS - 1) / FOLDIN_BATCH_ROWS;
+  if (batches > 0) {
+    readStream (&stream, &(batch[0]));
+  }
+
+#if HAVE_OPENMP
+#pragma omp parallel private(b,i) reduction(+:likelihood,steps)
+#endif
+  {
+    double *work = wmalloc (3 * k * sizeof (double));
+    double ll;
+
+    /*  Batch b is folded in while batch b - 1 is written and batch b + 1
+    **  is read; the end of the loop over the rows of batch b waits for all  */
+    for (b = 0; b <= batches; b++) {
+#if HAVE_OPENMP
+#pragma omp single nowait
+#endif
+      {
+        if (b > 0) {
+          writeBatch (fp, info -> textio, &(batch[(b - 1) % 2]), k);
+        }
+        if (b + 1 < batches) {
+          readStream (&stream, &(batch[(b + 1) % 2]));
+        }
+      }
+
+      if (b < batches) {
+#if HAVE_OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+        for (i = 0; i < batch[b % 2].rows; i++) {
+          steps += foldInRow (model -> probz, probw2, NULL, k, &(batch[b % 2]), i, info -> maxiter, work, &ll);
+          likelihood += ll;
+        }
+      }
+    }
+
+    wfree (work);
+  }
+
+  FCLOSE (fp);
+  time (&end);
+  info -> run_time += difftime (end, start);
+
+  if (info -> verbose) {
+    fprintf (stderr, "==\tModel:                                          %s (n = %u, k = %u)\n", info -> foldin_fn, n, k);
+    fprintf (stderr, "==\tRows folded in:                                 %u in %u batches\n", stream.m, batches);
+    fprintf (stderr, "==\tColumns not in the model:                       %u of %u (%zu pairs)\n", missing, stream.n, stream.ignored);
+    fprintf (stderr, "==\tEM steps per row:                               %.2f\n", (stream.m == 0) ? 0.0 : (double) steps / stream.m);
+    fprintf (stderr, "==\tLog likelihood of the rows:                     %f\n", likelihood);
+    fprintf (stderr, "==\tLatent states written to:                       %s\n", fn);
+  }
+
+  for (b = 0; b < 2; b++) {
+    freeStreamBatch (&(batch[b]));
+  }
+  closeStream (&stream);
+  wfree (probw2);
+  wfree (fn);
+  modelClose (model);
+
+  return true;
+}
@@ -24,43 +24,55 @@
 #include <math.h>
 #include <float.h>
 #include <time.h>  /*  time  */
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
 
 #include "wmalloc.h"
 #include "plsa-defn.h"
+#include "cofile.h"
 #include "debug.h"
+#include "em-steps.h"
 #include "input.h"
 
+/*!  The page holding address P, and the length from it to cover L bytes from P (for madvise)  */
+#define PAGE_START(P) ((void *) ((uintptr_t) (P) & ~((uintptr_t) sysconf (_SC_PAGESIZE) - 1)))
+#define PAGE_SPAN(P,L) ((size_t) ((char *) (P) + (L) - (char *) PAGE_START (P)))
+
 
 /*!  Initialization that depends on the input file or parameters  */
 void initializePostInput (INFO *info) {
-  unsigned int i = 0;
-  unsigned int size = 0;
-  unsigned int temp = 0;
+  unsigned int size = info -> num_clusters;
 
-  info -> cos = wmalloc (info -> m * sizeof (COOCCUR*));
-
-  /*  All processes read the co-occurrence data, so all must initialize  */
-  /*  Cannot allocate more space since we don't know the number of values in each row  */
-  for (i = 0; i < info -> m; i++) {
-    info -> cos[i] = NULL;
-  }
-
-  /*  Main process creates space for all clusters; others only for what it needs  */
-  if (info -> world_id == MAINPROC) {
-    size = info -> num_clusters;
-  }
-  else {
-    size = info -> block_size;
-  }
+  /*  Every process holds all clusters; it calculates only its own block of
+  **  them and receives the others in gatherProbs  */
 
   /*  Allocate space  */
-  info -> probw1_z_prev = wmalloc (size * info -> m * sizeof (PROBNODE));
-  info -> probw2_z_prev = wmalloc (size * info -> n * sizeof (PROBNODE));
+  info -> probw1_z_prev = wmalloc ((size_t) size * info -> m * sizeof (PROBNODE));
+  info -> probw2_z_prev = wmalloc ((size_t) size * info -> n * sizeof (PROBNODE));
   info -> probz_prev = wmalloc (size * sizeof (PROBNODE));
-  info -> probw1_z_curr = wmalloc (size * info -> m * sizeof (PROBNODE));
-  info -> probw2_z_curr = wmalloc (size * info -> n * sizeof (PROBNODE));
+  info -> probw1_z_curr = wmalloc ((size_t) size * info -> m * sizeof (PROBNODE));
+  info -> probw2_z_curr = wmalloc ((size_t) size * info -> n * sizeof (PROBNODE));
   info -> probz_curr = wmalloc (size * sizeof (PROBNODE));
-  info -> prob_w1w2 = wmalloc (info -> m * info -> n * sizeof (PROBNODE));
+
+  return;
+}
+
+
+/*!  Set the random seed; if not given as an argument, MAINPROC uses the time  */
+static void initializeSeed (INFO *info) {
+  unsigned int temp = 0;
 
   /*  Set seed if given as an argument, otherwise use the time  */
   if (info -> seed == UINT_MAX) {
@@ -70,14 +82,74 @@ void initializePostInput (INFO *info) {
       fprintf (stderr, "==\tApplying seed from time:                        %u\n", temp);
     }
   }
+#if HAVE_MPI
+  /*  With the rows divided, every process draws the initial probabilities  */
+  MPI_Bcast (&(info -> seed), 1, MPI_UNSIGNED, MAINPROC, MPI_COMM_WORLD);
+#endif
   srand (info -> seed);
 
   return;
 }
 
 
+/*!  Touch the pages of the tables first from the threads that work on
+**  them in the EM steps, so that the pages are placed in the memory local
+**  to those threads.  The tables must not have been written to yet  */
+static void placeTables (INFO *info) {
+  unsigned int first_row;
+  unsigned int last_row;
+  signed int k;
+
+#if HAVE_OPENMP
+#pragma omp parallel private(k,first_row,last_row)
+#endif
+  {
+    threadRows (info, &first_row, &last_row);
+    memset (info -> prob_w1w2 + GET_COS_START (first_row), 0, (GET_COS_START (last_row) - GET_COS_START (first_row)) * sizeof (PROBNODE));
+    if (info -> estep == ESTEP_ROWS) {
+      for (k = 0; k < info -> num_clusters; k++) {
+        memset (&(GET_PROBW1_Z_PREV (k, first_row)), 0, (last_row - first_row) * sizeof (PROBNODE));
+        memset (&(GET_PROBW1_Z_CURR (k, first_row)), 0, (last_row - first_row) * sizeof (PROBNODE));
+      }
+    }
+  }
+
+  /*  Otherwise, the threads divide the clusters of this process as in applyEMStepClusters  */
+  if (info -> estep == ESTEP_CLUSTERS) {
+#if HAVE_OPENMP
+#pragma omp parallel for
+#endif
+    for (k = info -> block_start; k <= info -> block_end; k++) {
+      memset (&(GET_PROBW1_Z_PREV (k, 0)), 0, info -> m * sizeof (PROBNODE));
+      memset (&(GET_PROBW1_Z_CURR (k, 0)), 0, info -> m * sizeof (PROBNODE));
+      memset (&(GET_PROBW2_Z_PREV (k, 0)), 0, info -> n * sizeof (PROBNODE));
+      memset (&(GET_PROBW2_Z_CURR (k, 0)), 0, info -> n * sizeof (PROBNODE));
+    }
+  }
+
+  return;
+}
+
+
+/*!  Set the rows of the file that this process holds:  all of them, or
+**  its block of them if the rows are divided among processes  */
+static void shareRows (INFO *info, unsigned int rows) {
+  info -> m_global = rows;
+  if (info -> decompose == DECOMPOSE_ROWS) {
+    info -> row_offset = BLOCK_LOW (info -> world_id, info -> world_size, rows);
+    info -> m = BLOCK_SIZE (info -> world_id, info -> world_size, rows);
+  }
+  else {
+    info -> row_offset = 0;
+    info -> m = rows;
+  }
+
+  return;
+}
+
+
 /*!
-**  Read the co-occurrence data from file.  The format of the file is:
+**  Read the co-occurrence data from a legacy file.  The format of the file is:
 **
 **  [rows][columns][row id+][column id+][w1 cos_count (w21 c21) ... (w2n c2n)]+**
 **
@@ -88,8 +160,12 @@ void initializePostInput (INFO *info) {
 **  Every value is an unsigned integer in binary format, unless
 **  textmode is TRUE -- if so, values are in text, separated
 **  by white space (tab).
+**
+**  This is the legacy binary format; see readCOText for the text format
+**  and readCOFile for version 2.  If the rows are divided among processes,
+**  the pairs of the rows before this process's are skipped over.
 */
-bool readCO (INFO *info) {
+static void readCOLegacy (INFO *info, size_t *nonzero_count, unsigned int *sum_freq) {
   FILE *fp = NULL;
   unsigned int w1 = 0;
   unsigned int w2 = 0;
@@ -98,92 +174,71 @@ bool readCO (INFO *info) {
   unsigned int rows = 0;
   unsigned int cols = 0;
   unsigned int cos_count = 0;
-  unsigned int found_pairs = 0;
   unsigned int found_w1 = 0;
 
-  unsigned int sum_freq = 0;
-  unsigned int nonzero_count = 0;
-  time_t start;
-  time_t end;
-
-  time (&start);
-
-  PROGRESS_MSG ("Reading from co-occurrence file...");
+  size_t pos = 0;  /*  Position among all pairs  */
+  size_t capacity = 0;  /*  Number of pairs allocated so far  */
 
   /*  Open the file; read the number of rows and columns and check them  */
-  if (info -> textio) {
-    FOPEN (info -> co_fn, fp, "r");
-    fscanf (fp, "%u", &rows);
-    fscanf (fp, "%u", &cols);
-  }
-  else {
-    FOPEN (info -> co_fn, fp, "rb");
-    fread (&rows, sizeof (unsigned int), 1, fp);
-    fread (&cols, sizeof (unsigned int), 1, fp);
-  }
+  FOPEN (info -> co_fn, fp, "rb");
+  fread (&rows, sizeof (unsigned int), 1, fp);
+  fread (&cols, sizeof (unsigned int), 1, fp);
 
-  info -> m = rows;
+  shareRows (info, rows);
   info -> n = cols;
 
   initializePostInput (info);
 
-  info -> row_ids = wmalloc (info -> m * sizeof (unsigned int));
+  /*  The pairs are grown while reading since their number is not known yet  */
+  capacity = info -> m + 1;
+  info -> cos_rows = wmalloc ((info -> m + 1) * sizeof (size_t));
+  info -> cos_rows[0] = 0;
+  info -> cos_columns = wmalloc (capacity * sizeof (unsigned int));
+  info -> cos_counts = wmalloc (capacity * sizeof (PROBNODE));
+
+  info -> row_ids = wmalloc (info -> m_global * sizeof (unsigned int));
   info -> column_ids = wmalloc (info -> n * sizeof (unsigned int));
 
-  if (info -> textio) {
-    for (unsigned int i = 0; i < info -> m; i++) {
-      fscanf (fp, "%u", &(info -> row_ids[i]));
-    }
-    for (unsigned int j = 0; j < info -> n; j++) {
-      fscanf (fp, "%u", &(info -> column_ids[j]));
+  fread (info -> row_ids, sizeof (unsigned int), info -> m_global, fp);
+  fread (info -> column_ids, sizeof (unsigned int), info -> n, fp);
+
+  /*  Skip the rows of the processes before this one  */
+  found_w1 = 0;
+  for (unsigned int g = 0; g < info -> row_offset; g++) {
+    fread (&w1, sizeof (unsigned int), 1, fp);
+    fread (&cos_count, sizeof (unsigned int), 1, fp);
+    if ((feof (fp)) || (fseeko (fp, (off_t) cos_count * 2 * sizeof (unsigned int), SEEK_CUR) != 0)) {
+      break;
     }
-  }
-  else {
-    fread (info -> row_ids, sizeof (unsigned int), info -> m, fp);
-    fread (info -> column_ids, sizeof (unsigned int), info -> n, fp);
+    found_w1++;
   }
 
-  found_pairs = 0;
-  found_w1 = 0;
   for (unsigned int i = 0; i < info -> m; i++) {
-    if (info -> textio) {
-      fscanf (fp, "%u", &w1);
-    }
-    else {
-      fread (&w1, sizeof (unsigned int), 1, fp);
-    }
+    fread (&w1, sizeof (unsigned int), 1, fp);
 
     if (feof (fp)) {
       break;
     }
     found_w1++;
-    if (info -> textio) {
-      fscanf (fp, "%u", &cos_count);
-    }
-    else {
-      fread (&cos_count, sizeof (unsigned int), 1, fp);
-    }
-
-    /*  Allocate space for the row  */
-    info -> cos[i] = wmalloc (sizeof (COOCCUR) * (cos_count + 1));
+    fread (&cos_count, sizeof (unsigned int), 1, fp);
 
-    /*  Position 0 of each row is cos_count    */
-    info ->  cos[i][0].x = 0.0;
-    info ->  cos[i][0].column = cos_count;
+    /*  Grow the pairs, doubling each time, so that the row fits  */
+    if (pos + cos_count > capacity) {
+      while (capacity < pos + cos_count) {
+        capacity *= 2;
+      }
+      info -> cos_columns = wrealloc (info -> cos_columns, capacity * sizeof (unsigned int));
+      info -> cos_counts = wrealloc (info -> cos_counts, capacity * sizeof (PROBNODE));
+    }
+    info -> cos_rows[i + 1] = pos + cos_count;
 
     /*  Term found is a query term  */
-    for (unsigned int j = 1; j <= cos_count; j++) {
-      if (info -> textio) {
-        fscanf (fp, "%u", &w2);
-        fscanf (fp, "%u", &freq);
-      }
-      else {
-        fread (&w2, sizeof (unsigned int), 1, fp);
-        fread (&freq, sizeof (unsigned int), 1, fp);
-      }
+    for (unsigned int j = 0; j < cos_count; j++) {
+      fread (&w2, sizeof (unsigned int), 1, fp);
+      fread (&freq, sizeof (unsigned int), 1, fp);
 
       if (freq != 0) {
-        nonzero_count++;
+        (*nonzero_count)++;
       }
 
       if (w2 > info -> n) {
@@ -195,29 +250,683 @@ bool readCO (INFO *info) {
         fprintf (stderr, "==\t\tRead (%u, %u) --> %u\n", i, w2, freq);
       }
 
-      SET_COS (i, j, w2, DOLOG (freq));
+      SET_COS (pos, w2, DOLOG (freq));
+      pos++;
 
-      sum_freq += freq;
-
-      found_pairs++;
+      *sum_freq += freq;
     }
   }
   FCLOSE (fp);
 
   /*  Check if the header of the file matches reality  */
-  if (found_w1 != info -> m) {
-    fprintf (stderr, "Not all query terms found!  (%u, %u)\n", found_w1, info -> m);
+  if (found_w1 != info -> row_offset + info -> m) {
+    fprintf (stderr, "Not all query terms found!  (%u, %u)\n", found_w1, info -> row_offset + info -> m);
+    exit (EXIT_FAILURE);
+  }
+
+  /*  Release the unused space  */
+  info -> nnz = pos;
+  if (info -> nnz != 0) {
+    info -> cos_columns = wrealloc (info -> cos_columns, info -> nnz * sizeof (unsigned int));
+    info -> cos_counts = wrealloc (info -> cos_counts, info -> nnz * sizeof (PROBNODE));
+  }
+
+  return;
+}
+
+
+/*!
+**  Map a version 2 co-occurrence file (see cofile.h) and use its arrays in
+**  place.  The counts are converted to logs unless the file has them.  If
+**  the rows are divided among processes, only the pairs of this process's
+**  rows are read, and its row offsets are copied to start from 0.
+*/
+static void readCOFile (INFO *info, size_t *nonzero_count, unsigned int *sum_freq) {
+  int fd;
+  struct stat sb;
+  char *map;
+  COFILEHEADER header;
+  COFILELAYOUT layout;
+  uint32_t *counts;
+  uint64_t *offsets;  /*  Row offsets in the file  */
+  uint64_t first;  /*  First pair of this process  */
+  size_t pos;  /*  Position among all pairs  */
+  size_t nonzero = 0;
+  unsigned int sum = 0;
+  unsigned int bad = 0;
+  bool have_logs;
+  signed int i;  /*  Index into w1  */
+  unsigned int first_row;  /*  Rows of this thread  */
+  unsigned int last_row;
+
+  fd = open (info -> co_fn, O_RDONLY);
+  if ((fd == -1) || (fstat (fd, &sb) == -1)) {
+    fprintf (stderr, "Error opening %s.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  if ((size_t) sb.st_size < sizeof (COFILEHEADER)) {
+    fprintf (stderr, "Co-occurrence file %s is truncated.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf (stderr, "Error mapping %s.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  (void) close (fd);
+
+  memcpy (&header, map, sizeof (COFILEHEADER));
+  if (header.version != COFILE_VERSION) {
+    fprintf (stderr, "Co-occurrence file %s has version %u; only version %u is supported.\n", info -> co_fn, header.version, COFILE_VERSION);
+    exit (EXIT_FAILURE);
+  }
+  cofileLayout (&header, &layout);
+  if (layout.size > (uint64_t) sb.st_size) {
+    fprintf (stderr, "Co-occurrence file %s is truncated.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+
+  info -> co_map = map;
+  info -> co_map_size = sb.st_size;
+  shareRows (info, header.m);
+  info -> n = header.n;
+
+  initializePostInput (info);
+
+  info -> row_ids = wmalloc (info -> m_global * sizeof (unsigned int));
+  info -> column_ids = wmalloc (info -> n * sizeof (unsigned int));
+  memcpy (info -> row_ids, map + layout.row_ids, info -> m_global * sizeof (unsigned int));
+  memcpy (info -> column_ids, map + layout.column_ids, info -> n * sizeof (unsigned int));
+
+  offsets = (uint64_t *) (map + layout.row_offsets);
+  if ((offsets[0] != 0) || (offsets[info -> m_global] != header.nnz)) {
+    fprintf (stderr, "Row offsets of %s do not match the number of pairs.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  first = offsets[info -> row_offset];
+  if (offsets[info -> row_offset + info -> m] < first) {
+    fprintf (stderr, "Row offsets of %s are not in order.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  info -> nnz = offsets[info -> row_offset + info -> m] - first;
+
+  /*  The row offsets can only be used in place if size_t has 64 bits and they start from 0  */
+  if ((sizeof (size_t) == sizeof (uint64_t)) && (first == 0)) {
+    info -> cos_rows = (size_t *) (offsets + info -> row_offset);
+  }
+  else {
+    info -> cos_rows = wmalloc ((info -> m + 1) * sizeof (size_t));
+    for (i = 0; i <= info -> m; i++) {
+      info -> cos_rows[i] = offsets[info -> row_offset + i] - first;
+    }
+  }
+  info -> cos_columns = (unsigned int *) (map + layout.columns) + first;
+  counts = (uint32_t *) (map + layout.counts) + first;
+
+  /*  The log counts can only be used in place if PROBNODE is a double  */
+  have_logs = (header.flags & COFILE_LOG_COUNTS) && (sizeof (PROBNODE) == sizeof (double));
+  if (have_logs) {
+    info -> cos_counts = (PROBNODE *) (map + layout.log_counts) + first;
+  }
+  else {
+    info -> cos_counts = wmalloc (info -> nnz * sizeof (PROBNODE));
+  }
+
+  /*  Every iteration reads all of this process's pairs, so ask for them to be read in now  */
+  (void) madvise (PAGE_START (info -> cos_columns), PAGE_SPAN (info -> cos_columns, info -> nnz * sizeof (unsigned int)), MADV_WILLNEED);
+  if (have_logs) {
+    (void) madvise (PAGE_START (info -> cos_counts), PAGE_SPAN (info -> cos_counts, info -> nnz * sizeof (PROBNODE)), MADV_WILLNEED);
+  }
+  else {
+    (void) madvise (PAGE_START (counts), PAGE_SPAN (counts, info -> nnz * sizeof (uint32_t)), MADV_WILLNEED);
+  }
+
+  /*  The row offsets are checked before the rows are divided among the threads  */
+  for (i = 0; i < info -> m; i++) {
+    if (GET_COS_START (i) > GET_COS_END (i)) {
+      fprintf (stderr, "Co-occurrence file %s has rows out of order.\n", info -> co_fn);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /*  Check the columns; convert the counts if needed.  Each thread
+  **  converts the rows it works on in the EM steps, so that their pages
+  **  are local to it  */
+#if HAVE_OPENMP
+#pragma omp parallel private(i,pos,first_row,last_row) reduction(+:nonzero,sum,bad)
+#endif
+  {
+    threadRows (info, &first_row, &last_row);
+    for (i = first_row; i < last_row; i++) {
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        if (GET_COS_POSITION (pos) >= info -> n) {
+          bad++;
+        }
+        if (counts[pos] != 0) {
+          nonzero++;
+        }
+        sum += counts[pos];
+        if (!have_logs) {
+          info -> cos_counts[pos] = DOLOG (counts[pos]);
+        }
+      }
+    }
+  }
+  if (bad != 0) {
+    fprintf (stderr, "Co-occurrence file %s has %u rows or columns out of range.\n", info -> co_fn, bad);
+    exit (EXIT_FAILURE);
+  }
+
+  if (info -> debug) {
+    for (i = 0; i < info -> m; i++) {
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        fprintf (stderr, "==\t\tRead (%u, %u) --> %u\n", i, GET_COS_POSITION (pos), counts[pos]);
+      }
+    }
+  }
+
+  *nonzero_count = nonzero;
+  *sum_freq = sum;
+
+  return;
+}
+
+
+/*!  Parse the unsigned integers in [p, end), placing them in values unless
+**  it is NULL; returns how many there are, or SIZE_MAX if a character is
+**  neither a digit nor white space  */
+static size_t parseValues (const char *p, const char *end, unsigned int *values) {
+  size_t count = 0;
+  unsigned int value;
+
+  while (p < end) {
+    if ((*p >= '0') && (*p <= '9')) {
+      value = 0;
+      do {
+        value = value * 10 + (unsigned int) (*p - '0');
+        p++;
+      } while ((p < end) && (*p >= '0') && (*p <= '9'));
+      if (values != NULL) {
+        values[count] = value;
+      }
+      count++;
+    }
+    else if ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r')) {
+      p++;
+    }
+    else {
+      return (SIZE_MAX);
+    }
+  }
+
+  return (count);
+}
+
+
+/*!  Start of chunk t of parts, moved forward past any value it splits  */
+static const char *chunkStart (const char *text, size_t len, unsigned int t, unsigned int parts) {
+  const char *p = text + (size_t) (((double) len * t) / parts);
+
+  if (t == 0) {
+    return (text);
+  }
+  while ((p < text + len) && (p[-1] >= '0') && (p[-1] <= '9')) {
+    p++;
+  }
+
+  return (p);
+}
+
+
+/*!
+**  Read a co-occurrence file in text (the same format as readCOLegacy).
+**  The file is mapped and split into chunks at white space; the threads
+**  count the values in their chunks, then parse them into one array at
+**  their offsets.  As the values are one stream, it does not matter how
+**  the rows are broken into lines.  The rows are then found by following
+**  the counts, and the pairs are copied into the CSR arrays in parallel.
+**  The rows are not divided among processes (see readCOFormat).
+*/
+static void readCOText (INFO *info, size_t *nonzero_count, unsigned int *sum_freq) {
+  int fd;
+  struct stat sb;
+  char *text;
+  size_t len;
+  unsigned int parts = 1;
+  size_t *offsets;  /*  First value of each chunk, then the total  */
+  unsigned int *values;
+  size_t *row_values;  /*  Position of the first pair of each row in values  */
+  size_t total;
+  size_t next;
+  size_t nonzero = 0;
+  unsigned int sum = 0;
+  unsigned int bad = 0;
+  unsigned int t;
+  unsigned int g;  /*  Index of a row in the file  */
+  signed int i;  /*  Index into w1  */
+  unsigned int first_row;  /*  Rows of this thread  */
+  unsigned int last_row;
+  size_t pos;  /*  Position among all pairs  */
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  fd = open (info -> co_fn, O_RDONLY);
+  if ((fd == -1) || (fstat (fd, &sb) == -1)) {
+    fprintf (stderr, "Error opening %s.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  len = sb.st_size;
+  text = (len == 0) ? NULL : mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (text == MAP_FAILED) {
+    fprintf (stderr, "Error mapping %s.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  (void) close (fd);
+  if (len != 0) {
+    (void) madvise (text, len, MADV_SEQUENTIAL);
+  }
+
+  /*  Several chunks per thread, so that the work evens out  */
+#if HAVE_OPENMP
+  parts = 4 * omp_get_max_threads ();
+#endif
+  offsets = wmalloc ((parts + 1) * sizeof (size_t));
+
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (t = 0; t < parts; t++) {
+    offsets[t + 1] = parseValues (chunkStart (text, len, t, parts), chunkStart (text, len, t + 1, parts), NULL);
+  }
+  offsets[0] = 0;
+  for (t = 0; t < parts; t++) {
+    if (offsets[t + 1] == SIZE_MAX) {
+      fprintf (stderr, "Co-occurrence file %s has a character that is not part of a number.\n", info -> co_fn);
+      exit (EXIT_FAILURE);
+    }
+    offsets[t + 1] += offsets[t];
+  }
+  total = offsets[parts];
+
+  values = wmalloc ((total + 1) * sizeof (unsigned int));
+#if HAVE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (t = 0; t < parts; t++) {
+    (void) parseValues (chunkStart (text, len, t, parts), chunkStart (text, len, t + 1, parts), values + offsets[t]);
+  }
+  if (text != NULL) {
+    (void) munmap (text, len);
+  }
+  wfree (offsets);
+
+  /*  The header  */
+  if ((total < 2) || (total < 2 + (size_t) values[0] + values[1])) {
+    fprintf (stderr, "Co-occurrence file %s ends before its list of ids.\n", info -> co_fn);
+    exit (EXIT_FAILURE);
+  }
+  shareRows (info, values[0]);
+  info -> n = values[1];
+
+  initializePostInput (info);
+
+  info -> row_ids = wmalloc (info -> m_global * sizeof (unsigned int));
+  info -> column_ids = wmalloc (info -> n * sizeof (unsigned int));
+  memcpy (info -> row_ids, values + 2, info -> m_global * sizeof (unsigned int));
+  memcpy (info -> column_ids, values + 2 + info -> m_global, info -> n * sizeof (unsigned int));
+
+  /*  Follow the counts to find the rows:  [w1 cos_count (w2 c) ...]  */
+  info -> cos_rows = wmalloc ((info -> m + 1) * sizeof (size_t));
+  row_values = wmalloc ((info -> m + 1) * sizeof (size_t));
+  info -> cos_rows[0] = 0;
+  next = 2 + (size_t) info -> m_global + info -> n;
+  for (g = 0; g < info -> row_offset + info -> m; g++) {
+    if (next + 2 > total) {
+      fprintf (stderr, "Not all query terms found!  (%u, %u)\n", g, info -> m_global);
+      exit (EXIT_FAILURE);
+    }
+    if (g >= info -> row_offset) {
+      i = g - info -> row_offset;
+      row_values[i] = next + 2;
+      info -> cos_rows[i + 1] = info -> cos_rows[i] + values[next + 1];
+    }
+    next += 2 + 2 * (size_t) values[next + 1];
+    if (next > total) {
+      fprintf (stderr, "Co-occurrence file %s ends in the middle of row %u.\n", info -> co_fn, g);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  info -> nnz = info -> cos_rows[info -> m];
+  info -> cos_columns = wmalloc (info -> nnz * sizeof (unsigned int));
+  info -> cos_counts = wmalloc (info -> nnz * sizeof (PROBNODE));
+
+  /*  Each thread fills the rows it works on in the EM steps, so that their pages are local to it  */
+#if HAVE_OPENMP
+#pragma omp parallel private(i,pos,next,first_row,last_row) reduction(+:nonzero,sum,bad)
+#endif
+  {
+    threadRows (info, &first_row, &last_row);
+    for (i = first_row; i < last_row; i++) {
+      next = row_values[i];
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        if (values[next] >= info -> n) {
+          bad++;
+        }
+        if (values[next + 1] != 0) {
+          nonzero++;
+        }
+        sum += values[next + 1];
+        SET_COS (pos, values[next], DOLOG (values[next + 1]));
+        next += 2;
+      }
+    }
+  }
+  if (bad != 0) {
+    fprintf (stderr, "Co-occurrence file %s has %u columns out of range (%u).\n", info -> co_fn, bad, info -> n);
     exit (EXIT_FAILURE);
   }
 
+  if (info -> debug) {
+    for (i = 0; i < info -> m; i++) {
+      next = row_values[i];
+      for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+        fprintf (stderr, "==\t\tRead (%u, %u) --> %u\n", i, values[next], values[next + 1]);
+        next += 2;
+      }
+    }
+  }
+
+  wfree (row_values);
+  wfree (values);
+
+  *nonzero_count = nonzero;
+  *sum_freq = sum;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if ((info -> verbose) && (info -> world_id == MAINPROC)) {
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf (stderr, "==\tText parsed:                                    %u rows in %.3f secs (%.0f rows/sec)\n", info -> m_global, secs, (secs > 0) ? info -> m_global / secs : 0.0);
+  }
+
+  return;
+}
+
+
+/*!  Check if the co-occurrence file is in version 2 format  */
+static bool isCOFile (INFO *info) {
+  FILE *fp = NULL;
+  char buffer[sizeof (COFILEHEADER)];
+  size_t len;
+
+  FOPEN (info -> co_fn, fp, "rb");
+  len = fread (buffer, 1, sizeof (COFILEHEADER), fp);
+  FCLOSE (fp);
+
+  return (cofileIsHeader (buffer, len));
+}
+
+
+/*!  Is the pointer inside the mapping of the co-occurrence file?  */
+static bool inMap (INFO *info, void *p) {
+  char *map = info -> co_map;
+
+  return ((map != NULL) && ((char *) p >= map) && ((char *) p < map + info -> co_map_size));
+}
+
+
+/*!  Is the pair held out?  Decided from the ids of its row and column
+**  alone, so that it is the same whatever the format of the file, the
+**  random seed, or the process that reads the row  */
+static bool isHeldOut (unsigned int row_id, unsigned int column_id, PROBNODE fraction) {
+  uint64_t h = ((uint64_t) row_id << 32) | column_id;
+
+  /*  The finalizer of splitmix64  */
+  h ^= h >> 30;
+  h *= UINT64_C (0xbf58476d1ce4e5b9);
+  h ^= h >> 27;
+  h *= UINT64_C (0x94d049bb133111eb);
+  h ^= h >> 31;
+
+  return ((double) (h >> 11) / 9007199254740992.0 < fraction);
+}
+
+
+/*!  Move the fraction --holdout of the pairs out of the co-occurrence
+**  arrays into the list of held-out pairs, which are not trained on and
+**  are evaluated by heldOutML instead.  The arrays are copied, so that
+**  those used in place from a mapped file are not changed  */
+static void holdOut (INFO *info) {
+  size_t *rows;
+  unsigned int *columns;
+  PROBNODE *counts;
+  size_t held = 0;
+  size_t kept = 0;
+  size_t pos;
+  unsigned int i;
+
+  for (i = 0; i < info -> m; i++) {
+    for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+      if (isHeldOut (info -> row_ids[info -> row_offset + i], info -> column_ids[GET_COS_POSITION (pos)], info -> holdout)) {
+        held++;
+      }
+    }
+  }
+
+  rows = wmalloc ((info -> m + 1) * sizeof (size_t));
+  columns = wmalloc ((info -> nnz - held) * sizeof (unsigned int) + 1);
+  counts = wmalloc ((info -> nnz - held) * sizeof (PROBNODE) + 1);
+  info -> held_rows = wmalloc (held * sizeof (unsigned int) + 1);
+  info -> held_columns = wmalloc (held * sizeof (unsigned int) + 1);
+  info -> held_counts = wmalloc (held * sizeof (PROBNODE) + 1);
+  info -> held_nnz = held;
+
+  held = 0;
+  for (i = 0; i < info -> m; i++) {
+    rows[i] = kept;
+    for (pos = GET_COS_START (i); pos < GET_COS_END (i); pos++) {
+      if (isHeldOut (info -> row_ids[info -> row_offset + i], info -> column_ids[GET_COS_POSITION (pos)], info -> holdout)) {
+        info -> held_rows[held] = i;
+        info -> held_columns[held] = GET_COS_POSITION (pos);
+        info -> held_counts[held] = GET_COS (pos);
+        held++;
+      }
+      else {
+        columns[kept] = GET_COS_POSITION (pos);
+        counts[kept] = GET_COS (pos);
+        kept++;
+      }
+    }
+  }
+  rows[info -> m] = kept;
+
+  freeCO (info);
+  info -> cos_rows = rows;
+  info -> cos_columns = columns;
+  info -> cos_counts = counts;
+  info -> nnz = kept;
+
+  return;
+}
+
+
+/*!  Read the co-occurrence data in the format of the file, then set the
+**  held-out pairs aside.  A version 2 file is read as such even with --text
+**  (which then only applies to the output).  Text is not read with the rows
+**  divided among processes, since its rows can only be found by parsing it
+**  from the start, so each process would parse all of it  */
+static void readCOFormat (INFO *info, size_t *nonzero_count, unsigned int *sum_freq) {
+  if (isCOFile (info)) {
+    readCOFile (info, nonzero_count, sum_freq);
+  }
+  else if (info -> textio) {
+    if ((info -> decompose == DECOMPOSE_ROWS) && (info -> world_size > 1)) {
+      if (info -> world_id == MAINPROC) {
+        fprintf (stderr, "==\tError:  A text co-occurrence file cannot be divided by rows; convert it with plsa-convert --text (--text still applies to the output).\n");
+      }
+      exit (EXIT_FAILURE);
+    }
+    readCOText (info, nonzero_count, sum_freq);
+  }
+  else {
+    readCOLegacy (info, nonzero_count, sum_freq);
+  }
+
+  if (info -> holdout > 0.0) {
+    holdOut (info);
+  }
+
+  return;
+}
+
+
+#if HAVE_MPI
+/*!  Processes on the same computer, and the window they share the co-occurrence data in  */
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static MPI_Win co_win = MPI_WIN_NULL;
+
+/*!  Round up to a multiple of 8 bytes, so that each array in the window is aligned  */
+#define ALIGN_8(X) (((X) + 7) & ~((size_t) 7))
+
+/*!  With --shared-input, the first process of each computer reads the
+**  co-occurrence data and the others use its copy, which is moved into
+**  a window of shared memory (MPI_Win_allocate_shared).  If all of the
+**  data is mapped from a version 2 file, the mapping is shared through
+**  the page cache already, so the others map the file themselves  */
+static void readCOShared (INFO *info, size_t *nonzero_count, unsigned int *sum_freq) {
+  unsigned long values[7];
+  size_t rows_bytes;
+  size_t columns_bytes;
+  size_t counts_bytes;
+  MPI_Aint bytes;
+  int disp_unit;
+  char *base;
+  signed int node_id;
+
+  MPI_Comm_split_type (MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, info -> world_id, MPI_INFO_NULL, &node_comm);
+  MPI_Comm_rank (node_comm, &node_id);
+
+  if (node_id == 0) {
+    readCOFormat (info, nonzero_count, sum_freq);
+    values[0] = info -> m;
+    values[1] = info -> n;
+    values[2] = info -> m_global;
+    values[3] = info -> nnz;
+    values[4] = *nonzero_count;
+    values[5] = *sum_freq;
+    values[6] = inMap (info, info -> cos_rows) && inMap (info, info -> cos_columns) && inMap (info, info -> cos_counts);
+  }
+  MPI_Bcast (values, 7, MPI_UNSIGNED_LONG, 0, node_comm);
+
+  if (values[6]) {
+    if (node_id != 0) {
+      readCOFormat (info, nonzero_count, sum_freq);
+    }
+    return;
+  }
+
+  if (node_id != 0) {
+    info -> m = values[0];
+    info -> n = values[1];
+    info -> m_global = values[2];
+    info -> row_offset = 0;
+    info -> nnz = values[3];
+    *nonzero_count = values[4];
+    *sum_freq = values[5];
+    initializePostInput (info);
+    info -> row_ids = wmalloc (info -> m_global * sizeof (unsigned int));
+    info -> column_ids = wmalloc (info -> n * sizeof (unsigned int));
+  }
+  MPI_Bcast (info -> row_ids, info -> m_global, MPI_UNSIGNED, 0, node_comm);
+  MPI_Bcast (info -> column_ids, info -> n, MPI_UNSIGNED, 0, node_comm);
+
+  rows_bytes = ALIGN_8 ((info -> m + 1) * sizeof (size_t));
+  columns_bytes = ALIGN_8 (info -> nnz * sizeof (unsigned int));
+  counts_bytes = info -> nnz * sizeof (PROBNODE);
+  MPI_Win_allocate_shared ((node_id == 0) ? rows_bytes + columns_bytes + counts_bytes : 0, 1, MPI_INFO_NULL, node_comm, &base, &co_win);
+  MPI_Win_shared_query (co_win, 0, &bytes, &disp_unit, &base);
+  MPI_Win_lock_all (MPI_MODE_NOCHECK, co_win);
+
+  /*  The first process moves its copy into the window  */
+  if (node_id == 0) {
+    memcpy (base, info -> cos_rows, (info -> m + 1) * sizeof (size_t));
+    memcpy (base + rows_bytes, info -> cos_columns, info -> nnz * sizeof (unsigned int));
+    memcpy (base + rows_bytes + columns_bytes, info -> cos_counts, counts_bytes);
+    freeCO (info);
+  }
+  MPI_Win_sync (co_win);
+  MPI_Barrier (node_comm);
+  MPI_Win_sync (co_win);
+
+  info -> cos_rows = (size_t *) base;
+  info -> cos_columns = (unsigned int *) (base + rows_bytes);
+  info -> cos_counts = (PROBNODE *) (base + rows_bytes + columns_bytes);
+
+  return;
+}
+#endif
+
+
+/*!  Read the co-occurrence data; the format of a binary file is detected from its first bytes  */
+bool readCO (INFO *info) {
+  size_t nonzero_count = 0;
+  unsigned int sum_freq = 0;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  PROGRESS_MSG ("Reading from co-occurrence file...");
+
+  info -> co_map = NULL;
+  info -> co_map_size = 0;
+#if HAVE_MPI
+  if ((info -> shared_input) && (info -> world_size > 1) && (info -> decompose == DECOMPOSE_CLUSTERS)) {
+    readCOShared (info, &nonzero_count, &sum_freq);
+  }
+  else {
+    readCOFormat (info, &nonzero_count, &sum_freq);
+  }
+#else
+  readCOFormat (info, &nonzero_count, &sum_freq);
+#endif
+  initializeSeed (info);
+
+  /*  p(w1,w2) is only needed for the pairs that were found  */
+  info -> prob_w1w2 = wmalloc (info -> nnz * sizeof (PROBNODE));
+  placeTables (info);
+
   if (info -> verbose) {
-    unsigned int zero_count = (info -> m * info -> n) - nonzero_count;
+    size_t nnz = info -> nnz + info -> held_nnz;
+    size_t held_nnz = info -> held_nnz;
+    unsigned int zero_count;
+
+#if HAVE_MPI
+    /*  With the rows divided, each process has read only some of the pairs  */
+    if ((info -> decompose == DECOMPOSE_ROWS) && (info -> world_size > 1)) {
+      fprintf (stderr, "==\tID %u holds rows %u - %u (%zu pairs).\n", info -> world_id, info -> row_offset, info -> row_offset + info -> m - 1, info -> nnz);
+      MPI_Allreduce (MPI_IN_PLACE, &nnz, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+      MPI_Allreduce (MPI_IN_PLACE, &held_nnz, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+      MPI_Allreduce (MPI_IN_PLACE, &nonzero_count, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+      MPI_Allreduce (MPI_IN_PLACE, &sum_freq, 1, MPI_UNSIGNED, MPI_SUM, MPI_COMM_WORLD);
+    }
+#endif
+    zero_count = (info -> m_global * info -> n) - nonzero_count;
     fprintf (stderr, "==\tID %u finished reading co-occurrence data.\n", info -> world_id);
     if (info -> world_id == MAINPROC) {
-      fprintf (stderr, "==\tMaximum number of pairs:                        %u\n", info -> m * info -> n);
-      fprintf (stderr, "==\tActual number of pairs in data file:            %u\n", found_pairs);
-      fprintf (stderr, "==\tPercentage of zeroes:                           %.2f %% (%u)\n", (double) zero_count / (double) ((info -> m * info -> n)) * 100, zero_count);
+      fprintf (stderr, "==\tInput format:                                   %s\n", (isCOFile (info)) ? ((info -> co_map != NULL) ? "version 2 (mapped)" : "version 2") : ((info -> textio) ? "text" : "legacy binary"));
+#if HAVE_MPI
+      fprintf (stderr, "==\tShared by the processes of each computer:       %s\n", (co_win != MPI_WIN_NULL) ? "yes" : "no");
+#endif
+      fprintf (stderr, "==\tMaximum number of pairs:                        %u\n", info -> m_global * info -> n);
+      fprintf (stderr, "==\tActual number of pairs in data file:            %zu\n", nnz);
+      fprintf (stderr, "==\tPercentage of zeroes:                           %.2f %% (%u)\n", (double) zero_count / (double) ((info -> m_global * info -> n)) * 100, zero_count);
       fprintf (stderr, "==\tSum of co-occurrence counts:                    %u\n", sum_freq);
+      if (info -> holdout > 0.0) {
+        fprintf (stderr, "==\tPairs held out:                                 %zu (%.2f %%)\n", held_nnz, (nnz == 0) ? 0.0 : (double) held_nnz / nnz * 100);
+      }
     }
   }
 
@@ -232,3 +941,49 @@ bool readCO (INFO *info) {
 }
 
 
+/*!  Release the co-occurrence data, whether it was read or mapped  */
+void freeCO (INFO *info) {
+  char *map = info -> co_map;
+
+  /*  Arrays inside the mapping were not allocated  */
+  if (!inMap (info, info -> cos_rows)) {
+    wfree (info -> cos_rows);
+  }
+  if (!inMap (info, info -> cos_columns)) {
+    wfree (info -> cos_columns);
+  }
+  if (!inMap (info, info -> cos_counts)) {
+    wfree (info -> cos_counts);
+  }
+  info -> cos_rows = NULL;
+  info -> cos_columns = NULL;
+  info -> cos_counts = NULL;
+
+  if (map != NULL) {
+    (void) munmap (map, info -> co_map_size);
+    info -> co_map = NULL;
+    info -> co_map_size = 0;
+  }
+
+  return;
+}
+
+
+/*!  Release the window of co-occurrence data shared by the processes of
+**  each computer; must be called by all of them before MPI_Finalize  */
+void freeSharedCO (INFO *info) {
+#if HAVE_MPI
+  if (co_win != MPI_WIN_NULL) {
+    MPI_Win_unlock_all (co_win);
+    MPI_Win_free (&co_win);
+    info -> cos_rows = NULL;
+    info -> cos_columns = NULL;
+    info -> cos_counts = NULL;
+  }
+  if (node_comm != MPI_COMM_NULL) {
+    MPI_Comm_free (&node_comm);
+  }
+#endif
+
+  return;
+}
@@ -21,5 +21,7 @@
 
 void initializePostInput (INFO *info);
 bool readCO (INFO *info);
+void freeCO (INFO *info);
+void freeSharedCO (INFO *info);
 
 #endif
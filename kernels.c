@@ -0,0 +1,556 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Kernels over the cluster dimension.  The dot and scatter kernels work on
+**  the cluster-minor tables used by the linear-space EM steps and all of
+**  their lengths are multiples of KERNEL_WIDTH; the log-sum-exp kernel is
+**  used by the log-space EM steps and takes any length.
+**  The instruction set is chosen at run time; the scalar versions are
+**  always available.
+**
+**  The log-sum-exp kernel evaluates exp with a polynomial after reducing
+**  the argument to [-ln(2)/2, ln(2)/2]; the degree of the polynomial sets
+**  its accuracy (--accuracy).  The legacy version repeats logSumsInline.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "plsa-defn.h"
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+/*!  ln(2) split into a high part (exact when multiplied by small integers) and a low part  */
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define LOG2_E 1.44269504088896338700e+00
+
+/*!  exp of anything smaller than this is 0 in double precision  */
+#define EXP_MIN -708.0
+
+/*!  1.5 * 2^52; adding it to a small integral double puts the integer in the lowest bits  */
+#define EXP_MAGIC 6755399441055744.0
+
+/*!  Largest degree of the polynomials  */
+#define POLY_MAX 13
+
+/*!  Taylor coefficients of exp, 1/d!, for d = 0 .. POLY_MAX  */
+static const double poly_coeff[POLY_MAX + 1] = {
+  1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+  1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800,
+  1.0 / 479001600, 1.0 / 6227020800.0
+};
+
+/*!  Degree of the polynomial for each accuracy; the error after range reduction
+**  is about (ln(2)/2)^(d+1) / (d+1)!, which is 1.2e-7 for 6 and 4e-18 for 13  */
+static const unsigned int poly_degree[] = {0, 6, 13};
+
+/*!  Degree in use, as set by initKernels  */
+static unsigned int degree = POLY_MAX;
+
+
+/********************************************************************/
+/*  Scalar  */
+
+static PROBNODE dotScalar (const PROBNODE *a, const PROBNODE *b, unsigned int len) {
+  PROBNODE sum = 0.0;
+  unsigned int k;
+
+  for (k = 0; k < len; k++) {
+    sum += a[k] * b[k];
+  }
+
+  return (sum);
+}
+
+
+static void scatterScalar (PROBNODE *acc, PROBNODE *row, const PROBNODE *q, const PROBNODE *r, PROBNODE f, unsigned int len) {
+  PROBNODE t;
+  unsigned int k;
+
+  for (k = 0; k < len; k++) {
+    t = f * q[k];
+    row[k] += t;
+    acc[k] += t * r[k];
+  }
+
+  return;
+}
+
+
+/*!  exp (x) for x <= 0 with the polynomial in use  */
+static double expPoly (double x) {
+  double n;
+  double r;
+  double p;
+  double scale;
+  int64_t bits;
+  signed int d;
+
+  if (x < EXP_MIN) {
+    return (0.0);
+  }
+
+  n = floor (x * LOG2_E + 0.5);
+  r = (x - n * LN2_HI) - n * LN2_LO;
+  p = poly_coeff[degree];
+  for (d = degree - 1; d >= 0; d--) {
+    p = p * r + poly_coeff[d];
+  }
+
+  bits = ((int64_t) n + 1023) << 52;
+  memcpy (&scale, &bits, sizeof (double));
+
+  return (p * scale);
+}
+
+
+/*!  Largest of x[0 .. len-1]  */
+static PROBNODE maxScalar (const PROBNODE *x, unsigned int len) {
+  PROBNODE max = -HUGE_VAL;
+  unsigned int k;
+
+  for (k = 0; k < len; k++) {
+    if (x[k] > max) {
+      max = x[k];
+    }
+  }
+
+  return (max);
+}
+
+
+/*!  Log-sum-exp by adding one term at a time with logSumsInline, as in the original program  */
+static PROBNODE logSumExpLegacy (const PROBNODE *x, unsigned int len, PROBNODE limit) {
+  PROBNODE a;
+  PROBNODE b;
+  PROBNODE temp;
+  unsigned int k;
+
+  temp = x[0];
+  for (k = 1; k < len; k++) {
+    if (temp > x[k]) {
+      a = temp;  b = x[k];
+    }
+    else {
+      a = x[k];  b = temp;
+    }
+    temp = (fabs (b - a) > limit) ? a : a + DOLOG1PEXP (b - a);
+  }
+
+  return (temp);
+}
+
+
+static PROBNODE logSumExpScalar (const PROBNODE *x, unsigned int len, PROBNODE limit) {
+  PROBNODE max = maxScalar (x, len);
+  PROBNODE sum = 0.0;
+  unsigned int k;
+
+  if (isinf (max)) {
+    return (max);
+  }
+
+  for (k = 0; k < len; k++) {
+    if (x[k] - max >= -limit) {
+      sum += expPoly (x[k] - max);
+    }
+  }
+
+  return (max + log (sum));
+}
+
+
+#if HAVE_X86_KERNELS
+/********************************************************************/
+/*  SSE2 (2 doubles)  */
+
+__attribute__ ((target ("sse2")))
+static PROBNODE dotSSE2 (const PROBNODE *a, const PROBNODE *b, unsigned int len) {
+  __m128d sum0 = _mm_setzero_pd ();
+  __m128d sum1 = _mm_setzero_pd ();
+  double temp[2];
+  unsigned int k;
+
+  for (k = 0; k < len; k += 4) {
+    sum0 = _mm_add_pd (sum0, _mm_mul_pd (_mm_loadu_pd (a + k), _mm_loadu_pd (b + k)));
+    sum1 = _mm_add_pd (sum1, _mm_mul_pd (_mm_loadu_pd (a + k + 2), _mm_loadu_pd (b + k + 2)));
+  }
+  _mm_storeu_pd (temp, _mm_add_pd (sum0, sum1));
+
+  return (temp[0] + temp[1]);
+}
+
+
+__attribute__ ((target ("sse2")))
+static void scatterSSE2 (PROBNODE *acc, PROBNODE *row, const PROBNODE *q, const PROBNODE *r, PROBNODE f, unsigned int len) {
+  __m128d vf = _mm_set1_pd (f);
+  __m128d t;
+  unsigned int k;
+
+  for (k = 0; k < len; k += 2) {
+    t = _mm_mul_pd (vf, _mm_loadu_pd (q + k));
+    _mm_storeu_pd (row + k, _mm_add_pd (_mm_loadu_pd (row + k), t));
+    _mm_storeu_pd (acc + k, _mm_add_pd (_mm_loadu_pd (acc + k), _mm_mul_pd (t, _mm_loadu_pd (r + k))));
+  }
+
+  return;
+}
+
+
+/********************************************************************/
+/*  AVX2 with FMA (4 doubles)  */
+
+__attribute__ ((target ("avx2,fma")))
+static PROBNODE dotAVX2 (const PROBNODE *a, const PROBNODE *b, unsigned int len) {
+  __m256d sum0 = _mm256_setzero_pd ();
+  __m256d sum1 = _mm256_setzero_pd ();
+  __m128d half;
+  unsigned int k;
+
+  for (k = 0; k < len; k += 8) {
+    sum0 = _mm256_fmadd_pd (_mm256_loadu_pd (a + k), _mm256_loadu_pd (b + k), sum0);
+    sum1 = _mm256_fmadd_pd (_mm256_loadu_pd (a + k + 4), _mm256_loadu_pd (b + k + 4), sum1);
+  }
+  sum0 = _mm256_add_pd (sum0, sum1);
+  half = _mm_add_pd (_mm256_castpd256_pd128 (sum0), _mm256_extractf128_pd (sum0, 1));
+
+  return (_mm_cvtsd_f64 (_mm_add_sd (half, _mm_unpackhi_pd (half, half))));
+}
+
+
+__attribute__ ((target ("avx2,fma")))
+static void scatterAVX2 (PROBNODE *acc, PROBNODE *row, const PROBNODE *q, const PROBNODE *r, PROBNODE f, unsigned int len) {
+  __m256d vf = _mm256_set1_pd (f);
+  __m256d t;
+  unsigned int k;
+
+  for (k = 0; k < len; k += 4) {
+    t = _mm256_mul_pd (vf, _mm256_loadu_pd (q + k));
+    _mm256_storeu_pd (row + k, _mm256_add_pd (_mm256_loadu_pd (row + k), t));
+    _mm256_storeu_pd (acc + k, _mm256_fmadd_pd (t, _mm256_loadu_pd (r + k), _mm256_loadu_pd (acc + k)));
+  }
+
+  return;
+}
+
+
+/*!  exp (x) of four values, x <= 0, with the polynomial in use  */
+__attribute__ ((target ("avx2,fma")))
+static inline __m256d expAVX2 (__m256d x) {
+  __m256d n;
+  __m256d r;
+  __m256d p;
+  __m256i bits;
+  signed int d;
+
+  n = _mm256_round_pd (_mm256_mul_pd (x, _mm256_set1_pd (LOG2_E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  r = _mm256_fnmadd_pd (n, _mm256_set1_pd (LN2_HI), x);
+  r = _mm256_fnmadd_pd (n, _mm256_set1_pd (LN2_LO), r);
+  p = _mm256_set1_pd (poly_coeff[degree]);
+  for (d = degree - 1; d >= 0; d--) {
+    p = _mm256_fmadd_pd (p, r, _mm256_set1_pd (poly_coeff[d]));
+  }
+
+  /*  2^n, built in the exponent bits  */
+  bits = _mm256_castpd_si256 (_mm256_add_pd (n, _mm256_set1_pd (EXP_MAGIC)));
+  bits = _mm256_sub_epi64 (bits, _mm256_castpd_si256 (_mm256_set1_pd (EXP_MAGIC)));
+  bits = _mm256_slli_epi64 (_mm256_add_epi64 (bits, _mm256_set1_epi64x (1023)), 52);
+
+  return (_mm256_mul_pd (p, _mm256_castsi256_pd (bits)));
+}
+
+
+__attribute__ ((target ("avx2,fma")))
+static PROBNODE logSumExpAVX2 (const PROBNODE *x, unsigned int len, PROBNODE limit) {
+  __m256d vmax = _mm256_set1_pd (-HUGE_VAL);
+  __m256d vsum = _mm256_setzero_pd ();
+  __m256d cutoff;
+  __m256d v;
+  __m128d half;
+  PROBNODE max;
+  PROBNODE sum;
+  unsigned int k;
+  unsigned int len4 = len - (len % 4);
+
+  for (k = 0; k < len4; k += 4) {
+    vmax = _mm256_max_pd (vmax, _mm256_loadu_pd (x + k));
+  }
+  half = _mm_max_pd (_mm256_castpd256_pd128 (vmax), _mm256_extractf128_pd (vmax, 1));
+  max = _mm_cvtsd_f64 (_mm_max_sd (half, _mm_unpackhi_pd (half, half)));
+  for (k = len4; k < len; k++) {
+    if (x[k] > max) {
+      max = x[k];
+    }
+  }
+  if (isinf (max)) {
+    return (max);
+  }
+
+  /*  Terms below the cut-off (or below EXP_MIN) contribute nothing  */
+  cutoff = _mm256_set1_pd ((-limit > EXP_MIN) ? -limit : EXP_MIN);
+  for (k = 0; k < len4; k += 4) {
+    v = _mm256_sub_pd (_mm256_loadu_pd (x + k), _mm256_set1_pd (max));
+    vsum = _mm256_add_pd (vsum, _mm256_and_pd (_mm256_cmp_pd (v, cutoff, _CMP_GE_OQ), expAVX2 (_mm256_max_pd (v, cutoff))));
+  }
+  half = _mm_add_pd (_mm256_castpd256_pd128 (vsum), _mm256_extractf128_pd (vsum, 1));
+  sum = _mm_cvtsd_f64 (_mm_add_sd (half, _mm_unpackhi_pd (half, half)));
+  for (k = len4; k < len; k++) {
+    if (x[k] - max >= -limit) {
+      sum += expPoly (x[k] - max);
+    }
+  }
+
+  return (max + log (sum));
+}
+
+
+/********************************************************************/
+/*  AVX-512 (8 doubles)  */
+
+__attribute__ ((target ("avx512f")))
+static PROBNODE dotAVX512 (const PROBNODE *a, const PROBNODE *b, unsigned int len) {
+  __m512d sum = _mm512_setzero_pd ();
+  unsigned int k;
+
+  for (k = 0; k < len; k += 8) {
+    sum = _mm512_fmadd_pd (_mm512_loadu_pd (a + k), _mm512_loadu_pd (b + k), sum);
+  }
+
+  return (_mm512_reduce_add_pd (sum));
+}
+
+
+__attribute__ ((target ("avx512f")))
+static void scatterAVX512 (PROBNODE *acc, PROBNODE *row, const PROBNODE *q, const PROBNODE *r, PROBNODE f, unsigned int len) {
+  __m512d vf = _mm512_set1_pd (f);
+  __m512d t;
+  unsigned int k;
+
+  for (k = 0; k < len; k += 8) {
+    t = _mm512_mul_pd (vf, _mm512_loadu_pd (q + k));
+    _mm512_storeu_pd (row + k, _mm512_add_pd (_mm512_loadu_pd (row + k), t));
+    _mm512_storeu_pd (acc + k, _mm512_fmadd_pd (t, _mm512_loadu_pd (r + k), _mm512_loadu_pd (acc + k)));
+  }
+
+  return;
+}
+
+
+/*!  exp (x) of eight values, x <= 0, with the polynomial in use  */
+__attribute__ ((target ("avx512f")))
+static inline __m512d expAVX512 (__m512d x) {
+  __m512d n;
+  __m512d r;
+  __m512d p;
+  __m512i bits;
+  signed int d;
+
+  n = _mm512_roundscale_pd (_mm512_mul_pd (x, _mm512_set1_pd (LOG2_E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  r = _mm512_fnmadd_pd (n, _mm512_set1_pd (LN2_HI), x);
+  r = _mm512_fnmadd_pd (n, _mm512_set1_pd (LN2_LO), r);
+  p = _mm512_set1_pd (poly_coeff[degree]);
+  for (d = degree - 1; d >= 0; d--) {
+    p = _mm512_fmadd_pd (p, r, _mm512_set1_pd (poly_coeff[d]));
+  }
+
+  /*  2^n, built in the exponent bits  */
+  bits = _mm512_castpd_si512 (_mm512_add_pd (n, _mm512_set1_pd (EXP_MAGIC)));
+  bits = _mm512_sub_epi64 (bits, _mm512_castpd_si512 (_mm512_set1_pd (EXP_MAGIC)));
+  bits = _mm512_slli_epi64 (_mm512_add_epi64 (bits, _mm512_set1_epi64 (1023)), 52);
+
+  return (_mm512_mul_pd (p, _mm512_castsi512_pd (bits)));
+}
+
+
+__attribute__ ((target ("avx512f")))
+static PROBNODE logSumExpAVX512 (const PROBNODE *x, unsigned int len, PROBNODE limit) {
+  __m512d vmax = _mm512_set1_pd (-HUGE_VAL);
+  __m512d vsum = _mm512_setzero_pd ();
+  __m512d cutoff;
+  __m512d v;
+  __mmask8 keep;
+  PROBNODE max;
+  PROBNODE sum;
+  unsigned int k;
+  unsigned int len8 = len - (len % 8);
+
+  for (k = 0; k < len8; k += 8) {
+    vmax = _mm512_max_pd (vmax, _mm512_loadu_pd (x + k));
+  }
+  max = _mm512_reduce_max_pd (vmax);
+  for (k = len8; k < len; k++) {
+    if (x[k] > max) {
+      max = x[k];
+    }
+  }
+  if (isinf (max)) {
+    return (max);
+  }
+
+  /*  Terms below the cut-off (or below EXP_MIN) contribute nothing  */
+  cutoff = _mm512_set1_pd ((-limit > EXP_MIN) ? -limit : EXP_MIN);
+  for (k = 0; k < len8; k += 8) {
+    v = _mm512_sub_pd (_mm512_loadu_pd (x + k), _mm512_set1_pd (max));
+    keep = _mm512_cmp_pd_mask (v, cutoff, _CMP_GE_OQ);
+    vsum = _mm512_mask_add_pd (vsum, keep, vsum, expAVX512 (_mm512_max_pd (v, cutoff)));
+  }
+  sum = _mm512_reduce_add_pd (vsum);
+  for (k = len8; k < len; k++) {
+    if (x[k] - max >= -limit) {
+      sum += expPoly (x[k] - max);
+    }
+  }
+
+  return (max + log (sum));
+}
+#endif
+
+
+/********************************************************************/
+
+static const char *simd_names[] = {"auto", "scalar", "sse2", "avx2", "avx512"};
+
+static const char *accuracy_names[] = {"legacy", "fast", "double"};
+
+
+/*!  Name of an instruction set  */
+const char *kernelsName (unsigned int simd) {
+  if (simd > SIMD_AVX512) {
+    return ("unknown");
+  }
+
+  return (simd_names[simd]);
+}
+
+
+/*!  Find the instruction set with the given name; false if there is none  */
+bool kernelsLookup (const char *name, unsigned int *simd) {
+  unsigned int i;
+
+  for (i = SIMD_AUTO; i <= SIMD_AVX512; i++) {
+    if (strcmp (name, simd_names[i]) == 0) {
+      *simd = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/*!  Name of an accuracy  */
+const char *accuracyName (unsigned int accuracy) {
+  if (accuracy > ACCURACY_DOUBLE) {
+    return ("unknown");
+  }
+
+  return (accuracy_names[accuracy]);
+}
+
+
+/*!  Find the accuracy with the given name; false if there is none  */
+bool accuracyLookup (const char *name, unsigned int *accuracy) {
+  unsigned int i;
+
+  for (i = ACCURACY_LEGACY; i <= ACCURACY_DOUBLE; i++) {
+    if (strcmp (name, accuracy_names[i]) == 0) {
+      *accuracy = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/*!  Check if the processor supports an instruction set  */
+static bool kernelsSupported (unsigned int simd) {
+#if HAVE_X86_KERNELS
+  __builtin_cpu_init ();
+  switch (simd) {
+    case SIMD_SCALAR:
+      return true;
+    case SIMD_SSE2:
+      return (__builtin_cpu_supports ("sse2"));
+    case SIMD_AVX2:
+      return ((__builtin_cpu_supports ("avx2")) && (__builtin_cpu_supports ("fma")));
+    case SIMD_AVX512:
+      return (__builtin_cpu_supports ("avx512f"));
+  }
+  return false;
+#else
+  return (simd == SIMD_SCALAR);
+#endif
+}
+
+
+/*!  Select the kernels; the best instruction set available is used for SIMD_AUTO  */
+void initKernels (INFO *info) {
+  if (info -> simd == SIMD_AUTO) {
+    info -> simd = SIMD_AVX512;
+    while (!kernelsSupported (info -> simd)) {
+      info -> simd--;
+    }
+  }
+  else if (!kernelsSupported (info -> simd)) {
+    fprintf (stderr, "==\tWarning:  The processor does not support %s; using scalar kernels.\n", kernelsName (info -> simd));
+    info -> simd = SIMD_SCALAR;
+  }
+
+  degree = poly_degree[info -> accuracy];
+
+  /*  There is no SSE2 version of log-sum-exp  */
+  info -> kernels.dot = dotScalar;
+  info -> kernels.scatter = scatterScalar;
+  info -> kernels.logSumExp = logSumExpScalar;
+#if HAVE_X86_KERNELS
+  switch (info -> simd) {
+    case SIMD_SSE2:
+      info -> kernels.dot = dotSSE2;
+      info -> kernels.scatter = scatterSSE2;
+      break;
+    case SIMD_AVX2:
+      info -> kernels.dot = dotAVX2;
+      info -> kernels.scatter = scatterAVX2;
+      info -> kernels.logSumExp = logSumExpAVX2;
+      break;
+    case SIMD_AVX512:
+      info -> kernels.dot = dotAVX512;
+      info -> kernels.scatter = scatterAVX512;
+      info -> kernels.logSumExp = logSumExpAVX512;
+      break;
+  }
+#endif
+  if (info -> accuracy == ACCURACY_LEGACY) {
+    info -> kernels.logSumExp = logSumExpLegacy;
+  }
+
+  return;
+}
@@ -27,14 +27,15 @@
 #include <mpi.h>
 #endif
 
-#if HAVE_OPENMP
-#include <omp.h>
-#endif
-
 #include "plsa-defn.h"
 #include "wmalloc.h"
 #include "parameters.h"
 #include "run.h"
+#include "stream.h"
+#include "foldin.h"
+#include "online.h"
+#include "restarts.h"
+#include "topology.h"
 
 
 /*!  Main function  */
@@ -51,10 +52,8 @@ int main (int argc, char *argv[]) {
   MPI_Comm_size (MPI_COMM_WORLD, &(info -> world_size));
 #endif
 
-#if HAVE_OPENMP
-  info -> threads = omp_get_num_procs ();
-  omp_set_num_threads (info -> threads);
-#endif
+  /*  Divide the processors among the processes of each computer  */
+  initTopology (info);
 
   /*  Process the command line parameters and then check them;
   **  if either fail then print usage information  */
@@ -62,8 +61,23 @@ int main (int argc, char *argv[]) {
     usage (argv[0]);
   }
   else {
-    result = run (info);
+    if (info -> pin) {
+      pinThreads (info);
+    }
+    if (info -> foldin_fn != NULL) {
+      result = foldIn (info);
+    }
+    else if (info -> online_rows > 0) {
+      result = runOnline (info);
+    }
+    else if (info -> restarts > 1) {
+      result = runRestarts (info);
+    }
+    else {
+      result = run (info);
+    }
   }
+  freeTopology (info);
 
 #if HAVE_MPI
   MPI_Finalize ();
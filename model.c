@@ -0,0 +1,249 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "model.h"
+
+/*!  Round X up to a multiple of 8  */
+#define ALIGN8(X) ((((X) + 7) / 8) * 8)
+
+/*!  An id and its index, for modelMapIds  */
+typedef struct modelid {
+  uint32_t id;
+  uint32_t index;
+} MODELID;
+
+
+void modelInitHeader (MODELHEADER *header, uint32_t m, uint32_t n, uint32_t k) {
+  memset (header, 0, sizeof (MODELHEADER));
+  memcpy (header -> magic, MODEL_MAGIC, MODEL_MAGIC_LEN);
+  header -> version = MODEL_VERSION;
+  header -> m = m;
+  header -> n = n;
+  header -> k = k;
+
+  return;
+}
+
+
+/*!  Calculate where each section of a file with this header starts  */
+void modelLayout (const MODELHEADER *header, MODELLAYOUT *layout) {
+  layout -> row_ids = ALIGN8 (sizeof (MODELHEADER));
+  layout -> column_ids = layout -> row_ids + (uint64_t) header -> m * sizeof (uint32_t);
+  layout -> probz = ALIGN8 (layout -> column_ids + (uint64_t) header -> n * sizeof (uint32_t));
+  layout -> probw1_z = layout -> probz + (uint64_t) header -> k * sizeof (double);
+  layout -> probw2_z = layout -> probw1_z + (uint64_t) header -> k * header -> m * sizeof (double);
+  layout -> size = layout -> probw2_z + (uint64_t) header -> k * header -> n * sizeof (double);
+
+  return;
+}
+
+
+/*!  Check if the buffer starts with the magic bytes of a model file  */
+bool modelIsHeader (const void *buffer, size_t len) {
+  const MODELHEADER *header = buffer;
+
+  if (len < sizeof (MODELHEADER)) {
+    return false;
+  }
+
+  return (memcmp (header -> magic, MODEL_MAGIC, MODEL_MAGIC_LEN) == 0);
+}
+
+
+/*!  Map a model file for reading; NULL (with a message) if it cannot be used  */
+MODEL *modelOpen (const char *fn) {
+  MODEL *model;
+  MODELLAYOUT layout;
+  struct stat sb;
+  char *map;
+  int fd;
+
+  fd = open (fn, O_RDONLY);
+  if (fd < 0) {
+    fprintf (stderr, "Error opening %s.\n", fn);
+    return (NULL);
+  }
+  if ((fstat (fd, &sb) != 0) || (sb.st_size < (off_t) sizeof (MODELHEADER))) {
+    fprintf (stderr, "Model file %s is too short.\n", fn);
+    close (fd);
+    return (NULL);
+  }
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    fprintf (stderr, "Error mapping %s.\n", fn);
+    return (NULL);
+  }
+
+  if (!modelIsHeader (map, sb.st_size)) {
+    fprintf (stderr, "%s is not a model file.\n", fn);
+    munmap (map, sb.st_size);
+    return (NULL);
+  }
+
+  model = malloc (sizeof (MODEL));
+  if (model == NULL) {
+    munmap (map, sb.st_size);
+    return (NULL);
+  }
+  memcpy (&(model -> header), map, sizeof (MODELHEADER));
+  if (model -> header.version != MODEL_VERSION) {
+    fprintf (stderr, "Model file %s has version %u; only version %u can be read.\n", fn, model -> header.version, MODEL_VERSION);
+    munmap (map, sb.st_size);
+    free (model);
+    return (NULL);
+  }
+  modelLayout (&(model -> header), &layout);
+  if (layout.size > (uint64_t) sb.st_size) {
+    fprintf (stderr, "Model file %s is truncated.\n", fn);
+    munmap (map, sb.st_size);
+    free (model);
+    return (NULL);
+  }
+
+  model -> row_ids = (const uint32_t *) (map + layout.row_ids);
+  model -> column_ids = (const uint32_t *) (map + layout.column_ids);
+  model -> probz = (const double *) (map + layout.probz);
+  model -> probw1_z = (const double *) (map + layout.probw1_z);
+  model -> probw2_z = (const double *) (map + layout.probw2_z);
+  model -> map = map;
+  model -> map_size = sb.st_size;
+
+  return (model);
+}
+
+
+void modelClose (MODEL *model) {
+  if (model == NULL) {
+    return;
+  }
+  munmap (model -> map, model -> map_size);
+  free (model);
+
+  return;
+}
+
+
+/*!  log (e^x + e^y)  */
+static double logAdd (double x, double y) {
+  if (x < y) {
+    double t = x;
+
+    x = y;
+    y = t;
+  }
+  if (isinf (y)) {
+    return (x);
+  }
+
+  return (x + log1p (exp (y - x)));
+}
+
+
+/*!  log p(i,j) of row i and column j (indices, not ids)  */
+double modelProb (const MODEL *model, uint32_t i, uint32_t j) {
+  const MODELHEADER *header = &(model -> header);
+  double result = -HUGE_VAL;
+  uint32_t k;
+
+  for (k = 0; k < header -> k; k++) {
+    result = logAdd (result, model -> probz[k] + model -> probw1_z[(size_t) k * header -> m + i] + model -> probw2_z[(size_t) k * header -> n + j]);
+  }
+
+  return (result);
+}
+
+
+/*!  log p(i,j) of every column j of row i (an index) into row, which has n values  */
+void modelRow (const MODEL *model, uint32_t i, double *row) {
+  const MODELHEADER *header = &(model -> header);
+  const double *probw2_z;
+  double weight;
+  uint32_t j;
+  uint32_t k;
+
+  for (j = 0; j < header -> n; j++) {
+    row[j] = -HUGE_VAL;
+  }
+  for (k = 0; k < header -> k; k++) {
+    weight = model -> probz[k] + model -> probw1_z[(size_t) k * header -> m + i];
+    probw2_z = model -> probw2_z + (size_t) k * header -> n;
+    for (j = 0; j < header -> n; j++) {
+      row[j] = logAdd (row[j], weight + probw2_z[j]);
+    }
+  }
+
+  return;
+}
+
+
+static int compareIds (const void *a, const void *b) {
+  const MODELID *x = a;
+  const MODELID *y = b;
+
+  return ((x -> id > y -> id) - (x -> id < y -> id));
+}
+
+
+/*!  Find each of count ids among the model_count ids of a model (row or
+**  column ids) and place its index into map, or UINT32_MAX if it is not
+**  there; returns the number found  */
+uint32_t modelMapIds (const uint32_t *model_ids, uint32_t model_count, const uint32_t *ids, uint32_t count, uint32_t *map) {
+  MODELID *sorted;
+  MODELID key;
+  MODELID *found;
+  uint32_t matched = 0;
+  uint32_t i;
+
+  sorted = malloc ((size_t) model_count * sizeof (MODELID) + 1);
+  if (sorted == NULL) {
+    fprintf (stderr, "Error allocating the ids of a model.\n");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < model_count; i++) {
+    sorted[i].id = model_ids[i];
+    sorted[i].index = i;
+  }
+  qsort (sorted, model_count, sizeof (MODELID), compareIds);
+
+  for (i = 0; i < count; i++) {
+    key.id = ids[i];
+    found = bsearch (&key, sorted, model_count, sizeof (MODELID), compareIds);
+    if (found != NULL) {
+      map[i] = found -> index;
+      matched++;
+    }
+    else {
+      map[i] = UINT32_MAX;
+    }
+  }
+  free (sorted);
+
+  return (matched);
+}
@@ -0,0 +1,93 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Model file:  the factored result of PLSA, from which any p(x,y) can be
+**  calculated.  All values are in the byte order of the machine that wrote
+**  the file and each section starts at a multiple of 8 bytes:
+**
+**    header        MODELHEADER
+**    row ids       uint32_t [m]
+**    column ids    uint32_t [n]
+**    p(z)          double [k]
+**    p(w1|z)       double [k][m]   (cluster by cluster, as probw1_z)
+**    p(w2|z)       double [k][n]   (cluster by cluster, as probw2_z)
+**
+**  The probabilities are logs.  This file and model.c do not depend on the
+**  rest of the program, so that other programs can read models.
+*/
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*!  First bytes of a model file  */
+#define MODEL_MAGIC "PLSA-MD"
+#define MODEL_MAGIC_LEN 8
+#define MODEL_VERSION 1
+
+typedef struct modelheader {
+  char magic[MODEL_MAGIC_LEN];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t m;
+  uint32_t n;
+  uint32_t k;
+  /*!  Random seed of the initial probabilities  */
+  uint32_t seed;
+  /*!  Number of EM steps applied  */
+  uint32_t iterations;
+  uint32_t reserved;
+  /*!  Log likelihood of the co-occurrence data under the model  */
+  double likelihood;
+} MODELHEADER;
+
+/*!  Byte offsets of the sections of a file and its total size  */
+typedef struct modellayout {
+  uint64_t row_ids;
+  uint64_t column_ids;
+  uint64_t probz;
+  uint64_t probw1_z;
+  uint64_t probw2_z;
+  uint64_t size;
+} MODELLAYOUT;
+
+/*!  A model file opened for reading; the arrays point into its mapping  */
+typedef struct model {
+  MODELHEADER header;
+  const uint32_t *row_ids;
+  const uint32_t *column_ids;
+  const double *probz;
+  const double *probw1_z;
+  const double *probw2_z;
+  void *map;
+  size_t map_size;
+} MODEL;
+
+void modelInitHeader (MODELHEADER *header, uint32_t m, uint32_t n, uint32_t k);
+void modelLayout (const MODELHEADER *header, MODELLAYOUT *layout);
+bool modelIsHeader (const void *buffer, size_t len);
+MODEL *modelOpen (const char *fn);
+void modelClose (MODEL *model);
+double modelProb (const MODEL *model, uint32_t i, uint32_t j);
+void modelRow (const MODEL *model, uint32_t i, double *row);
+uint32_t modelMapIds (const uint32_t *model_ids, uint32_t model_count, const uint32_t *ids, uint32_t count, uint32_t *map);
+
+#endif
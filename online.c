@@ -0,0 +1,538 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Online EM:  instead of an EM step over all pairs, the rows of the
+**  co-occurrence file are read (see stream.c) and used a batch of
+**  --online rows at a time.  p(z|w1) of each row of a batch is found as
+**  in fold-in, with ONLINE_ROW_STEPS EM steps, and the expected counts of
+**  the pairs of the batch, as a share of the batch, are blended into the
+**  statistics of the model:
+**
+**    S(w2,z) = (1 - a) S(w2,z) + a s(w2,z),  a = (t + 2)^-decay
+**
+**  for batch t, from which p(z) = sum S(w2,z) and p(w2|z) = S(w2,z) / p(z).
+**  So the model improves with every batch, and is usable after one pass
+**  over the rows; up to --maxiter passes are made, until the log
+**  likelihood of a pass changes by less than ML_DELTA percent.  Only the
+**  rows of two batches are in memory at once.
+**
+**  S is kept as scale x T, so that the decay (1 - a) is one multiplication
+**  of scale and only the columns of the batch's pairs change in T; the
+**  sums of T over the columns are kept as they change, and p(w2|z) is
+**  given to the rows as log T less the log of that sum.  The expected
+**  counts are kept per pair of the batch and added up by column.  T is
+**  multiplied out when scale falls below ONLINE_MIN_SCALE.
+**
+**  p(w1|z) is not part of the statistics:  it is found at the end from
+**  p(z|w1) of each row, as last seen, and the number of pairs of the row.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>                                  /*  UINT_MAX  */
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>  /*  DBL_EPSILON  */
+#include <time.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "em-steps.h"
+#include "output.h"
+#include "stream.h"
+#include "foldin.h"
+#include "online.h"
+
+
+/*!  The expected counts of the pairs of row r of the batch, with p(z|w1)
+**  of the row and log p(w2|z) = probw2 - shift, into pairs (the k values
+**  of each pair together).  post has room for k values  */
+static void addRowCounts (const double *probw2, const double *shift, unsigned int k, STREAMBATCH *batch, unsigned int r, double *pairs, double *post) {
+  const PROBNODE *topics = batch -> topics + (size_t) r * k;
+  const double *column;
+  double *counts;
+  double top;
+  double sum;
+  unsigned int z;
+  size_t pos;
+
+  for (pos = batch -> starts[r]; pos < batch -> starts[r + 1]; pos++) {
+    column = probw2 + (size_t) batch -> columns[pos] * k;
+    counts = pairs + pos * k;
+    top = -HUGE_VAL;
+    for (z = 0; z < k; z++) {
+      post[z] = topics[z] + column[z] - shift[z];
+      if (post[z] > top) {
+        top = post[z];
+      }
+    }
+    if (isinf (top)) {
+      for (z = 0; z < k; z++) {
+        counts[z] = 0.0;
+      }
+      continue;
+    }
+    sum = 0.0;
+    for (z = 0; z < k; z++) {
+      post[z] = exp (post[z] - top);
+      sum += post[z];
+    }
+    for (z = 0; z < k; z++) {
+      counts[z] = batch -> counts[pos] * post[z] / sum;
+    }
+  }
+
+  return;
+}
+
+
+/*!  Make room in pairs and order for the pairs of both batches  */
+static void growPairs (STREAMBATCH *batch, unsigned int k, double **pairs, size_t **order, size_t *room) {
+  size_t needed = (batch[0].capacity > batch[1].capacity) ? batch[0].capacity : batch[1].capacity;
+
+  if (needed > *room) {
+    *pairs = wrealloc (*pairs, needed * k * sizeof (double));
+    *order = wrealloc (*order, needed * sizeof (size_t));
+    *room = needed;
+  }
+
+  return;
+}
+
+
+/*!  List the columns of the pairs of the batch in touched, and the pairs
+**  of column touched[c] from order[starts[c]] to order[starts[c + 1]]
+**  (in the order of the batch).  stamp and slots have a value for each
+**  column; a column is in the batch if its stamp is serial.  Returns the
+**  number of columns  */
+static unsigned int indexColumns (STREAMBATCH *batch, unsigned int serial, unsigned int *stamp, unsigned int *slots, unsigned int *touched, size_t *starts, size_t *order) {
+  size_t count = batch -> starts[batch -> rows];
+  unsigned int columns = 0;
+  unsigned int c;
+  unsigned int j;
+  size_t pos;
+
+  starts[0] = 0;
+  for (pos = 0; pos < count; pos++) {
+    j = batch -> columns[pos];
+    if (stamp[j] != serial) {
+      stamp[j] = serial;
+      slots[j] = columns;
+      touched[columns] = j;
+      columns++;
+      starts[columns] = 0;
+    }
+    starts[slots[j] + 1]++;
+  }
+  for (c = 0; c < columns; c++) {
+    starts[c + 1] += starts[c];
+  }
+
+  /*  Each start is moved up while its pairs are placed, then back  */
+  for (pos = 0; pos < count; pos++) {
+    order[starts[slots[batch -> columns[pos]]]++] = pos;
+  }
+  for (c = columns; c > 0; c--) {
+    starts[c] = starts[c - 1];
+  }
+  starts[0] = 0;
+
+  return (columns);
+}
+
+
+/*!  p(w1|z) from p(z|w1) of each row (in *current*) and the number of
+**  pairs of each row, as logs of at least MIN_PROB  */
+static void rowsToProbW1Z (INFO *info, const double *totals) {
+  unsigned int num_clusters = info -> num_clusters;
+  double smallest = log (MIN_PROB);
+  double shift;
+  double sum;
+  unsigned int i;  /*  Index into w1  */
+  unsigned int k;  /*  Index into clusters  */
+
+#if HAVE_OPENMP
+#pragma omp parallel for private(i,shift,sum)
+#endif
+  for (k = 0; k < num_clusters; k++) {
+    sum = 0.0;
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) = (totals[i] > 0.0) ? GET_PROBW1_Z_CURR (k, i) + log (totals[i]) : -HUGE_VAL;
+      sum += exp (GET_PROBW1_Z_CURR (k, i));
+    }
+    shift = (sum > 0.0) ? log (sum) : 0.0;
+    for (i = 0; i < info -> m; i++) {
+      GET_PROBW1_Z_CURR (k, i) -= shift;
+      if (GET_PROBW1_Z_CURR (k, i) < smallest) {
+        GET_PROBW1_Z_CURR (k, i) = smallest;
+      }
+    }
+  }
+
+  return;
+}
+
+
+bool runOnline (INFO *info) {
+  unsigned int k = info -> num_clusters;
+  STREAM stream;
+  STREAMBATCH batch[2];
+  double *probz;  /*  log p(z)  */
+  double *probw2;  /*  log T, column by column  */
+  double *stats;  /*  T:  the share of the pairs of each column and latent state, divided by scale  */
+  double *sums;  /*  Sum of T over the columns  */
+  double *norms;  /*  Log of sums:  log p(w2|z) = log T - norms  */
+  double *adds;  /*  What each thread added to sums for the batch  */
+  double *pairs = NULL;  /*  Expected counts of each pair of the batch  */
+  double *totals;  /*  Number of pairs of each row  */
+  double scale = 1.0;
+  size_t room = 0;  /*  Pairs that pairs and order have room for  */
+  size_t *order = NULL;  /*  Pairs of the batch by column  */
+  size_t *starts;  /*  First of order of each column of the batch  */
+  unsigned int *stamp;  /*  Serial number of the last batch with each column  */
+  unsigned int *slots;  /*  Place of each column in touched  */
+  unsigned int *touched;  /*  Columns of the batch  */
+  unsigned int columns = 0;
+  unsigned int serial = 0;
+  unsigned int threads = 1;
+  unsigned int batches;
+  unsigned int steps = 0;  /*  Batches used so far  */
+  unsigned int pass;
+  double rate = 0.0;
+  double share = 0.0;  /*  Weight of the counts of the batch in T  */
+  double mass;
+  double entropy;  /*  Sum of n(w1) log n(w1)  */
+  double likelihood;
+  double prev_likelihood = 0.0;
+  double smallest = log (MIN_PROB);
+  unsigned int b;
+  unsigned int i;
+  unsigned int j;
+  unsigned int z;
+  time_t start;
+  time_t end;
+
+  /*  The rows are read and used by the threads of one process  */
+  if (info -> world_id != MAINPROC) {
+    return true;
+  }
+  if (info -> world_size > 1) {
+    fprintf (stderr, "==\tWarning:  Online EM is run by the first MPI process only.\n");
+  }
+  if (info -> snapshot != UINT_MAX) {
+    fprintf (stderr, "==\tWarning:  --snapshot is ignored by online EM.\n");
+  }
+  info -> decompose = DECOMPOSE_CLUSTERS;
+  info -> block_start = 0;
+  info -> block_end = k - 1;
+  info -> block_size = k;
+
+  time (&start);
+  openStream (info, &stream);
+  info -> m = stream.m;
+  info -> m_global = stream.m;
+  info -> row_offset = 0;
+  info -> n = stream.n;
+  info -> row_ids = stream.row_ids;
+  info -> column_ids = stream.column_ids;
+  stream.row_ids = NULL;
+  stream.column_ids = NULL;
+
+  if (info -> seed == UINT_MAX) {
+    info -> seed = time (NULL);
+    if (info -> verbose) {
+      fprintf (stderr, "==\tApplying seed from time:                        %u\n", info -> seed);
+    }
+  }
+  srand (info -> seed);
+
+  info -> probz_curr = wmalloc (k * sizeof (PROBNODE));
+  info -> probw1_z_curr = wmalloc ((size_t) k * info -> m * sizeof (PROBNODE) + 1);
+  info -> probw2_z_curr = wmalloc ((size_t) k * info -> n * sizeof (PROBNODE) + 1);
+  initEM (info);
+
+  /*  The statistics start as p(w2,z) of the initial model  */
+  probz = wmalloc (k * sizeof (double));
+  sums = wmalloc (k * sizeof (double));
+  norms = wmalloc (k * sizeof (double));
+  probw2 = wmalloc ((size_t) info -> n * k * sizeof (double) + 1);
+  stats = wmalloc ((size_t) info -> n * k * sizeof (double) + 1);
+  totals = wmalloc (info -> m * sizeof (double) + 1);
+  for (z = 0; z < k; z++) {
+    probz[z] = GET_PROBZ_CURR (z);
+    sums[z] = 0.0;
+  }
+  for (j = 0; j < info -> n; j++) {
+    for (z = 0; z < k; z++) {
+      stats[(size_t) j * k + z] = exp (probz[z] + GET_PROBW2_Z_CURR (z, j));
+      probw2[(size_t) j * k + z] = log (stats[(size_t) j * k + z]);
+      sums[z] += stats[(size_t) j * k + z];
+    }
+  }
+  for (z = 0; z < k; z++) {
+    norms[z] = log (sums[z]);
+  }
+  for (i = 0; i < info -> m; i++) {
+    totals[i] = 0.0;
+  }
+
+  stamp = wmalloc (info -> n * sizeof (unsigned int) + 1);
+  slots = wmalloc (info -> n * sizeof (unsigned int) + 1);
+  touched = wmalloc (info -> n * sizeof (unsigned int) + 1);
+  starts = wmalloc ((info -> n + 1) * sizeof (size_t));
+  for (j = 0; j < info -> n; j++) {
+    stamp[j] = 0;
+  }
+
+#if HAVE_OPENMP
+  threads = omp_get_max_threads ();
+#endif
+  adds = wmalloc (threads * k * sizeof (double));
+  memset (adds, 0, threads * k * sizeof (double));
+  for (b = 0; b < 2; b++) {
+    initStreamBatch (&(batch[b]), info -> online_rows, k);
+  }
+  batches = (info -> m + info -> online_rows - 1) / info -> online_rows;
+
+  for (pass = 1; pass <= info -> maxiter; pass++) {
+    if ((pass > 1) && (!rewindStream (&stream))) {
+      fprintf (stderr, "==\tWarning:  The standard input can be read only once; stopping after one pass.\n");
+      break;
+    }
+    likelihood = 0.0;
+    mass = 0.0;
+    entropy = 0.0;
+    if (batches > 0) {
+      readStream (&stream, &(batch[0]));
+    }
+    growPairs (batch, k, &pairs, &order, &room);
+
+#if HAVE_OPENMP
+#pragma omp parallel private(b,i,j,z) reduction(+:likelihood)
+#endif
+    {
+      double *work = wmalloc (3 * k * sizeof (double));
+      double *my_adds = adds;
+      double ll;
+      double sum;
+      size_t pos;
+      unsigned int c;
+      unsigned int t;
+
+#if HAVE_OPENMP
+      my_adds = adds + (size_t) omp_get_thread_num () * k;
+#endif
+
+      /*  Batch b is used while batch b + 1 is read; the end of the loop
+      **  over the rows of batch b waits for both  */
+      for (b = 0; b < batches; b++) {
+        STREAMBATCH *curr = &(batch[b % 2]);
+
+#if HAVE_OPENMP
+#pragma omp single nowait
+#endif
+        if (b + 1 < batches) {
+          readStream (&stream, &(batch[(b + 1) % 2]));
+        }
+
+        for (z = 0; z < k; z++) {
+          my_adds[z] = 0.0;
+        }
+
+#if HAVE_OPENMP
+#pragma omp for schedule(static,16)
+#endif
+        for (i = 0; i < curr -> rows; i++) {
+          (void) foldInRow (probz, probw2, norms, k, curr, i, ONLINE_ROW_STEPS, work, &ll);
+          likelihood += ll;
+          addRowCounts (probw2, norms, k, curr, i, pairs, work);
+          for (z = 0; z < k; z++) {
+            GET_PROBW1_Z_CURR (z, curr -> first + i) = curr -> topics[(size_t) i * k + z];
+          }
+        }
+
+#if HAVE_OPENMP
+#pragma omp single
+#endif
+        {
+          share = 0.0;
+          for (i = 0; i < curr -> rows; i++) {
+            sum = 0.0;
+            for (pos = curr -> starts[i]; pos < curr -> starts[i + 1]; pos++) {
+              sum += curr -> counts[pos];
+            }
+            totals[curr -> first + i] = sum;
+            share += sum;
+            if (sum > 0.0) {
+              entropy += sum * log (sum);
+            }
+          }
+          mass += share;
+          if (share > 0.0) {
+            rate = pow (steps + 2.0, -info -> decay);
+            scale *= 1.0 - rate;
+            share = rate / share / scale;
+            steps++;
+            serial++;
+            columns = indexColumns (curr, serial, stamp, slots, touched, starts, order);
+          }
+          /*  The next batch has been read by now  */
+          growPairs (batch, k, &pairs, &order, &room);
+        }
+
+        if (share > 0.0) {
+          /*  Add the counts of the batch to its columns of T  */
+#if HAVE_OPENMP
+#pragma omp for schedule(static)
+#endif
+          for (c = 0; c < columns; c++) {
+            j = touched[c];
+            for (z = 0; z < k; z++) {
+              work[z] = 0.0;
+            }
+            for (pos = starts[c]; pos < starts[c + 1]; pos++) {
+              for (z = 0; z < k; z++) {
+                work[z] += pairs[order[pos] * k + z];
+              }
+            }
+            for (z = 0; z < k; z++) {
+              sum = share * work[z];
+              stats[(size_t) j * k + z] += sum;
+              probw2[(size_t) j * k + z] = log (stats[(size_t) j * k + z]);
+              my_adds[z] += sum;
+            }
+          }
+
+#if HAVE_OPENMP
+#pragma omp single
+#endif
+          {
+            for (z = 0; z < k; z++) {
+              for (t = 0; t < threads; t++) {
+                sums[z] += adds[(size_t) t * k + z];
+              }
+            }
+
+            /*  Multiply out the scale before T gets too large  */
+            if (scale < ONLINE_MIN_SCALE) {
+              for (z = 0; z < k; z++) {
+                sums[z] = 0.0;
+              }
+              for (j = 0; j < info -> n; j++) {
+                for (z = 0; z < k; z++) {
+                  stats[(size_t) j * k + z] *= scale;
+                  probw2[(size_t) j * k + z] = log (stats[(size_t) j * k + z]);
+                  sums[z] += stats[(size_t) j * k + z];
+                }
+              }
+              scale = 1.0;
+            }
+
+            for (z = 0; z < k; z++) {
+              norms[z] = log (sums[z]);
+              probz[z] = log (scale) + norms[z];
+            }
+          }
+        }
+      }
+
+      wfree (work);
+    }
+
+    /*  The likelihood of the pairs as they were used, with p(w1) from the
+    **  number of pairs of each row  */
+    if (mass > 0.0) {
+      likelihood += entropy - mass * log (mass);
+    }
+    if (info -> verbose) {
+      if (pass == 1) {
+        fprintf (stderr, "[%3u]  %f\t[%u batches]\n", pass, likelihood, batches);
+      }
+      else {
+        fprintf (stderr, "[%3u]  %f --> %f\t[%f, %2.4f %%]\n", pass, prev_likelihood, likelihood, likelihood - prev_likelihood, (likelihood - prev_likelihood) / prev_likelihood * 100 * -1);
+      }
+    }
+    info -> iterations = pass;
+    info -> likelihood = likelihood;
+    if ((pass > 1) && (DBL_LESS (fabs ((likelihood - prev_likelihood) / prev_likelihood * 100), ML_DELTA))) {
+      break;
+    }
+    prev_likelihood = likelihood;
+  }
+
+  /*  The model, as logs of at least MIN_PROB  */
+  for (z = 0; z < k; z++) {
+    GET_PROBZ_CURR (z) = (probz[z] < smallest) ? smallest : probz[z];
+    for (j = 0; j < info -> n; j++) {
+      GET_PROBW2_Z_CURR (z, j) = probw2[(size_t) j * k + z] - norms[z];
+      if (GET_PROBW2_Z_CURR (z, j) < smallest) {
+        GET_PROBW2_Z_CURR (z, j) = smallest;
+      }
+    }
+  }
+  rowsToProbW1Z (info, totals);
+
+  time (&end);
+  info -> run_time += difftime (end, start);
+
+  if (info -> verbose) {
+    fprintf (stderr, "==\tm = %u; n = %u\n", info -> m_global, info -> n);
+    fprintf (stderr, "==\tOnline EM:                                      %u passes, %u batches\n", info -> iterations, steps);
+  }
+
+  info -> iter = UINT_MAX;
+  if (!info -> no_output) {
+    printCoProb (info);
+  }
+  if (info -> model_output) {
+    printModel (info);
+  }
+  waitSnapshot (info);
+
+  for (b = 0; b < 2; b++) {
+    freeStreamBatch (&(batch[b]));
+  }
+  closeStream (&stream);
+  wfree (probz);
+  wfree (sums);
+  wfree (norms);
+  wfree (adds);
+  wfree (pairs);
+  wfree (order);
+  wfree (starts);
+  wfree (stamp);
+  wfree (slots);
+  wfree (touched);
+  wfree (probw2);
+  wfree (stats);
+  wfree (totals);
+
+  return true;
+}
@@ -24,28 +24,387 @@
 #include <math.h>
 #include <float.h>
 #include <time.h>
+#include <unistd.h>  /*  pwrite  */
+#include <fcntl.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "wmalloc.h"
 #include "plsa-defn.h"
+#include "em-linear.h"
+#include "comm.h"
+#include "model.h"
 #include "output.h"
 
-void printCoProb (INFO *info) {
+/*!  Bytes of p(x,y) calculated before they are written out together  */
+#define OUTPUT_BATCH_BYTES (16 * 1024 * 1024)
+
+/*!  Characters set aside for each value of a text row; "%lf\t" of a value
+**  below 1e6 in magnitude takes at most this many  */
+#define TEXT_CHARS 16
+
+/*!  Threads that print a snapshot in the background, while those of the
+**  EM steps go on  */
+#define SNAPSHOT_THREADS 2
+
+/*!  Number of files printed so far  */
+static unsigned int snapshot_count = 0;
+
+#if HAVE_PTHREADS
+/*!  A snapshot being printed in the background, from its own copy of the probabilities  */
+static pthread_t snapshot_thread;
+static bool snapshot_running = false;
+static INFO snapshot_info;
+/*!  Copy of the probabilities that the snapshots are printed from, allocated by initSnapshot  */
+static PROBNODE *snapshot_probw1_z = NULL;
+static PROBNODE *snapshot_probw2_z = NULL;
+static PROBNODE *snapshot_probz = NULL;
+#endif
+
+
+/*!  Write temp as "%lf\t" would into p, which has room for TEXT_CHARS
+**  characters; returns the length, or -1 if the value is left to printf
+**  (large, infinite, or too close to halfway between two results)  */
+static int formatValue (char *p, PROBNODE temp) {
+  char digits[24];
+  double scaled = fabs (temp) * 1e6;
+  double whole = floor (scaled);
+  unsigned long long v;
+  int len = 0;
+  int count = 0;
+
+  if ((!(fabs (temp) < 1e6)) || (fabs (scaled - whole - 0.5) < 1e-3)) {
+    return (-1);
+  }
+
+  v = (unsigned long long) whole + ((scaled - whole > 0.5) ? 1 : 0);
+  while ((v > 0) || (count < 7)) {
+    digits[count++] = '0' + (v % 10);
+    v /= 10;
+  }
+
+  if (signbit (temp)) {
+    p[len++] = '-';
+  }
+  while (count > 6) {
+    p[len++] = digits[--count];
+  }
+  p[len++] = '.';
+  while (count > 0) {
+    p[len++] = digits[--count];
+  }
+  p[len++] = '\t';
+
+  return (len);
+}
+
+
+/*!  Format a row of p(x,y) as text into at most size characters; returns
+**  the length, or 0 if it does not fit  */
+static size_t formatRow (PROBNODE *values, unsigned int n, char *text, size_t size) {
+  char slow[400];
+  size_t pos = 0;
+  unsigned int j;
+  int len;
+
+  for (j = 0; j < n; j++) {
+    if (size - pos < TEXT_CHARS) {
+      return (0);
+    }
+    len = formatValue (text + pos, values[j]);
+    if (len < 0) {
+      len = snprintf (slow, sizeof (slow), "%lf\t", values[j]);
+      if ((len < 0) || ((size_t) len >= size - pos)) {
+        return (0);
+      }
+      memcpy (text + pos, slow, len);
+    }
+    pos += len;
+  }
+
+  return (pos);
+}
+
+
+/*!  Write v as "%u\t" would into p; returns the length  */
+static int formatUnsigned (char *p, unsigned int v) {
+  char digits[12];
+  int count = 0;
+  int len = 0;
+
+  do {
+    digits[count++] = '0' + (v % 10);
+    v /= 10;
+  } while (v > 0);
+  while (count > 0) {
+    p[len++] = digits[--count];
+  }
+  p[len++] = '\t';
+
+  return (len);
+}
+
+
+/*!  Is entry a of the selection worse than entry b (a smaller value, or
+**  the same value in a later column)?  */
+#define SELECT_WORSE(A,B) ((vals[A] < vals[B]) || ((vals[A] == vals[B]) && (cols[A] > cols[B])))
+
+
+/*!  Swap entries a and b of the selection  */
+static void selectSwap (unsigned int *cols, PROBNODE *vals, unsigned int a, unsigned int b) {
+  unsigned int col = cols[a];
+  PROBNODE val = vals[a];
+
+  cols[a] = cols[b];
+  vals[a] = vals[b];
+  cols[b] = col;
+  vals[b] = val;
+
+  return;
+}
+
+
+/*!  Move entry pos of a heap of size entries down until the entries
+**  below it are not worse than it  */
+static void selectDown (unsigned int *cols, PROBNODE *vals, unsigned int pos, unsigned int size) {
+  unsigned int child;
+
+  while ((child = 2 * pos + 1) < size) {
+    if ((child + 1 < size) && (SELECT_WORSE (child + 1, child))) {
+      child++;
+    }
+    if (!SELECT_WORSE (child, pos)) {
+      break;
+    }
+    selectSwap (cols, vals, pos, child);
+    pos = child;
+  }
+
+  return;
+}
+
+
+/*!  Select the (at most) keep largest values of a row of n values that
+**  are at least limit into cols and vals, from the largest down; returns
+**  their number.  The worst of those selected so far is at the top of a
+**  heap, so each value is compared with it only  */
+static unsigned int selectRow (PROBNODE *row, unsigned int n, unsigned int keep, PROBNODE limit, unsigned int *cols, PROBNODE *vals) {
+  unsigned int count = 0;
+  unsigned int pos;
+  unsigned int j;
+
+  for (j = 0; j < n; j++) {
+    if (!(row[j] >= limit)) {
+      continue;
+    }
+    if (count < keep) {
+      pos = count++;
+      cols[pos] = j;
+      vals[pos] = row[j];
+      while ((pos > 0) && (SELECT_WORSE (pos, (pos - 1) / 2))) {
+        selectSwap (cols, vals, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+      }
+    }
+    else if ((keep > 0) && (row[j] > vals[0])) {
+      cols[0] = j;
+      vals[0] = row[j];
+      selectDown (cols, vals, 0, count);
+    }
+  }
+
+  /*  Take the worst off the heap until it is sorted  */
+  for (pos = count; pos > 1; pos--) {
+    selectSwap (cols, vals, 0, pos - 1);
+    selectDown (cols, vals, 0, pos - 1);
+  }
+
+  return (count);
+}
+
+
+/*!  Format the selected columns of row w1 as a sparse row (see
+**  writeCoProb) into at most size bytes; returns the length, or 0 if it
+**  does not fit  */
+static size_t formatSparseRow (bool textio, unsigned int w1, unsigned int *cols, PROBNODE *vals, unsigned int count, char *text, size_t size) {
+  char slow[400];
+  size_t pos = 0;
+  unsigned int c;
+  int len;
+
+  if (!textio) {
+    memcpy (text + pos, &w1, sizeof (unsigned int));
+    pos += sizeof (unsigned int);
+    memcpy (text + pos, &count, sizeof (unsigned int));
+    pos += sizeof (unsigned int);
+    for (c = 0; c < count; c++) {
+      memcpy (text + pos, &(cols[c]), sizeof (unsigned int));
+      pos += sizeof (unsigned int);
+      memcpy (text + pos, &(vals[c]), sizeof (PROBNODE));
+      pos += sizeof (PROBNODE);
+    }
+    return (pos);
+  }
+
+  pos += formatUnsigned (text + pos, w1);
+  pos += formatUnsigned (text + pos, count);
+  for (c = 0; c < count; c++) {
+    if (size - pos < TEXT_CHARS + 11) {
+      return (0);
+    }
+    pos += formatUnsigned (text + pos, cols[c]);
+    len = formatValue (text + pos, vals[c]);
+    if (len < 0) {
+      len = snprintf (slow, sizeof (slow), "%lf\t", vals[c]);
+      if ((len < 0) || ((size_t) len >= size - pos)) {
+        return (0);
+      }
+      memcpy (text + pos, slow, len);
+    }
+    pos += len;
+  }
+
+  return (pos);
+}
+
+
+/*!  Calculate log p(i,j) of every column of row i into row, rounded if
+**  asked for; q, shift, and r are those of linearRowProbs  */
+static void calculateRow (INFO *info, PROBNODE *q, PROBNODE *shift, PROBNODE *r, unsigned int i, PROBNODE *row) {
   unsigned int num_clusters = info -> num_clusters;
-  unsigned int i = 0;  /*  Index into w1  */
   unsigned int j = 0;  /*  Index into w2  */
   unsigned int k = 0;  /*  Index into clusters  */
   PROBNODE temp;
+
+  if (info -> linear) {
+    linearRowProbs (info, q, shift, r, i, row);
+  }
+  for (j = 0; j < info -> n; j++) {
+    if (info -> linear) {
+      temp = row[j];
+    }
+    else {
+      temp = (GET_PROBZ_W1W2_CURR (0,i,j));
+      for (k = 1; k < num_clusters; k++) {
+        /*  temp stores logarithms  */
+        logSumsInline (temp, (GET_PROBZ_W1W2_CURR (k, i, j)));
+      }
+    }
+
+    /*  temp stores logarithms; round it to ROUND_DIGITS  */
+    if (info -> rounding) {
+      temp = (round (temp * ROUND_DIGITS)) / ROUND_DIGITS;
+    }
+    row[j] = temp;
+  }
+
+  return;
+}
+
+
+/*!  Write size bytes at offset of the file, in as many calls as needed  */
+static void writeAt (int fd, char *fn, const char *data, size_t size, off_t offset) {
+  ssize_t done;
+
+  while (size > 0) {
+    done = pwrite (fd, data, size, offset);
+    if (done <= 0) {
+      fprintf (stderr, "Error writing to %s.\n", fn);
+      exit (EXIT_FAILURE);
+    }
+    data += done;
+    size -= done;
+    offset += done;
+  }
+
+  return;
+}
+
+
+/*!  Print p(x,y) of all pairs.  Only MAINPROC prints, unless the rows are
+**  divided among processes:  each process then writes its own rows.  Text
+**  is appended by each process in turn, after the process before it;
+**  binary values are written straight to their place in the file.
+**  The threads calculate (and format) a batch of rows while the previous
+**  batch is written by one of them.
+**
+**  With --topn or --threshold, only the most probable columns of each row
+**  are printed, as sparse rows in the format of the input:  the row index
+**  and the number of columns, then each column and its value, from the
+**  most probable down.  These rows have different lengths, so they are
+**  always appended in turn  */
+static void writeCoProb (INFO *info, bool background) {
+  unsigned int num_clusters = info -> num_clusters;
+  unsigned int i = 0;  /*  Index into w1  */
+  unsigned int j = 0;  /*  Index into w2  */
+  bool sparse = (info -> topn > 0) || (info -> threshold > 0.0);  /*  Print sparse rows?  */
+  unsigned int keep = info -> n;  /*  Most columns of a sparse row  */
+  PROBNODE limit = -HUGE_VAL;  /*  Smallest value of a sparse row  */
+  bool sequential;  /*  Are the rows appended to the file in order?  */
+  size_t values_size;  /*  Values kept per row  */
+  size_t text_size = (info -> textio) ? (size_t) info -> n * TEXT_CHARS : 0;  /*  Characters per row  */
+  unsigned int batch_rows;
+  unsigned int batches;
+  PROBNODE *values[2];  /*  p(x,y) of each batch of rows  */
+  char *text[2];  /*  Text (or sparse rows) of each batch of rows  */
+  size_t *lengths[2];  /*  Length of the text of each row (0 if it did not fit)  */
+  PROBNODE *sums[2];  /*  Sum of p(x,y) of each row  */
+  unsigned int *nonprobs[2];  /*  Number of values above 0 (as logarithms) of each row  */
   PROBNODE tempsum = 0.0;
   unsigned int nonprob = 0;
+  PROBNODE *q = NULL;
+  PROBNODE *shift = NULL;
   FILE *fp = NULL;
-  char *fn = wmalloc (sizeof (char) * (strlen (info -> base_fn) + 10));
-  static unsigned int snapshot_count = 0;
+  off_t data_start;
+  char *fn;
+  signed int writers = 1;  /*  Number of processes that print  */
+  unsigned int b;
+#if HAVE_MPI
+  signed int turn;
+#endif
 
   time_t start;
   time_t end;
 
+  if (info -> decompose == DECOMPOSE_ROWS) {
+    writers = info -> world_size;
+  }
+  else if (info -> world_id != MAINPROC) {
+    return;
+  }
+
   time (&start);
   snapshot_count++;
+  fn = wmalloc (sizeof (char) * (strlen (info -> base_fn) + 20));
+
+  if ((info -> topn > 0) && (info -> topn < keep)) {
+    keep = info -> topn;
+  }
+  if (info -> threshold > 0.0) {
+    limit = log (info -> threshold);
+  }
+  sequential = (info -> textio) || (sparse);
+  values_size = (sparse) ? 0 : info -> n;
+  if (sparse) {
+    /*  The row index and the number of columns, then the pairs  */
+    if (info -> textio) {
+      text_size = 22 + (size_t) keep * (11 + TEXT_CHARS);
+    }
+    else {
+      text_size = 2 * sizeof (unsigned int) + (size_t) keep * (sizeof (unsigned int) + sizeof (PROBNODE));
+    }
+  }
 
   if (info -> iter == UINT_MAX) {
     sprintf (fn, "%s.plsa", info -> base_fn);
@@ -53,55 +412,222 @@ void printCoProb (INFO *info) {
   else {
     sprintf (fn, "%s.%u.plsa", info -> base_fn, info -> iter);
   }
-  if (info -> textio) {
-    FOPEN (fn, fp, "w");
-    fprintf (fp, "%u\t", info -> m);
-    fprintf (fp, "%u\t", info -> n);
-    for (i = 0; i < info -> m; i++) {
-      fprintf (fp, "%u\t", info -> row_ids[i]);
+
+  /*  Wait for the processes before this one  */
+#if HAVE_MPI
+  if ((writers > 1) && (sequential)) {
+    for (turn = 0; turn < info -> world_id; turn++) {
+      MPI_Barrier (MPI_COMM_WORLD);
+    }
+  }
+#endif
+
+  if (info -> world_id == MAINPROC) {
+    if (info -> textio) {
+      FOPEN (fn, fp, "w");
+      fprintf (fp, "%u\t", info -> m_global);
+      fprintf (fp, "%u\t", info -> n);
+      for (i = 0; i < info -> m_global; i++) {
+        fprintf (fp, "%u\t", info -> row_ids[i]);
+      }
+      for (j = 0; j < info -> n; j++) {
+        fprintf (fp, "%u\t", info -> column_ids[j]);
+      }
     }
-    for (j = 0; j < info -> n; j++) {
-      fprintf (fp, "%u\t", info -> column_ids[j]);
+    else {
+      FOPEN (fn, fp, "wb");
+      fwrite (&info -> m_global, sizeof (unsigned int), 1, fp);
+      fwrite (&info -> n, sizeof (unsigned int), 1, fp);
+      fwrite (info -> row_ids, sizeof (unsigned int), info -> m_global, fp);
+      fwrite (info -> column_ids, sizeof (unsigned int), info -> n, fp);
+      fflush (fp);
     }
   }
-  else {
-    FOPEN (fn, fp, "wb");
-    fwrite (&info -> m, sizeof (unsigned int), 1, fp);
-    fwrite (&info -> n, sizeof (unsigned int), 1, fp);
-    fwrite (info -> row_ids, sizeof (unsigned int), info -> m, fp);
-    fwrite (info -> column_ids, sizeof (unsigned int), info -> n, fp);
+
+  /*  Binary files are created by MAINPROC before the others write into them  */
+#if HAVE_MPI
+  if ((writers > 1) && (!sequential)) {
+    MPI_Barrier (MPI_COMM_WORLD);
   }
+#endif
 
-  for (i = 0; i < info -> m; i++) {
-    for (j = 0; j < info -> n; j++) {
-      temp = (GET_PROBZ_W1W2_CURR (0,i,j));
-      for (k = 1; k < num_clusters; k++) {
-        /*  temp stores logarithms  */
-        logSumsInline (temp, (GET_PROBZ_W1W2_CURR (k, i, j)));
-      }
+  if (info -> world_id != MAINPROC) {
+    if (sequential) {
+      FOPEN (fn, fp, (info -> textio) ? "a" : "ab");
+    }
+    else {
+      FOPEN (fn, fp, "r+b");
+    }
+  }
+  data_start = ((off_t) 2 + info -> m_global + info -> n) * sizeof (unsigned int);
 
-      /*  temp stores logarithms; round it to ROUND_DIGITS  */
-      if (info -> rounding) {
-        temp = (round (temp * ROUND_DIGITS)) / ROUND_DIGITS;
-      }
+  /*  In linear-space, a whole row is calculated at a time  */
+  if (info -> linear) {
+    q = wmalloc ((size_t) KERNEL_PAD (num_clusters) * info -> n * sizeof (PROBNODE));
+    shift = wmalloc (num_clusters * sizeof (PROBNODE));
+    linearProbW2Z (info, info -> probw2_z_curr, num_clusters, q, shift);
+  }
 
-      if (info -> textio) {
-        fprintf (fp, "%lf\t", temp);
-      }
-      else {
-        fwrite (&temp, sizeof (PROBNODE), 1, fp);
+  batch_rows = OUTPUT_BATCH_BYTES / (values_size * sizeof (PROBNODE) + text_size + 1);
+  if (batch_rows == 0) {
+    batch_rows = 1;
+  }
+  if (batch_rows > info -> m) {
+    batch_rows = info -> m;
+  }
+  batches = (batch_rows == 0) ? 0 : (info -> m + batch_rows - 1) / batch_rows;
+  for (b = 0; b < 2; b++) {
+    values[b] = wmalloc ((size_t) batch_rows * values_size * sizeof (PROBNODE) + 1);
+    text[b] = wmalloc ((size_t) batch_rows * text_size + 1);
+    lengths[b] = wmalloc ((size_t) batch_rows * sizeof (size_t) + 1);
+    sums[b] = wmalloc ((size_t) batch_rows * sizeof (PROBNODE) + 1);
+    nonprobs[b] = wmalloc ((size_t) batch_rows * sizeof (unsigned int) + 1);
+  }
+
+#if HAVE_OPENMP
+#pragma omp parallel num_threads((background) ? SNAPSHOT_THREADS : omp_get_max_threads ()) private(b,i,j)
+#endif
+  {
+    PROBNODE *r = NULL;
+    PROBNODE *row;
+    PROBNODE *scratch = NULL;  /*  The whole row of a sparse row  */
+    unsigned int *cols = NULL;  /*  Columns selected for a sparse row  */
+    PROBNODE *vals = NULL;  /*  Their values  */
+    unsigned int count;
+    unsigned int first;
+    unsigned int last;
+    unsigned int slot;
+
+    if (background) {
+      countWMallocCalls (false);
+    }
+    if (info -> linear) {
+      r = wmalloc (KERNEL_PAD (num_clusters) * sizeof (PROBNODE));
+    }
+    if (sparse) {
+      scratch = wmalloc ((size_t) info -> n * sizeof (PROBNODE) + 1);
+      cols = wmalloc ((size_t) keep * sizeof (unsigned int) + 1);
+      vals = wmalloc ((size_t) keep * sizeof (PROBNODE) + 1);
+    }
+
+    /*  Batch b is calculated while batch b - 1 is written; the end of the
+    **  loop over the rows of batch b waits for both  */
+    for (b = 0; b <= batches; b++) {
+#if HAVE_OPENMP
+#pragma omp single nowait
+#endif
+      if (b > 0) {
+        slot = (b - 1) % 2;
+        first = (b - 1) * batch_rows;
+        last = (b * batch_rows < info -> m) ? b * batch_rows : info -> m;
+        if (sparse) {
+          for (i = first; i < last; i++) {
+            if (lengths[slot][i - first] > 0) {
+              fwrite (text[slot] + (i - first) * text_size, 1, lengths[slot][i - first], fp);
+            }
+            else {
+              /*  Select the row again and print it with printf  */
+              calculateRow (info, q, shift, r, i, scratch);
+              count = selectRow (scratch, info -> n, keep, limit, cols, vals);
+              fprintf (fp, "%u\t%u\t", info -> row_offset + i, count);
+              for (j = 0; j < count; j++) {
+                fprintf (fp, "%u\t%lf\t", cols[j], vals[j]);
+              }
+            }
+          }
+        }
+        else if (info -> textio) {
+          for (i = first; i < last; i++) {
+            if (lengths[slot][i - first] > 0) {
+              fwrite (text[slot] + (i - first) * text_size, 1, lengths[slot][i - first], fp);
+            }
+            else {
+              row = values[slot] + (size_t) (i - first) * info -> n;
+              for (j = 0; j < info -> n; j++) {
+                fprintf (fp, "%lf\t", row[j]);
+              }
+            }
+          }
+        }
+        else {
+          writeAt (fileno (fp), fn, (char *) values[slot], (size_t) (last - first) * info -> n * sizeof (PROBNODE), data_start + ((off_t) info -> row_offset + first) * info -> n * sizeof (PROBNODE));
+        }
+        for (i = first; i < last; i++) {
+          tempsum += sums[slot][i - first];
+          nonprob += nonprobs[slot][i - first];
+        }
       }
-      if (temp > 0) {
-        nonprob++;
+
+      if (b < batches) {
+        slot = b % 2;
+        first = b * batch_rows;
+        last = ((b + 1) * batch_rows < info -> m) ? (b + 1) * batch_rows : info -> m;
+#if HAVE_OPENMP
+#pragma omp for schedule(dynamic,16)
+#endif
+        for (i = first; i < last; i++) {
+          row = (sparse) ? scratch : values[slot] + (size_t) (i - first) * info -> n;
+          calculateRow (info, q, shift, r, i, row);
+          sums[slot][i - first] = 0.0;
+          nonprobs[slot][i - first] = 0;
+          for (j = 0; j < info -> n; j++) {
+            if (row[j] > 0) {
+              nonprobs[slot][i - first]++;
+            }
+            sums[slot][i - first] += DOEXP (row[j]);
+          }
+          if (sparse) {
+            count = selectRow (row, info -> n, keep, limit, cols, vals);
+            lengths[slot][i - first] = formatSparseRow (info -> textio, info -> row_offset + i, cols, vals, count, text[slot] + (i - first) * text_size, text_size);
+          }
+          else if (info -> textio) {
+            lengths[slot][i - first] = formatRow (row, info -> n, text[slot] + (i - first) * text_size, text_size);
+          }
+        }
       }
-      tempsum += DOEXP (temp);
+    }
+
+    if (r != NULL) {
+      wfree (r);
+    }
+    if (sparse) {
+      wfree (scratch);
+      wfree (cols);
+      wfree (vals);
+    }
+    if (background) {
+      countWMallocCalls (true);
     }
   }
 
   FCLOSE (fp);
   wfree (fn);
+  for (b = 0; b < 2; b++) {
+    wfree (values[b]);
+    wfree (text[b]);
+    wfree (lengths[b]);
+    wfree (sums[b]);
+    wfree (nonprobs[b]);
+  }
+  if (info -> linear) {
+    wfree (q);
+    wfree (shift);
+  }
 
-  if ((info -> verbose) && (info -> iter == UINT_MAX)) {
+  /*  Let the processes after this one print, then total the statistics  */
+#if HAVE_MPI
+  if (writers > 1) {
+    if (sequential) {
+      for (turn = info -> world_id; turn < writers; turn++) {
+        MPI_Barrier (MPI_COMM_WORLD);
+      }
+    }
+    MPI_Allreduce (MPI_IN_PLACE, &nonprob, 1, MPI_UNSIGNED, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce (MPI_IN_PLACE, &tempsum, 1, MPI_TYPE, MPI_SUM, MPI_COMM_WORLD);
+  }
+#endif
+
+  if ((info -> verbose) && (info -> iter == UINT_MAX) && (info -> world_id == MAINPROC)) {
     fprintf (stderr, "==\tNon-probabilities:                              %u\n", nonprob);
     fprintf (stderr, "==\tSum of p(x,y):                                  %f\n", tempsum);
     fprintf (stderr, "==\tTotal output files printed                      %u\n", snapshot_count);
@@ -113,3 +639,201 @@ void printCoProb (INFO *info) {
   return;
 }
 
+
+#if HAVE_PTHREADS
+/*!  Print a snapshot with a few threads of its own; its allocations are
+**  not those of the iterations (see callsWMalloc)  */
+static void *snapshotThread (void *arg) {
+  countWMallocCalls (false);
+#if HAVE_OPENMP
+  omp_set_num_threads (SNAPSHOT_THREADS);
+#endif
+  writeCoProb ((INFO *) arg, true);
+
+  return (NULL);
+}
+#endif
+
+
+/*!  Wait for the snapshot being printed in the background, if any  */
+void waitSnapshot (INFO *info) {
+#if HAVE_PTHREADS
+  if (snapshot_running) {
+    pthread_join (snapshot_thread, NULL);
+    info -> printCoProbs_time += snapshot_info.printCoProbs_time;
+    snapshot_running = false;
+  }
+#endif
+
+  return;
+}
+
+
+/*!  Allocate the copy of the probabilities that snapshots are printed
+**  from in the background, once for all of them  */
+void initSnapshot (INFO *info) {
+#if HAVE_PTHREADS
+  if ((info -> snapshot != UINT_MAX) && (info -> world_id == MAINPROC) &&
+      ((info -> world_size == 1) || (info -> decompose == DECOMPOSE_CLUSTERS))) {
+    snapshot_probw1_z = wmalloc ((size_t) info -> num_clusters * info -> m * sizeof (PROBNODE));
+    snapshot_probw2_z = wmalloc ((size_t) info -> num_clusters * info -> n * sizeof (PROBNODE));
+    snapshot_probz = wmalloc (info -> num_clusters * sizeof (PROBNODE));
+  }
+#endif
+
+  return;
+}
+
+
+/*!  Wait for the last snapshot and free the copy of the probabilities  */
+void freeSnapshot (INFO *info) {
+  waitSnapshot (info);
+#if HAVE_PTHREADS
+  wfree (snapshot_probw1_z);
+  wfree (snapshot_probw2_z);
+  wfree (snapshot_probz);
+  snapshot_probw1_z = NULL;
+  snapshot_probw2_z = NULL;
+  snapshot_probz = NULL;
+#endif
+
+  return;
+}
+
+
+/*!  Print p(x,y) of all pairs from *current*.  A snapshot (info -> iter
+**  is not UINT_MAX) is printed in the background from a copy of the
+**  probabilities (see initSnapshot), so that the iterations go on meanwhile; not when the
+**  rows are divided, as the processes then print together  */
+void printCoProb (INFO *info) {
+  time_t start;
+  time_t end;
+
+  /*  The clusters of the other processes are needed  */
+  waitProbs (info);
+
+  /*  One snapshot at a time  */
+  waitSnapshot (info);
+
+#if HAVE_PTHREADS
+  if ((info -> iter != UINT_MAX) && ((info -> world_size == 1) || (info -> decompose == DECOMPOSE_CLUSTERS))) {
+    if (info -> world_id != MAINPROC) {
+      return;
+    }
+  }
+  if ((info -> iter != UINT_MAX) && (snapshot_probw1_z != NULL)) {
+    time (&start);
+    snapshot_info = *info;
+    snapshot_info.printCoProbs_time = 0;
+    snapshot_info.probw1_z_curr = snapshot_probw1_z;
+    snapshot_info.probw2_z_curr = snapshot_probw2_z;
+    snapshot_info.probz_curr = snapshot_probz;
+    memcpy (snapshot_info.probw1_z_curr, info -> probw1_z_curr, (size_t) info -> num_clusters * info -> m * sizeof (PROBNODE));
+    memcpy (snapshot_info.probw2_z_curr, info -> probw2_z_curr, (size_t) info -> num_clusters * info -> n * sizeof (PROBNODE));
+    memcpy (snapshot_info.probz_curr, info -> probz_curr, info -> num_clusters * sizeof (PROBNODE));
+    if (pthread_create (&snapshot_thread, NULL, snapshotThread, &snapshot_info) == 0) {
+      snapshot_running = true;
+      time (&end);
+      info -> printCoProbs_time += difftime (end, start);
+      return;
+    }
+  }
+#endif
+
+  writeCoProb (info, false);
+
+  return;
+}
+
+
+/*!  Write count probabilities at offset of the file as doubles  */
+static void writeDoubles (int fd, char *fn, PROBNODE *values, size_t count, off_t offset) {
+  double buffer[4096];
+  size_t done;
+  size_t part;
+  size_t pos;
+
+  for (done = 0; done < count; done += part) {
+    part = (count - done < 4096) ? count - done : 4096;
+    for (pos = 0; pos < part; pos++) {
+      buffer[pos] = values[done + pos];
+    }
+    writeAt (fd, fn, (char *) buffer, part * sizeof (double), offset + done * sizeof (double));
+  }
+
+  return;
+}
+
+
+/*!  Write the factored model (see model.h) to <base>.model.  MAINPROC
+**  writes the header, the ids, p(z), and p(w2|z); p(w1|z) is written by
+**  every process that holds rows of it, in their place in the file  */
+void printModel (INFO *info) {
+  MODELHEADER header;
+  MODELLAYOUT layout;
+  unsigned int k;
+  char *fn;
+  int fd = -1;
+  time_t start;
+  time_t end;
+
+  /*  The clusters of the other processes are needed  */
+  waitProbs (info);
+
+  if ((info -> decompose == DECOMPOSE_CLUSTERS) && (info -> world_id != MAINPROC)) {
+    return;
+  }
+
+  time (&start);
+  fn = wmalloc (sizeof (char) * (strlen (info -> base_fn) + 10));
+  sprintf (fn, "%s.model", info -> base_fn);
+
+  modelInitHeader (&header, info -> m_global, info -> n, info -> num_clusters);
+  header.seed = info -> seed;
+  header.iterations = info -> iterations;
+  header.likelihood = info -> likelihood;
+  modelLayout (&header, &layout);
+
+  /*  The file is created by MAINPROC before the others write into it  */
+  if (info -> world_id == MAINPROC) {
+    fd = open (fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+#if HAVE_MPI
+  if (info -> decompose == DECOMPOSE_ROWS) {
+    MPI_Barrier (MPI_COMM_WORLD);
+  }
+#endif
+  if (info -> world_id != MAINPROC) {
+    fd = open (fn, O_WRONLY);
+  }
+  if (fd < 0) {
+    fprintf (stderr, "Error creating %s.\n", fn);
+    exit (EXIT_FAILURE);
+  }
+
+  if (info -> world_id == MAINPROC) {
+    writeAt (fd, fn, (char *) &header, sizeof (MODELHEADER), 0);
+    writeAt (fd, fn, (char *) info -> row_ids, (size_t) info -> m_global * sizeof (uint32_t), layout.row_ids);
+    writeAt (fd, fn, (char *) info -> column_ids, (size_t) info -> n * sizeof (uint32_t), layout.column_ids);
+    writeDoubles (fd, fn, info -> probz_curr, info -> num_clusters, layout.probz);
+    writeDoubles (fd, fn, info -> probw2_z_curr, (size_t) info -> num_clusters * info -> n, layout.probw2_z);
+  }
+  for (k = 0; k < info -> num_clusters; k++) {
+    writeDoubles (fd, fn, &(GET_PROBW1_Z_CURR (k, 0)), info -> m, layout.probw1_z + ((off_t) k * info -> m_global + info -> row_offset) * sizeof (double));
+  }
+
+  if (close (fd) != 0) {
+    fprintf (stderr, "Error writing to %s.\n", fn);
+    exit (EXIT_FAILURE);
+  }
+
+  if ((info -> verbose) && (info -> world_id == MAINPROC)) {
+    fprintf (stderr, "==\tModel written to:                               %s (%.1f MB)\n", fn, layout.size / 1048576.0);
+  }
+  wfree (fn);
+
+  time (&end);
+  info -> printCoProbs_time += difftime (end, start);
+
+  return;
+}
@@ -20,5 +20,9 @@
 #define OUTPUT_H
 
 void printCoProb (INFO *info);
+void waitSnapshot (INFO *info);
+void initSnapshot (INFO *info);
+void freeSnapshot (INFO *info);
+void printModel (INFO *info);
 
 #endif
@@ -36,6 +36,8 @@
 
 #include "wmalloc.h"
 #include "plsa-defn.h"
+#include "kernels.h"
+#include "model.h"
 #include "parameters.h"
 
 /*!  Print out usage information  */
@@ -54,11 +56,45 @@ void usage (char *progname) {
   fprintf (stderr, "--snapshot <int>   :  Output snapshots p(x,y) at regular intervals.\n");
   fprintf (stderr, "                   :    (Default:  Do not output).\n");
   fprintf (stderr, "--openmp <int>     :  Number of OpenMP threads to use.\n");
-  fprintf (stderr, "                   :    (Default:  Maximum for PC).\n");
+  fprintf (stderr, "                   :    (Default:  This process's share of the processors).\n");
+  fprintf (stderr, "--pin              :  Keep each thread on one processor (Linux only).\n");
   fprintf (stderr, "--verbose          :  Verbose mode.\n");
   fprintf (stderr, "--debug            :  Debugging output.\n");
   fprintf (stderr, "--rounding         :  Round using %u as the multiplication factor.\n", ROUND_DIGITS);
   fprintf (stderr, "--nooutput         :  Suppress outputting p(x,y) to file.\n");
+  fprintf (stderr, "--model            :  Also write p(z), p(w1|z) and p(w2|z) to <base>.model.\n");
+  fprintf (stderr, "--topn <int>       :  Print only the most probable columns of each row of p(x,y).\n");
+  fprintf (stderr, "                   :    (Default:  Print all).\n");
+  fprintf (stderr, "--threshold <float>:  Print only the values of p(x,y) of at least this probability.\n");
+  fprintf (stderr, "                   :    (Default:  Print all).\n");
+  fprintf (stderr, "--init-model <file>:  Start from the probabilities of this model instead of random ones.\n");
+  fprintf (stderr, "--holdout <float>  :  Hold this fraction of the pairs out of training and stop when their likelihood stops improving.\n");
+  fprintf (stderr, "                   :    (Default:  Train on all pairs).\n");
+  fprintf (stderr, "--holdout-every <n>:  Iterations between evaluations of the held-out pairs (Default:  1).\n");
+  fprintf (stderr, "--patience <int>   :  Held-out evaluations in a row without improvement before training stops (Default:  %u).\n", HOLDOUT_PATIENCE);
+  fprintf (stderr, "--tempered <float> :  Tempered EM:  multiply beta by this (e.g., 0.9) when the held-out likelihood stops improving.\n");
+  fprintf (stderr, "                   :    (Default:  Plain EM; requires --holdout).\n");
+  fprintf (stderr, "--online <int>     :  Online EM over batches of this many rows, read as they are needed.\n");
+  fprintf (stderr, "                   :    (Default:  Batch EM; --maxiter passes over the rows).\n");
+  fprintf (stderr, "--decay <float>    :  Decay of the step size of online EM, in (0.5, 1].\n");
+  fprintf (stderr, "                   :    (Default:  %.2f).\n", ONLINE_DECAY);
+  fprintf (stderr, "--restarts <int>   :  Train this many models at once from the seeds seed, seed + 1, ... and keep the best.\n");
+  fprintf (stderr, "                   :    (Default:  One model; one process only).\n");
+  fprintf (stderr, "--keep-restarts    :  Write every model of --restarts to <base>.r<number> instead.\n");
+  fprintf (stderr, "--foldin <model>   :  Find p(z|w1) of the rows of the co-occurrence file with this model.\n");
+  fprintf (stderr, "                   :    (Written to <base>.foldin; --maxiter EM steps per row).\n");
+  fprintf (stderr, "--linear           :  Calculate in linear-space with scaling instead of log-space.\n");
+  fprintf (stderr, "--simd <name>      :  Instruction set for the linear-space kernels:\n");
+  fprintf (stderr, "                   :    auto, scalar, sse2, avx2 or avx512 (Default:  auto).\n");
+  fprintf (stderr, "--accuracy <name>  :  Accuracy of the log-space sums:  legacy, fast or double.\n");
+  fprintf (stderr, "                   :    (Default:  legacy).\n");
+  fprintf (stderr, "--lnlimit <float>  :  Ignore terms this much smaller (as logarithms) in log-space sums.\n");
+  fprintf (stderr, "                   :    (Default:  %.2f).\n", LN_LIMIT);
+  fprintf (stderr, "--estep <name>     :  Divide the E and M steps among threads by rows or clusters.\n");
+  fprintf (stderr, "                   :    (Default:  rows).\n");
+  fprintf (stderr, "--decompose <name> :  Divide the work among MPI processes by clusters or rows.\n");
+  fprintf (stderr, "                   :    (Default:  clusters).\n");
+  fprintf (stderr, "--shared-input     :  The MPI processes of each computer share one copy of the co-occurrence data.\n");
 
   fprintf (stderr, "\nCompile-time settings:\n  ");
   fprintf (stderr, "     MPI:                              ");
@@ -91,13 +127,27 @@ bool checkSettings (INFO *info) {
     return false;
   }
 
-  if (info -> num_clusters == 0) {
-    fprintf (stderr, "==\tError:  Number of clusters required with the --clusters option.\n");
-    return false;
+  /*  A model to start from gives the number of clusters, if it is not given  */
+  if ((info -> init_model_fn != NULL) && (info -> foldin_fn == NULL)) {
+    MODEL *model = modelOpen (info -> init_model_fn);
+
+    if (model == NULL) {
+      return false;
+    }
+    if (info -> num_clusters == 0) {
+      info -> num_clusters = model -> header.k;
+    }
+    if (info -> num_clusters != model -> header.k) {
+      fprintf (stderr, "==\tError:  The model to start from has %u clusters, not %u.\n", model -> header.k, info -> num_clusters);
+      modelClose (model);
+      return false;
+    }
+    modelClose (model);
   }
 
-  if (info -> num_clusters >= MAX_CLUSTERS) {
-    fprintf (stderr, "==\tError:  The maximum number of clusters is %u because of the MPI message tag lengths.  Please change MAX_CLUSTERS in plsa-defn.h and re-compile.\n", MAX_CLUSTERS);
+  /*  The number of clusters of fold-in is that of the model  */
+  if ((info -> num_clusters == 0) && (info -> foldin_fn == NULL)) {
+    fprintf (stderr, "==\tError:  Number of clusters required with the --clusters option.\n");
     return false;
   }
 
@@ -106,17 +156,75 @@ bool checkSettings (INFO *info) {
     return false;
   }
 
-  if (info -> world_size > info -> num_clusters) {
+  if ((info -> tempered > 0.0) && (info -> holdout == 0.0)) {
+    fprintf (stderr, "==\tError:  --tempered needs held-out pairs (--holdout) to know when to lower beta.\n");
+    return false;
+  }
+
+  if ((info -> holdout > 0.0) && ((info -> online_rows > 0) || (info -> foldin_fn != NULL))) {
+    fprintf (stderr, "==\tError:  --holdout is only used by batch EM, not with --online or --foldin.\n");
+    return false;
+  }
+
+  if ((info -> online_rows > 0) && (info -> foldin_fn != NULL)) {
+    fprintf (stderr, "==\tError:  --online trains a model; it cannot be used with --foldin.\n");
+    return false;
+  }
+
+  /*  The models of --restarts share the threads of one process  */
+  if ((info -> restarts > 1) && ((info -> online_rows > 0) || (info -> foldin_fn != NULL) || (info -> world_size > 1))) {
+    fprintf (stderr, "==\tError:  --restarts is only used by batch EM on one process, not with --online, --foldin or MPI.\n");
+    return false;
+  }
+
+  if ((info -> restarts > 1) && (info -> snapshot != UINT_MAX)) {
+    fprintf (stderr, "==\tError:  --snapshot cannot be used with --restarts.\n");
+    return false;
+  }
+
+  if ((info -> keep_restarts) && (info -> restarts <= 1)) {
+    fprintf (stderr, "==\tError:  --keep-restarts needs more than one model (--restarts).\n");
+    return false;
+  }
+
+  /*  Fold-in and online EM run on one process  */
+  if ((info -> decompose == DECOMPOSE_CLUSTERS) && (info -> world_size > info -> num_clusters) && (info -> foldin_fn == NULL) && (info -> online_rows == 0)) {
     fprintf (stderr, "==\tWarning:  The number of processors is more than the number of clusters.  Increasing the number of clusters.");
     info -> num_clusters = info -> world_size;
   }
 
+  /*  With the rows divided, each process already holds different data  */
+  if ((info -> shared_input) && (info -> decompose == DECOMPOSE_ROWS)) {
+    if (info -> world_id == MAINPROC) {
+      fprintf (stderr, "==\tWarning:  --shared-input has no effect with --decompose rows.\n");
+    }
+    info -> shared_input = false;
+  }
+
+  /*  Set the range of clusters this process will handle; all of them if the rows are divided instead  */
+  if (info -> decompose == DECOMPOSE_ROWS) {
+    info -> block_start = 0;
+    info -> block_end = info -> num_clusters - 1;
+    info -> block_size = info -> num_clusters;
+  }
+  else {
+    info -> block_start = BLOCK_LOW (info ->  world_id, info -> world_size, info -> num_clusters);
+    info -> block_end = BLOCK_HIGH (info ->  world_id, info -> world_size, info -> num_clusters);
+    info -> block_size = BLOCK_SIZE (info ->  world_id, info -> world_size, info -> num_clusters);
+  }
+
   if (info -> verbose) {
     if (info -> world_id == MAINPROC) {
       fprintf (stderr, "Settings\n");
       fprintf (stderr, "--------\n");
       fprintf (stderr, "==\tBase filename:                                  %s\n", info -> base_fn);
       fprintf (stderr, "==\tCo-occurrence filename:                         %s\n", info -> co_fn);
+      if (info -> foldin_fn != NULL) {
+        fprintf (stderr, "==\tFold in with the model:                         %s\n", info -> foldin_fn);
+      }
+      if (info -> init_model_fn != NULL) {
+        fprintf (stderr, "==\tStart from the model:                           %s\n", info -> init_model_fn);
+      }
       fprintf (stderr, "==\tProbability data type:                          ");
       if (sizeof (PROBNODE) == 4) {
         fprintf (stderr, "float\n");
@@ -127,28 +235,60 @@ bool checkSettings (INFO *info) {
       else {
         fprintf (stderr, "Unknown!\n");
       }
-      fprintf (stderr, "==\tClusters:                                       %u\n", info -> num_clusters);
+      if (info -> foldin_fn != NULL) {
+        fprintf (stderr, "==\tClusters:                                       [from the model]\n");
+      }
+      else {
+        fprintf (stderr, "==\tClusters:                                       %u\n", info -> num_clusters);
+      }
       if (info -> seed != UINT_MAX) {
         fprintf (stderr, "==\tRandom seed:                                    %u\n", info -> seed);
       }
       else {
         fprintf (stderr, "==\tRandom seed:                                    [from time]\n");
       }
-      fprintf (stderr, "==\tExponent difference [utils.h::addLogsFloat]:    %.8f\n", LN_LIMIT);
+      fprintf (stderr, "==\tExponent difference [utils.h::addLogsFloat]:    %.8f\n", info -> ln_limit);
       fprintf (stderr, "==\tTermination conditions\n");
       fprintf (stderr, "==\t  Maximum EM iterations:                        %u\n", info -> maxiter);
       fprintf (stderr, "==\t  Percentage difference:                        %f\n", ML_DELTA);
+      if (info -> holdout > 0.0) {
+        fprintf (stderr, "==\t  Pairs held out:                               %.2f %% (evaluated every %u iterations)\n", info -> holdout * 100, info -> holdout_every);
+        fprintf (stderr, "==\t  Evaluations without improvement allowed:      %u\n", info -> holdout_patience);
+      }
+      if (info -> tempered > 0.0) {
+        fprintf (stderr, "==\t  Tempered EM:                                  beta multiplied by %.2f\n", info -> tempered);
+      }
       fprintf (stderr, "==\tText mode:                                      %s\n", (info -> textio) ? "yes" : "no");
       fprintf (stderr, "==\tRounding:                                       %s\n", (info -> rounding) ? "yes" : "no");
       if (info -> rounding) {
         fprintf (stderr, "==\tRounding factor:                                %u\n", ROUND_DIGITS);
       }
       fprintf (stderr, "==\tSuppress output to file:                        %s\n", (info -> no_output) ? "yes" : "no");
+      fprintf (stderr, "==\tWrite the model:                                %s\n", (info -> model_output) ? "yes" : "no");
+      if (info -> topn > 0) {
+        fprintf (stderr, "==\tColumns printed per row:                        %u\n", info -> topn);
+      }
+      if (info -> threshold > 0.0) {
+        fprintf (stderr, "==\tSmallest probability printed:                   %g\n", info -> threshold);
+      }
+      if (info -> online_rows > 0) {
+        fprintf (stderr, "==\tOnline EM:                                      %u rows per batch\n", info -> online_rows);
+        fprintf (stderr, "==\t  Decay of the step size:                       %.2f\n", info -> decay);
+      }
+      if (info -> restarts > 1) {
+        fprintf (stderr, "==\tModels trained at once:                         %u (%s)\n", info -> restarts, (info -> keep_restarts) ? "all written" : "best written");
+      }
+      fprintf (stderr, "==\tArithmetic:                                     %s\n", (info -> linear) ? "linear-space" : "log-space");
+      fprintf (stderr, "==\t  Kernels:                                      %s\n", kernelsName (info -> simd));
+      fprintf (stderr, "==\t  Log-space sums:                               %s\n", accuracyName (info -> accuracy));
+      fprintf (stderr, "==\t  E and M steps divided by:                     %s\n", (info -> estep == ESTEP_ROWS) ? "rows" : "clusters");
     }
 #if HAVE_MPI
     fprintf (stderr, "==\tMPI:                                            OK\n");
     fprintf (stderr, "==\t  My ID:                                        %d\n", info -> world_id);
     fprintf (stderr, "==\t  Number of processes:                          %d\n", info -> world_size);
+    fprintf (stderr, "==\t  Processes on this computer:                   %d\n", info -> node_size);
+    fprintf (stderr, "==\t  Work divided by:                              %s\n", (info -> decompose == DECOMPOSE_ROWS) ? "rows" : "clusters");
     fprintf (stderr, "==\t  Block range:                                  %u - %u\n", info -> block_start, info -> block_end);
     fprintf (stderr, "==\t  Block size:                                   %u\n", info -> block_size);
 #else
@@ -157,6 +297,7 @@ bool checkSettings (INFO *info) {
 #if HAVE_OPENMP
     fprintf (stderr, "==\tOpen MP:                                        OK\n");
     fprintf (stderr, "==\t  Number of threads:                            %u\n", info -> threads);
+    fprintf (stderr, "==\t  Threads pinned:                               %s\n", (info -> pin) ? "yes" : "no");
 #else
     fprintf (stderr, "==\tOpen MP:                                        Not enabled\n");
 #endif
@@ -181,6 +322,12 @@ bool processOptions (int argc, char *argv[], INFO *info) {
   bool textio = false;
   bool rounding = false;
   bool no_output = false;
+  bool linear = false;
+  unsigned int simd = SIMD_AUTO;
+  unsigned int accuracy = ACCURACY_LEGACY;
+  PROBNODE ln_limit = LN_LIMIT;
+  unsigned int estep = ESTEP_ROWS;
+  unsigned int decompose = DECOMPOSE_CLUSTERS;
 
   /*  Usage information if no arguments  */
   if (argc == 1) {
@@ -197,11 +344,32 @@ bool processOptions (int argc, char *argv[], INFO *info) {
       {"maxiter", 1, 0, 0},
       {"snapshot", 1, 0, 0},
       {"openmp", 1, 0, 0},
+      {"pin", 0, 0, 0},
       {"verbose", 0, 0, 0},
       {"debug", 0, 0, 0},
       {"text", 0, 0, 0},
       {"rounding", 0, 0, 0},
       {"nooutput", 0, 0, 0},
+      {"model", 0, 0, 0},
+      {"topn", 1, 0, 0},
+      {"threshold", 1, 0, 0},
+      {"foldin", 1, 0, 0},
+      {"init-model", 1, 0, 0},
+      {"holdout", 1, 0, 0},
+      {"holdout-every", 1, 0, 0},
+      {"patience", 1, 0, 0},
+      {"tempered", 1, 0, 0},
+      {"online", 1, 0, 0},
+      {"decay", 1, 0, 0},
+      {"restarts", 1, 0, 0},
+      {"keep-restarts", 0, 0, 0},
+      {"linear", 0, 0, 0},
+      {"simd", 1, 0, 0},
+      {"accuracy", 1, 0, 0},
+      {"lnlimit", 1, 0, 0},
+      {"estep", 1, 0, 0},
+      {"decompose", 1, 0, 0},
+      {"shared-input", 0, 0, 0},
       {0, 0, 0, 0}
     };
 
@@ -236,7 +404,7 @@ bool processOptions (int argc, char *argv[], INFO *info) {
 #if HAVE_OPENMP
           /*  Check the previously set value, which is the maximum for the system  */
           if (atoi (optarg) > info -> threads) {
-            fprintf (stderr, "==\tError:  The number of threads requested exceeds the number available in the system (%u).\n", info -> threads);
+            fprintf (stderr, "==\tError:  The number of threads requested exceeds the number of processors available to this process (%u).\n", info -> threads);
             exit (-1);
           }
           info -> threads = atoi (optarg);
@@ -246,6 +414,94 @@ bool processOptions (int argc, char *argv[], INFO *info) {
           exit (-1);
 #endif
         }
+        else if (strcmp (long_options[option_index].name, "pin") == 0) {
+          info -> pin = true;
+        }
+        else if (strcmp (long_options[option_index].name, "shared-input") == 0) {
+#if HAVE_MPI
+          info -> shared_input = true;
+#else
+          fprintf (stderr, "==\tError:  MPI is not enabled; --shared-input meaningless.\n");
+          exit (-1);
+#endif
+        }
+        else if (strcmp (long_options[option_index].name, "model") == 0) {
+          info -> model_output = true;
+        }
+        else if (strcmp (long_options[option_index].name, "topn") == 0) {
+          if (atoi (optarg) <= 0) {
+            fprintf (stderr, "==\tError:  --topn must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+          info -> topn = atoi (optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "init-model") == 0) {
+          info -> init_model_fn = wmalloc (strlen (optarg) + 1);
+          info -> init_model_fn = strcpy (info -> init_model_fn, optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "holdout") == 0) {
+          info -> holdout = atof (optarg);
+          if ((info -> holdout <= 0.0) || (info -> holdout >= 1.0)) {
+            fprintf (stderr, "==\tError:  --holdout must be above 0 and below 1.\n");
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "holdout-every") == 0) {
+          if (atoi (optarg) <= 0) {
+            fprintf (stderr, "==\tError:  --holdout-every must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+          info -> holdout_every = atoi (optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "patience") == 0) {
+          if (atoi (optarg) <= 0) {
+            fprintf (stderr, "==\tError:  --patience must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+          info -> holdout_patience = atoi (optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "tempered") == 0) {
+          info -> tempered = atof (optarg);
+          if ((info -> tempered <= 0.0) || (info -> tempered >= 1.0)) {
+            fprintf (stderr, "==\tError:  --tempered must be above 0 and below 1.\n");
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "online") == 0) {
+          if (atoi (optarg) <= 0) {
+            fprintf (stderr, "==\tError:  --online must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+          info -> online_rows = atoi (optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "decay") == 0) {
+          info -> decay = atof (optarg);
+          if ((info -> decay <= 0.5) || (info -> decay > 1.0)) {
+            fprintf (stderr, "==\tError:  --decay must be above 0.5 and at most 1.\n");
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "restarts") == 0) {
+          if (atoi (optarg) <= 0) {
+            fprintf (stderr, "==\tError:  --restarts must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+          info -> restarts = atoi (optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "keep-restarts") == 0) {
+          info -> keep_restarts = true;
+        }
+        else if (strcmp (long_options[option_index].name, "foldin") == 0) {
+          info -> foldin_fn = wmalloc (strlen (optarg) + 1);
+          info -> foldin_fn = strcpy (info -> foldin_fn, optarg);
+        }
+        else if (strcmp (long_options[option_index].name, "threshold") == 0) {
+          info -> threshold = atof (optarg);
+          if ((info -> threshold <= 0.0) || (info -> threshold > 1.0)) {
+            fprintf (stderr, "==\tError:  --threshold must be a probability above 0.\n");
+            exit (EXIT_FAILURE);
+          }
+        }
         else if (strcmp (long_options[option_index].name, "verbose") == 0) {
           verbose = true;
         }
@@ -261,6 +517,52 @@ bool processOptions (int argc, char *argv[], INFO *info) {
         else if (strcmp (long_options[option_index].name, "nooutput") == 0) {
           no_output = true;
         }
+        else if (strcmp (long_options[option_index].name, "linear") == 0) {
+          linear = true;
+        }
+        else if (strcmp (long_options[option_index].name, "simd") == 0) {
+          if (!kernelsLookup (optarg, &simd)) {
+            fprintf (stderr, "==\tError:  Unknown instruction set for --simd (%s).\n", optarg);
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "accuracy") == 0) {
+          if (!accuracyLookup (optarg, &accuracy)) {
+            fprintf (stderr, "==\tError:  Unknown accuracy for --accuracy (%s).\n", optarg);
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "lnlimit") == 0) {
+          ln_limit = atof (optarg);
+          if (ln_limit <= 0.0) {
+            fprintf (stderr, "==\tError:  --lnlimit must be positive.\n");
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "estep") == 0) {
+          if (strcmp (optarg, "rows") == 0) {
+            estep = ESTEP_ROWS;
+          }
+          else if (strcmp (optarg, "clusters") == 0) {
+            estep = ESTEP_CLUSTERS;
+          }
+          else {
+            fprintf (stderr, "==\tError:  Unknown value for --estep (%s).\n", optarg);
+            exit (EXIT_FAILURE);
+          }
+        }
+        else if (strcmp (long_options[option_index].name, "decompose") == 0) {
+          if (strcmp (optarg, "clusters") == 0) {
+            decompose = DECOMPOSE_CLUSTERS;
+          }
+          else if (strcmp (optarg, "rows") == 0) {
+            decompose = DECOMPOSE_ROWS;
+          }
+          else {
+            fprintf (stderr, "==\tError:  Unknown value for --decompose (%s).\n", optarg);
+            exit (EXIT_FAILURE);
+          }
+        }
         break;
       default:
         printf ("?? getopt returned character code 0%o ??\n", c);
@@ -279,11 +581,13 @@ bool processOptions (int argc, char *argv[], INFO *info) {
   info -> textio = textio;
   info -> rounding = rounding;
   info -> no_output = no_output;
-
-  /*  Set the range of clusters this process will handle  */
-  info -> block_start = BLOCK_LOW (info ->  world_id, info -> world_size, info -> num_clusters);
-  info -> block_end = BLOCK_HIGH (info ->  world_id, info -> world_size, info -> num_clusters);
-  info -> block_size = BLOCK_SIZE (info ->  world_id, info -> world_size, info -> num_clusters);
+  info -> linear = linear;
+  info -> simd = simd;
+  info -> accuracy = accuracy;
+  info -> ln_limit = ln_limit;
+  info -> estep = estep;
+  info -> decompose = decompose;
+  initKernels (info);
 
   return true;
 }
@@ -0,0 +1,247 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Convert a legacy co-occurrence file (binary or text; see readCO) to
+**  version 2 (see cofile.h).
+**
+**  The input is read twice:  once to count the pairs, which fixes where
+**  each section of the output starts, and once to write the sections.
+**  Each section is written sequentially through its own stream, so memory
+**  use does not depend on the size of the input.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "plsa-defn.h"
+#include "cofile.h"
+
+
+static void usage (char *progname) {
+  fprintf (stderr, "Convert a legacy co-occurrence file to version 2 for PLSA\n");
+  fprintf (stderr, "Usage:  %s [options] <input> <output>\n\n", progname);
+  fprintf (stderr, "--text             :  The input is in text.\n");
+  fprintf (stderr, "--nologs           :  Do not store the log counts (smaller file; logs are taken when read).\n");
+  exit (EXIT_FAILURE);
+}
+
+
+/*!  Read one unsigned integer from a legacy file; false at the end of the file  */
+static bool readValue (FILE *fp, bool textio, unsigned int *value) {
+  if (textio) {
+    return (fscanf (fp, "%u", value) == 1);
+  }
+
+  return (fread (value, sizeof (unsigned int), 1, fp) == 1);
+}
+
+
+/*!  Read a value that must be present  */
+static unsigned int needValue (FILE *fp, bool textio, const char *fn) {
+  unsigned int value = 0;
+
+  if (!readValue (fp, textio, &value)) {
+    fprintf (stderr, "Error:  %s ends early.\n", fn);
+    exit (EXIT_FAILURE);
+  }
+
+  return (value);
+}
+
+
+/*!  Read the header and ids of a legacy file, leaving fp at the first row  */
+static void readLegacyHeader (FILE *fp, bool textio, const char *fn, uint32_t *m, uint32_t *n, uint32_t *ids) {
+  uint32_t i;
+
+  *m = needValue (fp, textio, fn);
+  *n = needValue (fp, textio, fn);
+  for (i = 0; i < *m + *n; i++) {
+    if (ids != NULL) {
+      ids[i] = needValue (fp, textio, fn);
+    }
+    else {
+      (void) needValue (fp, textio, fn);
+    }
+  }
+
+  return;
+}
+
+
+/*!  Open the output at a given position  */
+static FILE *openAt (const char *fn, uint64_t offset) {
+  FILE *fp = NULL;
+
+  FOPEN (fn, fp, "r+b");
+  if (fseeko (fp, (off_t) offset, SEEK_SET) != 0) {
+    fprintf (stderr, "Error seeking in %s.\n", fn);
+    exit (EXIT_FAILURE);
+  }
+
+  return (fp);
+}
+
+
+int main (int argc, char *argv[]) {
+  bool textio = false;
+  bool logs = true;
+  char *in_fn;
+  char *out_fn;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  FILE *fp_rows = NULL;
+  FILE *fp_columns = NULL;
+  FILE *fp_counts = NULL;
+  FILE *fp_logs = NULL;
+  COFILEHEADER header;
+  COFILELAYOUT layout;
+  uint32_t m = 0;
+  uint32_t n = 0;
+  uint32_t *ids = NULL;
+  uint64_t nnz = 0;
+  uint64_t offset = 0;
+  uint32_t i;
+  uint32_t j;
+  unsigned int w1;
+  unsigned int cos_count;
+  unsigned int w2;
+  unsigned int freq;
+  double log_count;
+  int c;
+
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"text", 0, 0, 0},
+      {"nologs", 0, 0, 0},
+      {0, 0, 0, 0}
+    };
+
+    c = getopt_long (argc, argv, "", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    if (c != 0) {
+      usage (argv[0]);
+    }
+    if (strcmp (long_options[option_index].name, "text") == 0) {
+      textio = true;
+    }
+    else if (strcmp (long_options[option_index].name, "nologs") == 0) {
+      logs = false;
+    }
+  }
+  if (optind + 2 != argc) {
+    usage (argv[0]);
+  }
+  in_fn = argv[optind];
+  out_fn = argv[optind + 1];
+
+  /*  First pass:  count the pairs  */
+  FOPEN (in_fn, in, textio ? "r" : "rb");
+  readLegacyHeader (in, textio, in_fn, &m, &n, NULL);
+  for (i = 0; i < m; i++) {
+    if (!readValue (in, textio, &w1)) {
+      fprintf (stderr, "Error:  Only %u of %u rows found in %s.\n", i, m, in_fn);
+      exit (EXIT_FAILURE);
+    }
+    cos_count = needValue (in, textio, in_fn);
+    if (textio) {
+      for (j = 0; j < 2 * cos_count; j++) {
+        (void) needValue (in, textio, in_fn);
+      }
+    }
+    else {
+      (void) fseeko (in, (off_t) cos_count * 2 * sizeof (unsigned int), SEEK_CUR);
+    }
+    nnz += cos_count;
+  }
+  FCLOSE (in);
+
+  cofileInitHeader (&header, m, n, nnz, logs ? COFILE_LOG_COUNTS : 0);
+  cofileLayout (&header, &layout);
+
+  /*  Create the output at its full size  */
+  FOPEN (out_fn, out, "wb");
+  if ((fwrite (&header, sizeof (COFILEHEADER), 1, out) != 1) || (ftruncate (fileno (out), (off_t) layout.size) != 0)) {
+    fprintf (stderr, "Error writing %s.\n", out_fn);
+    exit (EXIT_FAILURE);
+  }
+  FCLOSE (out);
+
+  /*  Second pass:  write the sections  */
+  FOPEN (in_fn, in, textio ? "r" : "rb");
+  ids = malloc (((size_t) m + n) * sizeof (uint32_t));
+  if (ids == NULL) {
+    fprintf (stderr, "Error allocating the ids.\n");
+    exit (EXIT_FAILURE);
+  }
+  readLegacyHeader (in, textio, in_fn, &m, &n, ids);
+  out = openAt (out_fn, layout.row_ids);
+  fwrite (ids, sizeof (uint32_t), (size_t) m + n, out);
+  FCLOSE (out);
+  free (ids);
+
+  fp_rows = openAt (out_fn, layout.row_offsets);
+  fp_columns = openAt (out_fn, layout.columns);
+  fp_counts = openAt (out_fn, layout.counts);
+  if (logs) {
+    fp_logs = openAt (out_fn, layout.log_counts);
+  }
+
+  for (i = 0; i < m; i++) {
+    w1 = needValue (in, textio, in_fn);
+    cos_count = needValue (in, textio, in_fn);
+    fwrite (&offset, sizeof (uint64_t), 1, fp_rows);
+    for (j = 0; j < cos_count; j++) {
+      w2 = needValue (in, textio, in_fn);
+      freq = needValue (in, textio, in_fn);
+      if (w2 >= n) {
+        fprintf (stderr, "Error:  Word 2 (%u) of row %u is out of range (%u).\n", w2, i, n);
+        exit (EXIT_FAILURE);
+      }
+      fwrite (&w2, sizeof (uint32_t), 1, fp_columns);
+      fwrite (&freq, sizeof (uint32_t), 1, fp_counts);
+      if (logs) {
+        /*  The same value as readCO would calculate  */
+        log_count = DOLOG (freq);
+        fwrite (&log_count, sizeof (double), 1, fp_logs);
+      }
+    }
+    offset += cos_count;
+  }
+  fwrite (&offset, sizeof (uint64_t), 1, fp_rows);
+  FCLOSE (in);
+
+  if ((fclose (fp_rows) != 0) || (fclose (fp_columns) != 0) || (fclose (fp_counts) != 0) || (logs && (fclose (fp_logs) != 0))) {
+    fprintf (stderr, "Error writing %s.\n", out_fn);
+    exit (EXIT_FAILURE);
+  }
+
+  fprintf (stderr, "==\tConverted %u rows, %u columns and %llu pairs.\n", m, n, (unsigned long long) nnz);
+
+  return (EXIT_SUCCESS);
+}
@@ -50,7 +50,7 @@ typedef float PROBNODE;
 **  e^(-11.51292547) = 0.00001
 **  e^(-9.210340372) = 0.0001
 */
-/*!  Accuracy of floating point values as a log (base e) value, multiplied by -1  */
+/*!  Accuracy of floating point values as a log (base e) value, multiplied by -1; default for --lnlimit  */
 #define LN_LIMIT 23.02585093
 
 /*!  Minimum probability  */
@@ -77,6 +77,24 @@ typedef float PROBNODE;
 /*!  Minimum difference between two maximum likelihoods  */
 #define ML_DELTA 0.001
 
+/*!  Default number of evaluations of the held-out pairs in a row without improvement before training stops (see run.c)  */
+#define HOLDOUT_PATIENCE 3
+
+/*!  Default decay of the step size of online EM (see online.c); the step of batch t is (t + 2)^-decay  */
+#define ONLINE_DECAY 0.7
+
+/*!  EM steps of each row of a batch of online EM  */
+#define ONLINE_ROW_STEPS 5
+
+/*!  Smallest scale of the statistics of online EM before they are multiplied out (see online.c)  */
+#define ONLINE_MIN_SCALE 1e-100
+
+/*!  EM steps before a model of --restarts may be abandoned (see restarts.c)  */
+#define RESTART_GRACE 10
+
+/*!  A model of --restarts is abandoned if its log likelihood is this many percent below the best one after as many steps  */
+#define RESTART_BEHIND 0.5
+
 /*!  ID of the main processor is always 0  */
 #define MAINPROC 0
 
@@ -98,26 +116,8 @@ typedef float PROBNODE;
 #define BLOCK_SIZE(id, p, n) (BLOCK_LOW ((id) + 1, p, n)-BLOCK_LOW(id, p, n))
 #define BLOCK_OWNER(index, p, n) (((p) * ((index)+1)-1)/(n))
 
-/*!  Maximum latent state -- value must be a multiple of 10 and the true maximum state is 1 less.  Affects the function macro MSG_TAG.  */
-#define MAX_CLUSTERS 1000
-
-/*!  Define the message tag based on the iteration, type of message, and cluster number */
-#define MSG_TAG(X,Y,Z) ((X * 10000) + (Y * MAX_CLUSTERS) + Z)
-
-#define TAG_PROBW1_Z 1
-#define TAG_PROBW2_Z 2
-#define TAG_PROBZ 3
-#define TAG_PROBZ_W1W2 4
-#define TAG_PROBW1W2 5
-
-/*!  V is the current process; W is the recipient; X, Y, Z are the iteration, message type, and cluster ID  */
-#if DEBUG
-#define MSG_SEND_STATUS(V,W,X,Y,Z) fprintf (stderr, "[%u] Send to %u (%u, %u, %u)...\n", V, W, X, Y, Z);
-#define MSG_RECV_STATUS(V,W,X,Y,Z) fprintf (stderr, "[%u] Receive from %u (%u, %u, %u)...\n", V, W, X, Y, Z);
-#else
-#define MSG_SEND_STATUS(V,W,X,Y,Z) ;
-#define MSG_RECV_STATUS(V,W,X,Y,Z) ;
-#endif
+/*!  Number of parts p(w1,w2) is reduced in, so that each part is sent while the next is calculated  */
+#define MERGE_PARTS 8
 
 /********************************************************************/
 /*   Inline functions  */
@@ -141,28 +141,34 @@ if (info -> verbose) { \
 /********************************************************************/
 /*  Functions for accessing cooccurrence structure  */
 
-/*!  Function to retrieve from the cooccurrence array  */
-#define SET_COS(W,X,Y,Z) \
+/*!  Function to store a pair in the cooccurrence arrays -- X is the position among all pairs; Y is w2; Z is the count (as a log value)  */
+#define SET_COS(X,Y,Z) \
 { \
-  info -> cos[W][X].column = Y; \
-  info -> cos[W][X].x = Z; \
+  info -> cos_columns[X] = Y; \
+  info -> cos_counts[X] = Z; \
 }
 
-/*!  Function to retrieve the position from the cooccurrence array  */
-#define GET_COS(W,X) (info -> cos[W][X].x)
+/*!  Position of the first pair of row W in the cooccurrence arrays  */
+#define GET_COS_START(W) (info -> cos_rows[W])
 
-/*!  Function to retrieve the cooccurrence count from the cooccurrence array  */
-#define GET_COS_POSITION(W,X) (info -> cos[W][X].column)
+/*!  Position after the last pair of row W in the cooccurrence arrays  */
+#define GET_COS_END(W) (info -> cos_rows[(W) + 1])
+
+/*!  Function to retrieve the cooccurrence count (as a log value) at position X of the cooccurrence arrays  */
+#define GET_COS(X) (info -> cos_counts[X])
+
+/*!  Function to retrieve the column (w2) at position X of the cooccurrence arrays  */
+#define GET_COS_POSITION(X) (info -> cos_columns[X])
 
 /********************************************************************/
 /*  Functions for accessing probabilities  */
 /*!  Function to retrieve from P(w1|z); translate 2D to 1D co-ordinates -- X is z; Y is w1  */
-#define GET_PROBW1_Z_PREV(X,Y) (info -> probw1_z_prev[X * info -> m + Y])
-#define GET_PROBW1_Z_CURR(X,Y) (info -> probw1_z_curr[X * info -> m + Y])
+#define GET_PROBW1_Z_PREV(X,Y) (info -> probw1_z_prev[(size_t) (X) * info -> m + (Y)])
+#define GET_PROBW1_Z_CURR(X,Y) (info -> probw1_z_curr[(size_t) (X) * info -> m + (Y)])
 
 /*!  Function to retrieve from P(w2|z); translate 2D to 1D co-ordinates -- X is z; Y is w2  */
-#define GET_PROBW2_Z_PREV(X,Y) (info -> probw2_z_prev[X * info -> n + Y])
-#define GET_PROBW2_Z_CURR(X,Y) (info -> probw2_z_curr[X * info -> n + Y])
+#define GET_PROBW2_Z_PREV(X,Y) (info -> probw2_z_prev[(size_t) (X) * info -> n + (Y)])
+#define GET_PROBW2_Z_CURR(X,Y) (info -> probw2_z_curr[(size_t) (X) * info -> n + (Y)])
 
 /*!  Function to retrieve from P(z) -- X is z  */
 #define GET_PROBZ_PREV(X) (info -> probz_prev[X])
@@ -172,8 +178,8 @@ if (info -> verbose) { \
 #define GET_PROBZ_W1W2_PREV(W,X,Y) (GET_PROBW1_Z_PREV(W,X) + GET_PROBW2_Z_PREV(W,Y) + GET_PROBZ_PREV(W))
 #define GET_PROBZ_W1W2_CURR(W,X,Y) (GET_PROBW1_Z_CURR(W,X) + GET_PROBW2_Z_CURR(W,Y) + GET_PROBZ_CURR(W))
 
-/*!  Function to retrieve from P(i,j) -- X is w1; Y is w2  */
-#define GET_PROB_W1W2(X, Y) (info -> prob_w1w2[X * info -> n + Y])
+/*!  Function to retrieve from P(i,j) -- X is the position of (i,j) in the cooccurrence arrays  */
+#define GET_PROB_W1W2(X) (info -> prob_w1w2[X])
 
 #define logSumsInline(A,B) \
 {                          \
@@ -187,16 +193,100 @@ if (info -> verbose) { \
                            \
   /*  a > b  */            \
                            \
-  A = (fabs (y - x) > LN_LIMIT) ? x : x + DOLOG1PEXP (y - x);   \
+  A = (fabs (y - x) > info -> ln_limit) ? x : x + DOLOG1PEXP (y - x);   \
+}
+
+/*!  As logSumsInline, but A may be -HUGE_VAL for a sum with no terms yet  */
+#define logSumsEmptyInline(A,B) \
+{                               \
+  if (isinf (A)) {              \
+    A = (B);                    \
+  }                             \
+  else logSumsInline (A,B)      \
 }
 
+/*!  An empty sum (-HUGE_VAL) as the minimum probability, for cells without any co-occurrences  */
+#define EMPTY_TO_MIN(X) ((isinf (X)) ? log (MIN_PROB) : (X))
+
+/*!  Most memory for the copies of P(w2|z) of --estep rows, as a multiple of
+**  that of P(w1|z) and P(w2|z); the clusters are divided among the threads
+**  instead if they need more  */
+#define ESTEP_COPIES_LIMIT 4.0
+
+/*!  How the E and M steps are divided among threads:  by rows (split by the number of co-occurrences), or by clusters  */
+#define ESTEP_ROWS 0
+#define ESTEP_CLUSTERS 1
+
+/*!  How the work is divided among MPI processes:  by clusters (each process reads all rows), or by rows (each process has all clusters)  */
+#define DECOMPOSE_CLUSTERS 0
+#define DECOMPOSE_ROWS 1
+
 /********************************************************************/
-typedef struct cooccur {
-  /*!  The co-occurrence count, as a log value  */
-  PROBNODE x;
-  /*!  Column position of this value  */
-  unsigned int column;
-} COOCCUR;
+/*  Kernels over the (padded) cluster dimension; see kernels.c  */
+
+/*!  The cluster dimension of the cluster-minor tables is padded to a multiple of this many values  */
+#define KERNEL_WIDTH 8
+
+/*!  Round X up to a multiple of KERNEL_WIDTH  */
+#define KERNEL_PAD(X) ((((X) + KERNEL_WIDTH - 1) / KERNEL_WIDTH) * KERNEL_WIDTH)
+
+/*!  Instruction sets for the kernels  */
+#define SIMD_AUTO 0
+#define SIMD_SCALAR 1
+#define SIMD_SSE2 2
+#define SIMD_AVX2 3
+#define SIMD_AVX512 4
+
+/*!  Accuracy of the log-sum-exp kernel:  pairwise logSumsInline in float, a polynomial exp accurate to about 1e-7, or one accurate to double precision  */
+#define ACCURACY_LEGACY 0
+#define ACCURACY_FAST 1
+#define ACCURACY_DOUBLE 2
+
+typedef struct kernels {
+  /*!  Return the sum of a[k] * b[k]  */
+  PROBNODE (*dot) (const PROBNODE *a, const PROBNODE *b, unsigned int len);
+  /*!  For t = f * q[k], add t to row[k] and t * r[k] to acc[k]  */
+  void (*scatter) (PROBNODE *acc, PROBNODE *row, const PROBNODE *q, const PROBNODE *r, PROBNODE f, unsigned int len);
+  /*!  Return log (sum exp (x[k])), ignoring the x[k] that are more than limit below the largest  */
+  PROBNODE (*logSumExp) (const PROBNODE *x, unsigned int len, PROBNODE limit);
+} KERNELS;
+
+/********************************************************************/
+/*  Work space of the EM steps; see initWorkspace  */
+
+/*!  Number of vectors over the clusters for each thread  */
+#define WORK_VECTORS 4
+
+/*!  Vector V of thread T, of KERNEL_PAD (num_clusters) values  */
+#define WORK_VECTOR(T,V) (info -> work.vectors + ((size_t) (T) * WORK_VECTORS + (V)) * info -> work.width)
+
+typedef struct workspace {
+  /*!  Number of threads the space is divided among  */
+  unsigned int threads;
+  /*!  Length of each vector, KERNEL_PAD (num_clusters)  */
+  unsigned int width;
+  /*!  With --linear, the sums of P(w2|z), of (width * n) values  */
+  PROBNODE *w2;
+  /*!  With --estep rows, the copy of P(w2|z) of each thread, of width values for each column of its rows, as [slot][k]  */
+  PROBNODE *copies;
+  /*!  First slot of the copy of each thread (threads + 1 of them)  */
+  size_t *copy_starts;
+  /*!  Slot of the column of each pair in the copy of the thread with its row  */
+  unsigned int *pair_slots;
+  /*!  Slots (of all copies, in thread order) that hold each column, with the first of each column in column_starts (n + 1)  */
+  size_t *column_starts;
+  size_t *column_slots;
+  /*!  Copy of P(z) for each thread, of width values  */
+  PROBNODE *z;
+  /*!  WORK_VECTORS vectors for each thread  */
+  PROBNODE *vectors;
+  /*!  With --linear, the shifted linear P(w2|z) as [w2][k] and the shift of each cluster  */
+  PROBNODE *q;
+  PROBNODE *shift;
+  /*!  With --linear, the shift of each row and the factor of each pair  */
+  PROBNODE *row_shift;
+  PROBNODE *factor;
+} WORKSPACE;
 
 
 typedef struct info {
@@ -210,6 +300,20 @@ typedef struct info {
   bool rounding;
   /*!  Suppress output  */
   bool no_output;
+  /*!  Calculate in linear-space instead of log-space  */
+  bool linear;
+  /*!  Instruction set requested for the kernels (SIMD_AUTO to detect)  */
+  unsigned int simd;
+  /*!  Accuracy of the log-sum-exp kernel  */
+  unsigned int accuracy;
+  /*!  Cut-off when adding log values; terms smaller by more than this are dropped  */
+  PROBNODE ln_limit;
+  /*!  Kernels for the instruction set in use  */
+  KERNELS kernels;
+  /*!  How the E and M steps are divided among threads  */
+  unsigned int estep;
+  /*!  How the work is divided among processes  */
+  unsigned int decompose;
 
   /*!  Random seed  */
   unsigned int seed;
@@ -221,22 +325,84 @@ typedef struct info {
   unsigned int maxiter;
   /*!  Intervals to output p(x,y); UINT_MAX means do not output  */
   unsigned int snapshot;
-  /*!  Number of unique query terms  */
+  /*!  Number of unique query terms held by this process (all of them, unless divided by rows)  */
   unsigned int m;
+  /*!  Number of unique query terms in the co-occurrence file  */
+  unsigned int m_global;
+  /*!  Index in the file of the first query term of this process  */
+  unsigned int row_offset;
   /*!  Number of terms in the document collection  */
   unsigned int n;
 
   /*!  Co-occurrence filename  */
   char *co_fn;
-  /*!  Co-occurrence counts in a COOCCUR data structure  */
-  COOCCUR **cos;
-  /*!  List of row identifiers (m of them)  */
+  /*  Co-occurrence counts, stored by row (compressed sparse row)  */
+  /*!  Position of the first pair of each row in cos_columns and cos_counts (m + 1 of them)  */
+  size_t *cos_rows;
+  /*!  Column (w2) of each pair (nnz of them)  */
+  unsigned int *cos_columns;
+  /*!  Co-occurrence count of each pair, as a log value (nnz of them)  */
+  PROBNODE *cos_counts;
+  /*!  Number of non-zero pairs in the co-occurrence data  */
+  size_t nnz;
+  /*  Pairs held out of training (see input.c::holdOut), stored as a list  */
+  /*!  Fraction of the pairs that are held out; 0 for none  */
+  PROBNODE holdout;
+  /*!  Iterations between evaluations of the held-out pairs  */
+  unsigned int holdout_every;
+  /*!  Evaluations in a row without improvement before training stops (or beta is lowered)  */
+  unsigned int holdout_patience;
+  /*!  Number of held-out pairs of this process  */
+  size_t held_nnz;
+  /*!  Row (local to this process) of each held-out pair  */
+  unsigned int *held_rows;
+  /*!  Column of each held-out pair  */
+  unsigned int *held_columns;
+  /*!  Co-occurrence count of each held-out pair, as a log value  */
+  PROBNODE *held_counts;
+  /*!  Log likelihood of the held-out pairs for the final model; only known by the main process  */
+  PROBNODE held_likelihood;
+  /*!  Tempered EM:  factor that beta is multiplied by when the held-out likelihood stops improving; 0 for plain EM  */
+  PROBNODE tempered;
+  /*!  Exponent of p(z,w1,w2) in the E-step; 1 for plain EM  */
+  PROBNODE beta;
+  /*!  Number of models trained at once from the seeds seed, seed + 1, ... (see restarts.c); 0 or 1 for one  */
+  unsigned int restarts;
+  /*!  Write every model of --restarts instead of only the best one  */
+  bool keep_restarts;
+  /*!  Which of the models of --restarts this is  */
+  unsigned int restart;
+  /*!  Log likelihoods of all models of --restarts so far; NULL for one model  */
+  struct restarts *race;
+  /*!  Mapping of a version 2 co-occurrence file, whose arrays may be used in place by cos_*; NULL if none  */
+  void *co_map;
+  /*!  Size of the mapping in bytes  */
+  size_t co_map_size;
+  /*!  List of row identifiers (m_global of them)  */
   unsigned int *row_ids;
   /*!  List of column identifiers (m of them)  */
   unsigned int *column_ids;
 
   /*!  Iteration; only calculated by the main process and broadcasted to others  */
   unsigned int iter;
+  /*!  Number of EM steps applied to the final model  */
+  unsigned int iterations;
+  /*!  Log likelihood of the final model; only known by the main process  */
+  PROBNODE likelihood;
+  /*!  Write the factored model (see model.h)?  */
+  bool model_output;
+  /*!  Print only this many of the most probable columns of each row of p(x,y); 0 for all  */
+  unsigned int topn;
+  /*!  Print only the values of p(x,y) of at least this probability (not a log); 0 for all  */
+  PROBNODE threshold;
+  /*!  Model to fold the rows of the co-occurrence file into (see foldin.c); NULL to train one  */
+  char *foldin_fn;
+  /*!  Model to start training from instead of random probabilities (see em-steps.c::warmStart); NULL for none  */
+  char *init_model_fn;
+  /*!  Rows of each batch of online EM (see online.c); 0 for batch EM  */
+  unsigned int online_rows;
+  /*!  Decay of the step size of online EM, in (0.5, 1]  */
+  PROBNODE decay;
 
   /*!  P(w1|z) of size (k * m)  */
   PROBNODE *probw1_z_curr;
@@ -252,17 +418,28 @@ typedef struct info {
   /*!  P'(z) of size (k)  */
   PROBNODE *probz_prev;
 
-  /*!  P(w1,w2) of size (m * n)  */
+  /*!  P(w1,w2) of size (nnz); only kept for the non-zero pairs, parallel to cos_columns  */
   PROBNODE *prob_w1w2;
 
+  /*!  Work space of the EM steps  */
+  WORKSPACE work;
+
   /*  Variables specific to Open MP  */
   int threads;
+  /*!  Keep each thread on one processor?  */
+  bool pin;
 
   /*  Variables specific to MPI  */
   /*!  ID of this process  */
   signed int world_id;
   /*!  Number of processes total  */
   signed int world_size;
+  /*!  ID of this process among those on the same computer  */
+  signed int node_id;
+  /*!  Number of processes on the same computer  */
+  signed int node_size;
+  /*!  Do the processes of each computer share one copy of the co-occurrence data?  */
+  bool shared_input;
   /*!  Starting block (cluster) for this process to handle  */
   unsigned int block_start;
   /*!  Ending block (cluster) for this process to handle  */
@@ -285,6 +462,9 @@ typedef struct info {
   double gatherProbs_time;
   double normalizeProbs_time;
   double distributeProbs_time;
+  /*!  Seconds spent waiting for the reductions of p(w1,w2) and for the exchanges of the probabilities (MPI only)  */
+  double waitMerge_time;
+  double waitGather_time;
   double printCoProbs_time;
   time_t program_end;
 } INFO;
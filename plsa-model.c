@@ -0,0 +1,131 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Print the header of a model file (see model.h) and, if asked, log
+**  p(x,y) of some of its rows, calculated from the model.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "model.h"
+
+
+static void usage (char *progname) {
+  fprintf (stderr, "Print a PLSA model and p(x,y) calculated from it\n");
+  fprintf (stderr, "Usage:  %s [options] <model>\n\n", progname);
+  fprintf (stderr, "--row <id>         :  Print log p(x,y) of the row with this id (may be repeated).\n");
+  fprintf (stderr, "--all              :  Print log p(x,y) of all rows.\n");
+  exit (EXIT_FAILURE);
+}
+
+
+/*!  Print the row with index i as its id followed by log p(x,y) of each column  */
+static void printRow (const MODEL *model, uint32_t i, double *row) {
+  uint32_t j;
+
+  modelRow (model, i, row);
+  printf ("%u", model -> row_ids[i]);
+  for (j = 0; j < model -> header.n; j++) {
+    printf ("\t%lf", row[j]);
+  }
+  printf ("\n");
+
+  return;
+}
+
+
+int main (int argc, char *argv[]) {
+  MODEL *model;
+  uint32_t *ids = NULL;
+  unsigned int count = 0;
+  bool all = false;
+  double *row;
+  uint32_t i;
+  unsigned int r;
+  int c;
+
+  ids = malloc (argc * sizeof (uint32_t));
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"row", 1, 0, 0},
+      {"all", 0, 0, 0},
+      {0, 0, 0, 0}
+    };
+
+    c = getopt_long (argc, argv, "", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    if (c != 0) {
+      usage (argv[0]);
+    }
+    if (strcmp (long_options[option_index].name, "row") == 0) {
+      ids[count++] = strtoul (optarg, NULL, 10);
+    }
+    else if (strcmp (long_options[option_index].name, "all") == 0) {
+      all = true;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage (argv[0]);
+  }
+
+  model = modelOpen (argv[optind]);
+  if (model == NULL) {
+    return (EXIT_FAILURE);
+  }
+
+  fprintf (stderr, "==\tRows (m):                                       %u\n", model -> header.m);
+  fprintf (stderr, "==\tColumns (n):                                    %u\n", model -> header.n);
+  fprintf (stderr, "==\tLatent states (k):                              %u\n", model -> header.k);
+  fprintf (stderr, "==\tRandom seed:                                    %u\n", model -> header.seed);
+  fprintf (stderr, "==\tEM steps:                                       %u\n", model -> header.iterations);
+  fprintf (stderr, "==\tLog likelihood:                                 %f\n", model -> header.likelihood);
+
+  row = malloc ((model -> header.n + 1) * sizeof (double));
+  if (all) {
+    for (i = 0; i < model -> header.m; i++) {
+      printRow (model, i, row);
+    }
+  }
+  for (r = 0; r < count; r++) {
+    for (i = 0; i < model -> header.m; i++) {
+      if (model -> row_ids[i] == ids[r]) {
+        break;
+      }
+    }
+    if (i == model -> header.m) {
+      fprintf (stderr, "Row %u is not in the model.\n", ids[r]);
+      continue;
+    }
+    printRow (model, i, row);
+  }
+
+  free (row);
+  free (ids);
+  modelClose (model);
+
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,304 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Random restarts:  EM only finds a local maximum of the likelihood, which
+**  depends on the random initial probabilities.  --restarts R trains R
+**  models from the seeds seed, seed + 1, ..., seed + R - 1 with the
+**  co-occurrence data read once and shared by all of them.  The threads of
+**  the process are divided among min (R, threads) models at a time, and
+**  each model has its own probabilities and work space.
+**
+**  Each model records its log likelihood after every EM step.  After
+**  RESTART_GRACE steps, a model whose log likelihood is more than
+**  RESTART_BEHIND percent below that of the best model after as many steps
+**  (or when it stopped, if it stopped earlier) is abandoned.  The best of
+**  the remaining models, by the log likelihood of the held-out pairs with
+**  --holdout and otherwise of the pairs trained on, is written as usual;
+**  with --keep-restarts, no model is abandoned and model r is written to
+**  <base>.r<r>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>                                  /*  UINT_MAX  */
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "em-steps.h"
+#include "input.h"
+#include "output.h"
+#include "comm.h"
+#include "run.h"
+#include "restarts.h"
+
+/*!  Log likelihoods of the models of --restarts, shared by the threads
+**  training them; only changed inside the critical section "restarts"  */
+typedef struct restarts {
+  /*!  Number of models  */
+  unsigned int count;
+  /*!  Log likelihoods kept per model (maxiter + 1)  */
+  unsigned int length;
+  /*!  Log likelihood of model r after t steps at history[r * length + t]  */
+  PROBNODE *history;
+  /*!  Number of log likelihoods recorded for each model  */
+  unsigned int *reached;
+  /*!  Has each model stopped?  */
+  bool *finished;
+  /*!  Was each model abandoned?  */
+  bool *abandoned;
+} RESTARTS;
+
+
+/*!  Record the log likelihood of the model of info after the given number
+**  of steps, and return false if the model should be abandoned since it is
+**  too far behind the best model after as many steps  */
+bool keepRestart (INFO *info, unsigned int step, PROBNODE likelihood) {
+  RESTARTS *race = info -> race;
+  PROBNODE leader = -HUGE_VAL;
+  PROBNODE other;
+  unsigned int r;
+  bool keep = true;
+
+  if (step >= race -> length) {
+    return true;
+  }
+
+#if HAVE_OPENMP
+#pragma omp critical (restarts)
+#endif
+  {
+    race -> history[(size_t) info -> restart * race -> length + step] = likelihood;
+    race -> reached[info -> restart] = step + 1;
+
+    if ((step >= RESTART_GRACE) && (!info -> keep_restarts)) {
+      for (r = 0; r < race -> count; r++) {
+        if ((r == info -> restart) || (race -> abandoned[r])) {
+          continue;
+        }
+        /*  A model that stopped earlier would have stayed where it stopped  */
+        if (race -> reached[r] > step) {
+          other = race -> history[(size_t) r * race -> length + step];
+        }
+        else if ((race -> finished[r]) && (race -> reached[r] > 0)) {
+          other = race -> history[(size_t) r * race -> length + race -> reached[r] - 1];
+        }
+        else {
+          continue;
+        }
+        if (other > leader) {
+          leader = other;
+        }
+      }
+
+      if ((!isinf (leader)) && (likelihood < leader - fabs (leader) * RESTART_BEHIND / 100)) {
+        race -> abandoned[info -> restart] = true;
+        keep = false;
+      }
+    }
+  }
+
+  return (keep);
+}
+
+
+/*!  Train one model of --restarts with the threads given to this one  */
+static void trainRestart (INFO *model) {
+  initWorkspace (model);
+  iterate (model);
+  freeWorkspace (model);
+
+#if HAVE_OPENMP
+#pragma omp critical (restarts)
+#endif
+  {
+    model -> race -> finished[model -> restart] = true;
+  }
+
+  return;
+}
+
+
+/*!  Write model r, to <base>.r<r> if every model is written  */
+static void writeRestart (INFO *info, INFO *model) {
+  char *base_fn = model -> base_fn;
+
+  if (info -> keep_restarts) {
+    model -> base_fn = wmalloc (sizeof (char) * (strlen (base_fn) + 16));
+    sprintf (model -> base_fn, "%s.r%u", base_fn, model -> restart);
+  }
+  model -> verbose = info -> verbose;
+
+  if (!info -> no_output) {
+    printCoProb (model);
+  }
+  if (info -> model_output) {
+    printModel (model);
+  }
+
+  if (info -> keep_restarts) {
+    wfree (model -> base_fn);
+    model -> base_fn = base_fn;
+  }
+
+  return;
+}
+
+
+bool runRestarts (INFO *info) {
+  RESTARTS race;
+  INFO *models;
+  unsigned int count = info -> restarts;
+  unsigned int threads = 1;
+  unsigned int teams = 1;
+  unsigned int best = UINT_MAX;
+  PROBNODE score;
+  PROBNODE best_score = -HUGE_VAL;
+  unsigned int r;
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  if (!readCO (info)) {
+    fprintf (stderr, "Error reading co-occurrence data by processor %u.\n", info -> world_id);
+    return false;
+  }
+  initComm (info);
+  if (info -> verbose) {
+    fprintf (stderr, "==\tm = %u; n = %u\n", info -> m_global, info -> n);
+  }
+
+  race.count = count;
+  race.length = info -> maxiter + 1;
+  race.history = wmalloc ((size_t) count * race.length * sizeof (PROBNODE));
+  race.reached = wmalloc (count * sizeof (unsigned int));
+  race.finished = wmalloc (count * sizeof (bool));
+  race.abandoned = wmalloc (count * sizeof (bool));
+
+  /*  Each model shares the co-occurrence data of info; the first one also
+  **  uses its probabilities, which uninitialize frees.  The models are
+  **  initialized in turn, since rand () has one state  */
+  models = wmalloc (count * sizeof (INFO));
+  for (r = 0; r < count; r++) {
+    models[r] = *info;
+    models[r].seed = info -> seed + r;
+    models[r].restart = r;
+    models[r].race = &race;
+    models[r].verbose = false;
+    if (r > 0) {
+      initializePostInput (&(models[r]));
+      models[r].prob_w1w2 = wmalloc (info -> nnz * sizeof (PROBNODE));
+    }
+    race.reached[r] = 0;
+    race.finished[r] = false;
+    race.abandoned[r] = false;
+
+    srand (models[r].seed);
+    initEM (&(models[r]));
+  }
+
+  /*  Each team of threads trains one model at a time, with its share of
+  **  the threads for the EM steps  */
+#if HAVE_OPENMP
+  threads = omp_get_max_threads ();
+  teams = (count < threads) ? count : threads;
+  omp_set_max_active_levels (2);
+#pragma omp parallel num_threads(teams)
+  {
+    omp_set_num_threads (BLOCK_SIZE (omp_get_thread_num (), teams, threads));
+#pragma omp for schedule(dynamic,1)
+    for (r = 0; r < count; r++) {
+      trainRestart (&(models[r]));
+    }
+  }
+  omp_set_num_threads (threads);
+#else
+  for (r = 0; r < count; r++) {
+    trainRestart (&(models[r]));
+  }
+#endif
+
+  for (r = 0; r < count; r++) {
+    score = (info -> holdout > 0.0) ? models[r].held_likelihood : models[r].likelihood;
+    if ((!race.abandoned[r]) && ((best == UINT_MAX) || (score > best_score))) {
+      best = r;
+      best_score = score;
+    }
+    if (info -> verbose) {
+      fprintf (stderr, "[%3u]  Seed %u:  %u steps, log likelihood %f", r, models[r].seed, models[r].iterations, models[r].likelihood);
+      if (info -> holdout > 0.0) {
+        fprintf (stderr, ", held-out %f", models[r].held_likelihood);
+      }
+      fprintf (stderr, "%s\n", (race.abandoned[r]) ? " [abandoned]" : "");
+    }
+  }
+  if (info -> verbose) {
+    fprintf (stderr, "==\tModels trained:                                 %u at a time with %u threads each\n", teams, threads / teams);
+    fprintf (stderr, "==\tBest model:                                     %u (seed %u)\n", best, models[best].seed);
+  }
+
+  if (info -> keep_restarts) {
+    for (r = 0; r < count; r++) {
+      writeRestart (info, &(models[r]));
+    }
+  }
+  else {
+    writeRestart (info, &(models[best]));
+  }
+  info -> iterations = models[best].iterations;
+  info -> likelihood = models[best].likelihood;
+  info -> held_likelihood = models[best].held_likelihood;
+
+  for (r = 1; r < count; r++) {
+    wfree (models[r].prob_w1w2);
+    wfree (models[r].probw1_z_curr);
+    wfree (models[r].probw2_z_curr);
+    wfree (models[r].probz_curr);
+    wfree (models[r].probw1_z_prev);
+    wfree (models[r].probw2_z_prev);
+    wfree (models[r].probz_prev);
+  }
+  wfree (models);
+  wfree (race.history);
+  wfree (race.reached);
+  wfree (race.finished);
+  wfree (race.abandoned);
+
+  waitSnapshot (info);
+  freeComm (info);
+  freeSharedCO (info);
+
+  time (&end);
+  info -> run_time += difftime (end, start);
+
+  return (true);
+}
@@ -18,6 +18,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>                                  /*  UINT_MAX  */
 #include <stdbool.h>
 #include <math.h>  /*  fabs  */
@@ -33,11 +34,13 @@
 #include "wmalloc.h"
 #include "plsa-defn.h"
 #include "em-steps.h"
+#include "em-linear.h"
 #include "input.h"
 #include "output.h"
 #include "parameters.h"
 #include "debug.h"
 #include "comm.h"
+#include "restarts.h"
 #include "run.h"
 
 
@@ -55,12 +58,58 @@ INFO *initialize () {
   info -> gatherProbs_time = 0;
   info -> normalizeProbs_time = 0;
   info -> distributeProbs_time = 0;
+  info -> waitMerge_time = 0;
+  info -> waitGather_time = 0;
   info -> printCoProbs_time = 0;
 
   /*  MPI may or may not be in use; assume it is not and set defaults  */
   info -> world_id = MAINPROC;
   info -> world_size = 1;
+  info -> node_id = 0;
+  info -> node_size = 1;
   info -> threads = 0;
+  info -> pin = false;
+  info -> shared_input = false;
+  info -> model_output = false;
+  info -> topn = 0;
+  info -> threshold = 0.0;
+  info -> foldin_fn = NULL;
+  info -> init_model_fn = NULL;
+  info -> online_rows = 0;
+  info -> decay = ONLINE_DECAY;
+  info -> holdout = 0.0;
+  info -> holdout_every = 1;
+  info -> holdout_patience = HOLDOUT_PATIENCE;
+  info -> held_nnz = 0;
+  info -> held_rows = NULL;
+  info -> held_columns = NULL;
+  info -> held_counts = NULL;
+  info -> held_likelihood = 0.0;
+  info -> tempered = 0.0;
+  info -> beta = 1.0;
+  info -> restarts = 0;
+  info -> keep_restarts = false;
+  info -> restart = 0;
+  info -> race = NULL;
+  info -> iterations = 0;
+  info -> likelihood = 0.0;
+
+  /*  Nothing has been read or allocated yet; fold-in (see foldin.c) and
+  **  online EM (see online.c) do not use all of these  */
+  info -> cos_rows = NULL;
+  info -> cos_columns = NULL;
+  info -> cos_counts = NULL;
+  info -> co_map = NULL;
+  info -> co_map_size = 0;
+  info -> prob_w1w2 = NULL;
+  info -> probw1_z_curr = NULL;
+  info -> probw2_z_curr = NULL;
+  info -> probz_curr = NULL;
+  info -> probw1_z_prev = NULL;
+  info -> probw2_z_prev = NULL;
+  info -> probz_prev = NULL;
+  info -> row_ids = NULL;
+  info -> column_ids = NULL;
 
   /*  Set a handler for floating point exceptions  */
   info -> sigfpe_count = 0;
@@ -73,7 +122,11 @@ INFO *initialize () {
 void uninitialize (INFO *info) {
   double total_time = 0;
 
-  wfree (info -> cos);
+  freeCO (info);
+  wfree (info -> held_rows);
+  wfree (info -> held_columns);
+  wfree (info -> held_counts);
+  wfree (info -> prob_w1w2);
   wfree (info -> probw1_z_curr);
   wfree (info -> probw2_z_curr);
   wfree (info -> probz_curr);
@@ -82,6 +135,8 @@ void uninitialize (INFO *info) {
   wfree (info -> probz_prev);
   wfree (info -> base_fn);
   wfree (info -> co_fn);
+  wfree (info -> foldin_fn);
+  wfree (info -> init_model_fn);
   wfree (info -> row_ids);
   wfree (info -> column_ids);
 
@@ -109,6 +164,10 @@ void uninitialize (INFO *info) {
       fprintf (stderr, "==\t    Distribute probabilities:                   %6.2f %%\n", info -> distributeProbs_time / total_time * 100);
       fprintf (stderr, "==\t    Print probabilities:                        %6.2f %%\n", info -> printCoProbs_time / total_time * 100);
     }
+    if (info -> world_size > 1) {
+      fprintf (stderr, "==\tID %u waited for p(x,y):                         %.3f secs\n", info -> world_id, info -> waitMerge_time);
+      fprintf (stderr, "==\tID %u waited for probabilities:                  %.3f secs\n", info -> world_id, info -> waitGather_time);
+    }
   }
 
   wfree (info);
@@ -117,148 +176,373 @@ void uninitialize (INFO *info) {
 }
 
 
-bool run (INFO *info) {
+/*!  Copy p(w1|z), p(w2|z) and p(z) of *current* (of the rows of this
+**  process) to the given tables, or back from them if restore  */
+static void copyCurrent (INFO *info, PROBNODE *probw1_z, PROBNODE *probw2_z, PROBNODE *probz, bool restore) {
+  size_t w1_size = (size_t) info -> num_clusters * info -> m * sizeof (PROBNODE);
+  size_t w2_size = (size_t) info -> num_clusters * info -> n * sizeof (PROBNODE);
+  size_t z_size = info -> num_clusters * sizeof (PROBNODE);
+
+  if (restore) {
+    memcpy (info -> probw1_z_curr, probw1_z, w1_size);
+    memcpy (info -> probw2_z_curr, probw2_z, w2_size);
+    memcpy (info -> probz_curr, probz, z_size);
+  }
+  else {
+    memcpy (probw1_z, info -> probw1_z_curr, w1_size);
+    memcpy (probw2_z, info -> probw2_z_curr, w2_size);
+    memcpy (probz, info -> probz_curr, z_size);
+  }
+
+  return;
+}
+
+
+/*!  Apply EM steps to the initial probabilities in *current*, which all
+**  processes have, until the log likelihood stops improving (or the
+**  held-out pairs say so) or maxiter steps; the final model is left in
+**  *current*, and its number of steps and log likelihood in info.  With
+**  held-out pairs, the final model is the one that did best on them  */
+void iterate (INFO *info) {
   PROBNODE curr_ML = 0;
   PROBNODE prev_ML = 0;
   PROBNODE diff = 0.0;
+  PROBNODE held_ML = 0.0;
+  PROBNODE best_held = -HUGE_VAL;
+  PROBNODE best_ML = 0.0;
+  unsigned int best_step = UINT_MAX;  /*  Steps of the model that did best on the held-out pairs  */
+  PROBNODE *best_probw1_z = NULL;  /*  That model  */
+  PROBNODE *best_probw2_z = NULL;
+  PROBNODE *best_probz = NULL;
+  bool checked;  /*  Were the held-out pairs evaluated in this iteration?  */
+  bool improved = false;  /*  Has the held-out likelihood improved since beta was lowered?  */
+  unsigned int misses = 0;  /*  Evaluations in a row without improvement  */
+  bool stop_held = false;
+  bool can_fuse;
+  unsigned long loop_mallocs;
+  unsigned int loop_count = 0;
+  bool fused = false;
   int error_code;
 
   info -> iter = 0;
   error_code = 0;
 
-  time_t start;
-  time_t end;
   time_t loop_start;
   time_t loop_end;
   double timediff = 0.0;
 
-  time (&start);
-
-  /*  All processes read in co-occurrence data  */
-  if (!readCO (info)) {
-    /*  If there is an error, all processes are terminated  */
-    fprintf (stderr, "Error reading co-occurrence data by processor %u.\n", info -> world_id);
-#if HAVE_MPI
-    MPI_Abort (MPI_COMM_WORLD, 0);
-#endif
-    return false;
+  /*  With one process (or with the rows divided, when each process has all
+  **  clusters of its pairs), p(w1,w2), the log likelihood and the E- and
+  **  M-steps are done in one sweep (see applyEMStepFused); the likelihood is
+  **  then that of *previous* and known only after the steps, which are
+  **  discarded if the loop stops.  The last iteration allowed by maxiter is
+  **  not fused, since its steps would always be discarded; nor are those of
+  **  tempered EM with beta below 1, which needs p(w1,w2) twice  */
+  can_fuse = ((info -> world_size == 1) || (info -> decompose == DECOMPOSE_ROWS)) && (info -> estep == ESTEP_ROWS);
+
+  if (info -> holdout > 0.0) {
+    best_probw1_z = wmalloc ((size_t) info -> num_clusters * info -> m * sizeof (PROBNODE));
+    best_probw2_z = wmalloc ((size_t) info -> num_clusters * info -> n * sizeof (PROBNODE));
+    best_probz = wmalloc (info -> num_clusters * sizeof (PROBNODE));
   }
 
-  /*  Only MAINPROC initializes to ensure the random seed only affects it  */
-  if (info -> world_id == MAINPROC) {
-    /*  Initial probabilties placed in *current*  */
-    initEM (info);
-    if (info -> verbose) {
-      fprintf (stderr, "==\tm = %u; n = %u\n", info -> m, info -> n);
-    }
-  }
-
-  /*  Send the initial probabilities in *current* for p(w1|z), p(w2|z), and p(z) to all processes  */
-  distributeProbs (info);
-
   time (&loop_start);
+  loop_mallocs = callsWMalloc ();
   while (true) {
+    if ((info -> iter == 0) && (info -> snapshot != UINT_MAX)) {
+      printCoProb (info);
+    }
+
+    /*  The held-out pairs are evaluated with *current*, which is the model
+    **  whose likelihood is found in this iteration  */
+    checked = (info -> holdout > 0.0) && (info -> iter % info -> holdout_every == 0);
+    if (checked) {
+      waitProbs (info);
+      if ((info -> world_id == MAINPROC) || (info -> decompose == DECOMPOSE_ROWS)) {
+        held_ML = heldOutML (info);
+      }
+      held_ML = gatherML (info, held_ML);
+
+      /*  Stop once the held-out likelihood has not improved for
+      **  holdout_patience evaluations in a row, as it may go down for a
+      **  while before going up again; with tempered EM, lower beta first
+      **  (for the steps of this iteration), and stop if that does not help
+      **  for as long  */
+      if (info -> world_id == MAINPROC) {
+        if (info -> verbose) {
+          fprintf (stderr, "[%3u]  Held-out = %f\t[beta = %.4f]\n", info -> iter, held_ML, info -> beta);
+        }
+        if (held_ML > best_held) {
+          best_held = held_ML;
+          best_step = loop_count;
+          improved = true;
+          misses = 0;
+        }
+        else if (++misses >= info -> holdout_patience) {
+          if ((info -> tempered > 0.0) && (improved)) {
+            info -> beta *= info -> tempered;
+            improved = false;
+            misses = 0;
+          }
+          else {
+            stop_held = true;
+          }
+        }
+      }
 #if HAVE_MPI
-    /*  Create a barrier at each iteration start */
-    MPI_Barrier (MPI_COMM_WORLD);
+      MPI_Bcast (&best_step, 1, MPI_UNSIGNED, MAINPROC, MPI_COMM_WORLD);
+      if (info -> tempered > 0.0) {
+        MPI_Bcast (&(info -> beta), 1, MPI_TYPE, MAINPROC, MPI_COMM_WORLD);
+      }
 #endif
 
-    /*  Calculate p(w1, w2) using *current*  */
-    calculateProbW1W2 (info);
-    if (info -> world_id == MAINPROC) {
-      /*  Calculate the log likelihood  */
-      curr_ML = calculateML (info);
+      /*  Keep the best model so far, to go back to it at the end  */
+      if (best_step == loop_count) {
+        copyCurrent (info, best_probw1_z, best_probw2_z, best_probz, false);
+      }
+    }
+
+    fused = can_fuse && (info -> iter < info -> maxiter) && (info -> beta == 1.0);
+    if (fused) {
+      /*  *current* becomes *previous* and is overwritten by the steps  */
+      swapPrevCurr (info);
+      if (info -> linear) {
+        curr_ML = applyEMStepLinearFused (info);
+      }
+      else {
+        curr_ML = applyEMStepFused (info);
+      }
+    }
+    else {
+      /*  Calculate p(w1, w2) using *current*  */
+      if (info -> linear) {
+        calculateProbW1W2Linear (info);
+      }
+      else {
+        calculateProbW1W2 (info);
+      }
+      if ((info -> world_id == MAINPROC) || (info -> decompose == DECOMPOSE_ROWS)) {
+        /*  Calculate the log likelihood  */
+        curr_ML = calculateML (info);
+      }
+    }
+    curr_ML = gatherML (info, curr_ML);
 
+    if (info -> world_id == MAINPROC) {
+      if ((checked) && (best_step == loop_count)) {
+        best_ML = curr_ML;
+      }
       if (info -> iter == 0) {
         if (info -> verbose) {
           fprintf (stderr, "[---]  Initial = %f\n", curr_ML);
         }
-        if (info -> snapshot != UINT_MAX) {
-          printCoProb (info);
-        }
       }
       else {
         diff = (curr_ML - prev_ML) / prev_ML * 100 * -1;
         if (info -> verbose) {
           fprintf (stderr, "[%3u]  %f --> %f\t[%f, %2.4f %%]\n", info -> iter, prev_ML, curr_ML, (curr_ML - prev_ML), diff);
         }
-        if ((curr_ML < prev_ML) || (DBL_LESS (fabs (diff), ML_DELTA))) {
+        if (((curr_ML < prev_ML) && (info -> tempered == 0.0)) || (DBL_LESS (fabs (diff), ML_DELTA))) {
           info -> iter = UINT_MAX;  /*  Set an indicator to leave loop  */
         }
       }
 
+      /*  One of several models trained at once stops if it falls behind  */
+      if ((info -> race != NULL) && (!keepRestart (info, loop_count, curr_ML))) {
+        info -> iter = UINT_MAX;
+      }
+
       prev_ML = curr_ML;
 
 #if DEBUG
+      /*  When fused, *current* is not normalized yet  */
+      if (!fused) {
+        waitProbs (info);
         checkCoProb (info);
+      }
 #endif
 
       if (info ->  iter != UINT_MAX) {
         info -> iter++;
       }
 
-      if (info -> iter > (info -> maxiter)) {
+      if ((info -> iter > (info -> maxiter)) || (stop_held)) {
         info -> iter = UINT_MAX;  /*  Set an indicator to leave loop  */
       }
     }
 
 #if HAVE_MPI
     /*  Broadcast the iteration number to all processes  */
-    error_code = MPI_Bcast (&(info -> iter), 1, MPI_TYPE, MAINPROC, MPI_COMM_WORLD);
+    error_code = MPI_Bcast (&(info -> iter), 1, MPI_UNSIGNED, MAINPROC, MPI_COMM_WORLD);
     if (error_code != MPI_SUCCESS) {
       fprintf (stderr, "Broadcast iteration from %u result:  %d.\n", info -> world_id, error_code);
     }
-
-    /*  Broadcast p(i,j) from main to all other processes  */
-    error_code = MPI_Bcast (info -> prob_w1w2, (info -> m * info -> n), MPI_TYPE, MAINPROC, MPI_COMM_WORLD);
-    if (error_code != MPI_SUCCESS) {
-      fprintf (stderr, "Second broadcast p(x,y) from %u result:  %d.\n", info -> world_id, error_code);
-    }
 #endif
 
     /*  Check if we are suppose to exit this loop  */
     if (info -> iter == UINT_MAX) {
+      /*  Discard the last steps; the final model is the one last evaluated  */
+      if (fused) {
+        swapPrevCurr (info);
+      }
       break;
     }
 
-    /*  Swap the previous with current; *previous* is used to overwrite *current*  */
-    swapPrevCurr (info);
+    if (!fused) {
+      /*  p(w1,w2) of the tempered probabilities is the denominator of the
+      **  E-step; the block of *current* may still be being sent to the other
+      **  processes (see gatherProbs), which must not see it tempered  */
+      if (info -> beta != 1.0) {
+        waitProbs (info);
+        temperProbs (info);
+        if (info -> linear) {
+          calculateProbW1W2Linear (info);
+        }
+        else {
+          calculateProbW1W2 (info);
+        }
+      }
 
-    /*  Calculate E- and M-steps together; place results in *current*  */
-    applyEMStep (info);
+      /*  Swap the previous with current; *previous* is used to overwrite *current*  */
+      swapPrevCurr (info);
 
-    /*  Transmit *current* to MAINPROC  */
-    gatherProbs (info);
+      /*  Calculate E- and M-steps together; place results in *current*  */
+      if (info -> linear) {
+        applyEMStepLinear (info);
+      }
+      else {
+        applyEMStep (info);
+      }
+    }
 
-    /*  MAINPROC normalizes probabilities in *current*; and decide if a temporary snapshot should be printed  */
-    if (info -> world_id == MAINPROC) {
+    /*  Each process normalizes its clusters of *current* and exchanges them
+    **  with all others, or with the rows divided, adds its sums to those of
+    **  all others and then normalizes; finally p(z) is normalized over all
+    **  clusters  */
+    if (info -> decompose == DECOMPOSE_CLUSTERS) {
       normalizeProbs (info);
-      /*  If snapshots are required, then print it out if this is the first iteration OR
-      **  this iteration is a multiple of (info -> snapshot)  */
-      if ((info -> snapshot != UINT_MAX) &&
-          ((info -> iter % info -> snapshot == 0) || (info -> iter == 1))) {
-        if (!info -> no_output) {
-          printCoProb (info);
-        }
+      gatherProbs (info);
+    }
+    else {
+      gatherProbs (info);
+      normalizeProbs (info);
+    }
+    normalizeProbZ (info);
+
+    /*  If snapshots are required, then print it out if this is the first iteration OR
+    **  this iteration is a multiple of (info -> snapshot)  */
+    if ((info -> snapshot != UINT_MAX) &&
+        ((info -> iter % info -> snapshot == 0) || (info -> iter == 1))) {
+      if (!info -> no_output) {
+        printCoProb (info);
       }
     }
 
-    distributeProbs (info);
+    loop_count++;
   }
   time (&loop_end);
   timediff += difftime (loop_end, loop_start);
+  loop_mallocs = callsWMalloc () - loop_mallocs;
+  info -> iterations = loop_count;
+  info -> likelihood = curr_ML;
+  loop_count++;
+
+  /*  The held-out likelihood of the final model; if the best model so far
+  **  did better (as it did if the held-out pairs stopped the loop), go back
+  **  to it  */
+  if (info -> holdout > 0.0) {
+    waitProbs (info);
+    held_ML = 0.0;
+    if ((info -> world_id == MAINPROC) || (info -> decompose == DECOMPOSE_ROWS)) {
+      held_ML = heldOutML (info);
+    }
+    held_ML = gatherML (info, held_ML);
+    info -> held_likelihood = held_ML;
+    if ((info -> world_id == MAINPROC) && (held_ML >= best_held)) {
+      best_step = UINT_MAX;
+    }
+#if HAVE_MPI
+    MPI_Bcast (&best_step, 1, MPI_UNSIGNED, MAINPROC, MPI_COMM_WORLD);
+#endif
+    if (best_step != UINT_MAX) {
+      copyCurrent (info, best_probw1_z, best_probw2_z, best_probz, true);
+      info -> iterations = best_step;
+      info -> likelihood = best_ML;
+      info -> held_likelihood = best_held;
+    }
+
+    if ((info -> verbose) && (info -> world_id == MAINPROC)) {
+      fprintf (stderr, "==\tHeld-out log likelihood:                        %f (model after %u steps%s)\n", info -> held_likelihood, info -> iterations, (best_step != UINT_MAX) ? ", restored" : "");
+      if (info -> tempered > 0.0) {
+        fprintf (stderr, "==\tFinal beta:                                     %.4f\n", info -> beta);
+      }
+    }
+
+    wfree (best_probw1_z);
+    wfree (best_probw2_z);
+    wfree (best_probz);
+  }
+
+  if (info -> verbose) {
+    fprintf (stderr, "==\t  Allocations per iteration:                    %.2f\n", (double) loop_mallocs / loop_count);
+  }
 
   if (info -> maxiter == 1) {
     fprintf (stderr, "==\t  Main loop [one iteration only!]:             %6.2f %% (%f)\n", 0.0, timediff);
   }
 
-  /*  Only MAINPROC prints  */
-  if (info -> world_id == MAINPROC) {
-    if (!info -> no_output) {
-      printCoProb (info);
+  return;
+}
+
+
+bool run (INFO *info) {
+  time_t start;
+  time_t end;
+
+  time (&start);
+
+  /*  All processes read in co-occurrence data  */
+  if (!readCO (info)) {
+    /*  If there is an error, all processes are terminated  */
+    fprintf (stderr, "Error reading co-occurrence data by processor %u.\n", info -> world_id);
+#if HAVE_MPI
+    MPI_Abort (MPI_COMM_WORLD, 0);
+#endif
+    return false;
+  }
+
+  initWorkspace (info);
+  initComm (info);
+  initSnapshot (info);
+
+  /*  Only MAINPROC initializes to ensure the random seed only affects it,
+  **  unless the rows are divided:  every process then draws the same values
+  **  and keeps those of its rows  */
+  if ((info -> world_id == MAINPROC) || (info -> decompose == DECOMPOSE_ROWS)) {
+    /*  Initial probabilties placed in *current*  */
+    initEM (info);
+    if ((info -> verbose) && (info -> world_id == MAINPROC)) {
+      fprintf (stderr, "==\tm = %u; n = %u\n", info -> m_global, info -> n);
     }
   }
 
+  /*  Send the initial probabilities in *current* for p(w1|z), p(w2|z), and p(z) to all processes  */
+  distributeProbs (info);
+
+  iterate (info);
+
+  if (!info -> no_output) {
+    printCoProb (info);
+  }
+  if (info -> model_output) {
+    printModel (info);
+  }
+
+  freeSnapshot (info);
+  freeComm (info);
+  freeWorkspace (info);
+  freeSharedCO (info);
+
   time (&end);
   info -> run_time += difftime (end, start);
 
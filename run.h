@@ -21,6 +21,7 @@
 
 INFO *initialize ();
 void uninitialize (INFO *info);
+void iterate (INFO *info);
 bool run (INFO *info);
 
 #endif
@@ -0,0 +1,315 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Co-occurrence files read a batch of rows at a time, without holding
+**  the whole matrix:  the legacy binary and text formats are read in
+**  order (also from the standard input, as "-"), and version 2 files are
+**  read with pread from their sections.  Used by fold-in and online EM.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>  /*  pread  */
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "cofile.h"
+#include "stream.h"
+
+
+/*!  Read size bytes at offset of the file, or exit  */
+static void readAt (STREAM *stream, void *data, size_t size, off_t offset) {
+  ssize_t done;
+
+  while (size > 0) {
+    done = pread (fileno (stream -> fp), data, size, offset);
+    if (done <= 0) {
+      fprintf (stderr, "Co-occurrence file %s is truncated.\n", stream -> fn);
+      exit (EXIT_FAILURE);
+    }
+    data = (char *) data + done;
+    size -= done;
+    offset += done;
+  }
+
+  return;
+}
+
+
+/*!  Read the next value of a legacy or text file, or exit  */
+static unsigned int readValue (STREAM *stream) {
+  unsigned int value = 0;
+  int c;
+
+  if (!stream -> textio) {
+    if (fread (&value, sizeof (unsigned int), 1, stream -> fp) != 1) {
+      fprintf (stderr, "Co-occurrence file %s ends early.\n", stream -> fn);
+      exit (EXIT_FAILURE);
+    }
+    return (value);
+  }
+
+  do {
+    c = getc (stream -> fp);
+  } while ((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r'));
+  if ((c < '0') || (c > '9')) {
+    fprintf (stderr, "Co-occurrence file %s %s.\n", stream -> fn, (c == EOF) ? "ends early" : "has a character that is not part of a number");
+    exit (EXIT_FAILURE);
+  }
+  while ((c >= '0') && (c <= '9')) {
+    value = value * 10 + (unsigned int) (c - '0');
+    c = getc (stream -> fp);
+  }
+  (void) ungetc (c, stream -> fp);
+
+  return (value);
+}
+
+
+/*!  Open the co-occurrence file and read its sizes and ids; each column
+**  is its own at first  */
+void openStream (INFO *info, STREAM *stream) {
+  COFILEHEADER header;
+  unsigned int sizes[2];
+  unsigned int i;
+
+  stream -> fn = info -> co_fn;
+  stream -> textio = info -> textio;
+  stream -> v2 = false;
+  stream -> next_row = 0;
+  stream -> ignored = 0;
+  if (strcmp (info -> co_fn, "-") == 0) {
+    stream -> fp = stdin;
+  }
+  else {
+    FOPEN (info -> co_fn, stream -> fp, "rb");
+
+    /*  A version 2 file is read as such even with --text  */
+    if ((stream -> textio) && (fread (&header, COFILE_MAGIC_LEN, 1, stream -> fp) == 1) && (cofileIsHeader (&header, sizeof (COFILEHEADER)))) {
+      stream -> textio = false;
+    }
+    rewind (stream -> fp);
+  }
+
+  if (stream -> textio) {
+    stream -> m = readValue (stream);
+    stream -> n = readValue (stream);
+  }
+  else {
+    /*  A legacy file starts with the number of rows and columns instead of the magic bytes  */
+    if (fread (&header, COFILE_MAGIC_LEN, 1, stream -> fp) != 1) {
+      fprintf (stderr, "Co-occurrence file %s ends early.\n", stream -> fn);
+      exit (EXIT_FAILURE);
+    }
+    if (cofileIsHeader (&header, sizeof (COFILEHEADER))) {
+      if (stream -> fp == stdin) {
+        fprintf (stderr, "A version 2 co-occurrence file cannot be read from the standard input.\n");
+        exit (EXIT_FAILURE);
+      }
+      stream -> v2 = true;
+      readAt (stream, &header, sizeof (COFILEHEADER), 0);
+      cofileLayout (&header, &(stream -> layout));
+      stream -> m = header.m;
+      stream -> n = header.n;
+    }
+    else {
+      memcpy (sizes, &header, sizeof (sizes));
+      stream -> m = sizes[0];
+      stream -> n = sizes[1];
+    }
+  }
+
+  stream -> row_ids = wmalloc (stream -> m * sizeof (unsigned int) + 1);
+  stream -> column_ids = wmalloc (stream -> n * sizeof (unsigned int) + 1);
+  stream -> columns = wmalloc (stream -> n * sizeof (uint32_t) + 1);
+  if (stream -> v2) {
+    readAt (stream, stream -> row_ids, stream -> m * sizeof (unsigned int), stream -> layout.row_ids);
+    readAt (stream, stream -> column_ids, stream -> n * sizeof (unsigned int), stream -> layout.column_ids);
+  }
+  else {
+    for (i = 0; i < stream -> m; i++) {
+      stream -> row_ids[i] = readValue (stream);
+    }
+    for (i = 0; i < stream -> n; i++) {
+      stream -> column_ids[i] = readValue (stream);
+    }
+    stream -> data_start = (stream -> fp == stdin) ? 0 : ftello (stream -> fp);
+  }
+  for (i = 0; i < stream -> n; i++) {
+    stream -> columns[i] = i;
+  }
+
+  return;
+}
+
+
+/*!  Go back to the first row; not possible with the standard input  */
+bool rewindStream (STREAM *stream) {
+  if (stream -> fp == stdin) {
+    return false;
+  }
+  if ((!stream -> v2) && (fseeko (stream -> fp, stream -> data_start, SEEK_SET) != 0)) {
+    return false;
+  }
+  stream -> next_row = 0;
+
+  return true;
+}
+
+
+void closeStream (STREAM *stream) {
+  if (stream -> fp != stdin) {
+    FCLOSE (stream -> fp);
+  }
+  wfree (stream -> row_ids);
+  wfree (stream -> column_ids);
+  wfree (stream -> columns);
+
+  return;
+}
+
+
+/*!  Allocate a batch of at most size rows, with room for the results of
+**  k latent states per row  */
+void initStreamBatch (STREAMBATCH *batch, unsigned int size, unsigned int k) {
+  batch -> size = size;
+  batch -> rows = 0;
+  batch -> first = 0;
+  batch -> capacity = size + 1;
+  batch -> starts = wmalloc ((size + 1) * sizeof (size_t));
+  batch -> columns = wmalloc (batch -> capacity * sizeof (unsigned int));
+  batch -> counts = wmalloc (batch -> capacity * sizeof (double));
+  batch -> topics = wmalloc ((size_t) size * k * sizeof (PROBNODE) + 1);
+
+  return;
+}
+
+
+void freeStreamBatch (STREAMBATCH *batch) {
+  wfree (batch -> starts);
+  wfree (batch -> columns);
+  wfree (batch -> counts);
+  wfree (batch -> topics);
+
+  return;
+}
+
+
+/*!  Make room for count pairs in the batch  */
+static void growBatch (STREAMBATCH *batch, size_t count) {
+  if (count <= batch -> capacity) {
+    return;
+  }
+  while (batch -> capacity < count) {
+    batch -> capacity *= 2;
+  }
+  batch -> columns = wrealloc (batch -> columns, batch -> capacity * sizeof (unsigned int));
+  batch -> counts = wrealloc (batch -> counts, batch -> capacity * sizeof (double));
+
+  return;
+}
+
+
+/*!  Read the next batch of rows (at most the size of the batch), keeping
+**  the pairs whose columns are kept  */
+void readStream (STREAM *stream, STREAMBATCH *batch) {
+  uint64_t *offsets;
+  uint32_t *columns;
+  uint32_t *counts;
+  size_t pos = 0;
+  size_t pair;
+  size_t pairs;
+  unsigned int count;
+  unsigned int column;
+  unsigned int freq;
+  unsigned int i;
+  unsigned int j;
+
+  batch -> rows = stream -> m - stream -> next_row;
+  if (batch -> rows > batch -> size) {
+    batch -> rows = batch -> size;
+  }
+  batch -> first = stream -> next_row;
+  batch -> starts[0] = 0;
+
+  if (stream -> v2) {
+    /*  The pairs of the batch are together in each section  */
+    offsets = wmalloc ((batch -> rows + 1) * sizeof (uint64_t));
+    readAt (stream, offsets, (batch -> rows + 1) * sizeof (uint64_t), stream -> layout.row_offsets + (off_t) stream -> next_row * sizeof (uint64_t));
+    pairs = offsets[batch -> rows] - offsets[0];
+    columns = wmalloc (pairs * sizeof (uint32_t) + 1);
+    counts = wmalloc (pairs * sizeof (uint32_t) + 1);
+    readAt (stream, columns, pairs * sizeof (uint32_t), stream -> layout.columns + offsets[0] * sizeof (uint32_t));
+    readAt (stream, counts, pairs * sizeof (uint32_t), stream -> layout.counts + offsets[0] * sizeof (uint32_t));
+    growBatch (batch, pairs);
+    for (i = 0; i < batch -> rows; i++) {
+      for (pair = offsets[i] - offsets[0]; pair < offsets[i + 1] - offsets[0]; pair++) {
+        if (columns[pair] >= stream -> n) {
+          fprintf (stderr, "Word 2 (%u) is out of range (%u).\n", columns[pair], stream -> n);
+          exit (EXIT_FAILURE);
+        }
+        column = stream -> columns[columns[pair]];
+        if (column == UINT32_MAX) {
+          stream -> ignored++;
+        }
+        else if (counts[pair] != 0) {
+          batch -> columns[pos] = column;
+          batch -> counts[pos] = counts[pair];
+          pos++;
+        }
+      }
+      batch -> starts[i + 1] = pos;
+    }
+    wfree (offsets);
+    wfree (columns);
+    wfree (counts);
+  }
+  else {
+    /*  [w1 cos_count (w2 c) ...]  */
+    for (i = 0; i < batch -> rows; i++) {
+      (void) readValue (stream);
+      count = readValue (stream);
+      growBatch (batch, pos + count);
+      for (j = 0; j < count; j++) {
+        column = readValue (stream);
+        freq = readValue (stream);
+        if (column >= stream -> n) {
+          fprintf (stderr, "Word 2 (%u) is out of range (%u).\n", column, stream -> n);
+          exit (EXIT_FAILURE);
+        }
+        column = stream -> columns[column];
+        if (column == UINT32_MAX) {
+          stream -> ignored++;
+        }
+        else if (freq != 0) {
+          batch -> columns[pos] = column;
+          batch -> counts[pos] = freq;
+          pos++;
+        }
+      }
+      batch -> starts[i + 1] = pos;
+    }
+  }
+  stream -> next_row += batch -> rows;
+
+  return;
+}
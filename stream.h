@@ -0,0 +1,73 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cofile.h"
+
+/*!  A co-occurrence file that is read a batch of rows at a time  */
+typedef struct stream {
+  FILE *fp;
+  char *fn;
+  bool textio;
+  /*!  A version 2 file, whose sections are read with pread  */
+  bool v2;
+  COFILELAYOUT layout;
+  /*!  Position of the first row in a legacy or text file  */
+  off_t data_start;
+  unsigned int m;
+  unsigned int n;
+  unsigned int *row_ids;
+  unsigned int *column_ids;
+  /*!  Column each column of the file is kept as; UINT32_MAX if it is left out  */
+  uint32_t *columns;
+  /*!  Index of the next row to read  */
+  unsigned int next_row;
+  /*!  Number of pairs left out because of their column  */
+  size_t ignored;
+} STREAM;
+
+/*!  A batch of rows:  their pairs, by the columns they are kept as, and their results  */
+typedef struct streambatch {
+  /*!  Most rows of a batch  */
+  unsigned int size;
+  unsigned int rows;
+  /*!  Index of the first row in the file  */
+  unsigned int first;
+  /*!  First pair of each row (rows + 1 of them)  */
+  size_t *starts;
+  unsigned int *columns;
+  double *counts;
+  /*!  Number of pairs allocated  */
+  size_t capacity;
+  /*!  log p(z|w1) of each row (rows x k)  */
+  PROBNODE *topics;
+} STREAMBATCH;
+
+void openStream (INFO *info, STREAM *stream);
+bool rewindStream (STREAM *stream);
+void closeStream (STREAM *stream);
+void initStreamBatch (STREAMBATCH *batch, unsigned int size, unsigned int k);
+void freeStreamBatch (STREAMBATCH *batch);
+void readStream (STREAM *stream, STREAMBATCH *batch);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+**  Probabilistic latent semantic analysis (PLSA, multiprocessor version)
+**  Copyright (C) 2009-2010  by Raymond Wan (r.wan@aist.go.jp)
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+**  Placement of the processes and threads on the processors of each
+**  computer.  The MPI processes on the same computer divide its processors
+**  among themselves, unless the MPI launcher has already bound them to
+**  different processors.  With --pin, each thread is then kept on one of
+**  the processors of its process (Linux only).
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "PLSA_MP_Config.h"
+#if HAVE_MPI
+#include <mpi.h>
+#endif
+
+#if HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "wmalloc.h"
+#include "plsa-defn.h"
+#include "topology.h"
+
+#if HAVE_OPENMP && defined (__linux__)
+/*!  Processors of this process, in order  */
+static int *cpus = NULL;
+static unsigned int num_cpus = 0;
+#endif
+
+
+/*!  Find the processes on the same computer (node_id and node_size) and
+**  set the number of threads to this process's share of the processors  */
+void initTopology (INFO *info) {
+#if HAVE_MPI
+  MPI_Comm node_comm;
+#endif
+#if HAVE_OPENMP && defined (__linux__)
+  bool shared = true;  /*  Do the processes of this computer have the same processors?  */
+  cpu_set_t mask;
+  unsigned int first;
+  unsigned int last;
+  unsigned int seen;
+  unsigned int c;
+#endif
+#if HAVE_OPENMP && defined (__linux__) && HAVE_MPI
+  cpu_set_t *masks;
+  signed int r;
+#endif
+
+  info -> node_id = 0;
+  info -> node_size = 1;
+
+#if HAVE_MPI
+  MPI_Comm_split_type (MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, info -> world_id, MPI_INFO_NULL, &node_comm);
+  MPI_Comm_rank (node_comm, &(info -> node_id));
+  MPI_Comm_size (node_comm, &(info -> node_size));
+#endif
+
+#if HAVE_OPENMP
+#if defined (__linux__)
+  CPU_ZERO (&mask);
+  (void) sched_getaffinity (0, sizeof (cpu_set_t), &mask);
+
+#if HAVE_MPI
+  /*  A launcher that binds processes gives them different processors,
+  **  which are then used as they are  */
+  masks = wmalloc (info -> node_size * sizeof (cpu_set_t));
+  MPI_Allgather (&mask, sizeof (cpu_set_t), MPI_BYTE, masks, sizeof (cpu_set_t), MPI_BYTE, node_comm);
+  for (r = 0; r < info -> node_size; r++) {
+    if (!CPU_EQUAL (&mask, &(masks[r]))) {
+      shared = false;
+    }
+  }
+  wfree (masks);
+#endif
+
+  num_cpus = CPU_COUNT (&mask);
+  cpus = wmalloc ((num_cpus + 1) * sizeof (int));
+  first = 0;
+  last = num_cpus;
+  if ((shared) && (info -> node_size > 1) && (num_cpus >= info -> node_size)) {
+    first = BLOCK_LOW (info -> node_id, info -> node_size, num_cpus);
+    last = BLOCK_LOW (info -> node_id + 1, info -> node_size, num_cpus);
+  }
+  num_cpus = 0;
+  seen = 0;
+  for (c = 0; (c < CPU_SETSIZE) && (seen < last); c++) {
+    if (CPU_ISSET (c, &mask)) {
+      if (seen >= first) {
+        cpus[num_cpus] = c;
+        num_cpus++;
+      }
+      seen++;
+    }
+  }
+  info -> threads = num_cpus;
+#else
+  /*  The processors of the processes are unknown, so they are assumed to be the same  */
+  info -> threads = omp_get_num_procs ();
+  if ((info -> node_size > 1) && (info -> threads >= info -> node_size)) {
+    info -> threads = BLOCK_SIZE (info -> node_id, info -> node_size, info -> threads);
+  }
+#endif
+  omp_set_num_threads (info -> threads);
+#endif
+
+#if HAVE_MPI
+  MPI_Comm_free (&node_comm);
+#endif
+
+  return;
+}
+
+
+/*!  Keep each thread on one processor of this process; the threads of
+**  OpenMP are kept for all later parallel regions of the same size  */
+void pinThreads (INFO *info) {
+#if HAVE_OPENMP && defined (__linux__)
+  unsigned int pinned = 0;
+
+  if (num_cpus == 0) {
+    return;
+  }
+
+#pragma omp parallel reduction(+:pinned)
+  {
+    cpu_set_t mask;
+
+    CPU_ZERO (&mask);
+    CPU_SET (cpus[omp_get_thread_num () % num_cpus], &mask);
+    if (sched_setaffinity (0, sizeof (cpu_set_t), &mask) == 0) {
+      pinned++;
+    }
+  }
+
+  if (info -> verbose) {
+    fprintf (stderr, "==\tID %u pinned threads:                            %u of %u\n", info -> world_id, pinned, info -> threads);
+  }
+#else
+  if (info -> world_id == MAINPROC) {
+    fprintf (stderr, "==\tWarning:  Threads can only be pinned under Linux with OpenMP; --pin ignored.\n");
+  }
+#endif
+
+  return;
+}
+
+
+void freeTopology (INFO *info) {
+#if HAVE_OPENMP && defined (__linux__)
+  if (cpus != NULL) {
+    wfree (cpus);
+    cpus = NULL;
+  }
+#endif
+
+  return;
+}
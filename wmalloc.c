@@ -19,16 +19,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
+#include "PLSA_MP_Config.h"
 #include "wmalloc.h"
 
 static unsigned int inuse_malloc = 0;
 static unsigned int max_malloc = 0;
+static unsigned long calls_malloc = 0;
+/*  Are the calls of this thread counted in calls_malloc?  */
+#if HAVE_PTHREADS
+static __thread bool counted = true;
+#else
+static bool counted = true;
+#endif
 static WMSTRUCT **wm_array;
 static char *tempstr;
 
 void *wmalloc (size_t y_arg) {
   void *x_arg = malloc (y_arg);
+  if (counted) {
+#if HAVE_OPENMP
+#pragma omp atomic
+#endif
+    calls_malloc++;
+  }
   if (x_arg == NULL) {
     fprintf (stderr, "Error in malloc while allocating %u bytes in [%s, %u].\n", (unsigned int) y_arg, __FILE__, __LINE__);
     exit (EXIT_FAILURE);
@@ -42,6 +57,12 @@ void *wmalloc (size_t y_arg) {
 
 
 void *wrealloc (void *x_arg, size_t y_arg) {
+  if (counted) {
+#if HAVE_OPENMP
+#pragma omp atomic
+#endif
+    calls_malloc++;
+  }
 #ifdef COUNT_MALLOC
   countFree ((void*) x_arg);
 #endif
@@ -65,6 +86,17 @@ void wfree (void *x_arg) {
   free (x_arg);
 }
 
+/*  Number of calls to wmalloc and wrealloc so far  */
+unsigned long callsWMalloc (void) {
+  return (calls_malloc);
+}
+
+/*  Leave the calls of this thread out of callsWMalloc (or count them
+**  again), for work done in the background of the loop being counted  */
+void countWMallocCalls (bool count) {
+  counted = count;
+}
+
 /*  Function adapted from Algorithms in C (Third edition) by Robert Sedgewick
 **  (page 578) */
 static unsigned int hash (char *v, signed int M) {
@@ -19,6 +19,8 @@
 #ifndef WMALLOC_H
 #define WMALLOC_H
 
+#include <stdbool.h>
+
 #define WM_SIZE 65536
 #define TEMPSTRLEN 80
 
@@ -33,6 +35,8 @@ typedef struct wmstruct {
 void *wmalloc (size_t y_arg);
 void *wrealloc (void *x_arg, size_t y_arg);
 void wfree (void *x_arg);
+unsigned long callsWMalloc (void);
+void countWMallocCalls (bool count);
 
 void initWMalloc (void);
 void printWMalloc (void);